@@ -12,9 +12,9 @@ char * String_Create(const char * stringWithFormat, ...) {
 
     // Make a copy of our formatted string to work with
     if (stringWithFormat != NULL) {
-        fmt = strdup(stringWithFormat);
+        fmt = mem_strdup(MEM_STRINGS, stringWithFormat);
     } else {
-        fmt = strdup("");
+        fmt = mem_strdup(MEM_STRINGS, "");
     }
 
     // Now apply the formatting on a trial run to determine how long the formatted string should be
@@ -28,7 +28,7 @@ char * String_Create(const char * stringWithFormat, ...) {
     va_end(argp);
 
     // Allocate enough memory, and generate the formatted string for reals
-    str = calloc(len + 1, sizeof(char));
+    str = mem_calloc(MEM_STRINGS, len + 1, sizeof(char));
     if (!str) {
         return NULL;
     }
@@ -36,7 +36,28 @@ char * String_Create(const char * stringWithFormat, ...) {
     vsnprintf(str, len + 1, fmt, argp);
     va_end(argp);
 
-    free(fmt);
+    mem_free(fmt);
+
+    return str;
+}
+
+char * String_Frame(const char * stringWithFormat, ...) {
+    // Like String_Create, but the string is made in the frame's scratch 
+    // memory - it goes away by itself once the frame's drawn, so there's 
+    // nothing to destroy (and nothing to keep hold of, either)
+    va_list argp;
+    va_start(argp, stringWithFormat);
+    char one_char[1];
+    int len = vsnprintf(one_char, 1, stringWithFormat, argp);
+    va_end(argp);
+    if (len < 0) {
+        len = 0;
+    }
+
+    char *str = mem_arena_alloc(&frameArena, len + 1);
+    va_start(argp, stringWithFormat);
+    vsnprintf(str, len + 1, stringWithFormat, argp);
+    va_end(argp);
 
     return str;
 }
@@ -47,9 +68,9 @@ char * String_Append(char *string, const char * stringWithFormat, ...) {
 
     // Make a copy of our formatted string to work with
     if (stringWithFormat != NULL) {
-        fmt = strdup(stringWithFormat);
+        fmt = mem_strdup(MEM_STRINGS, stringWithFormat);
     } else {
-        fmt = strdup("");
+        fmt = mem_strdup(MEM_STRINGS, "");
     }
 
     // Now apply the formatting on a trial run to determine how long the formatted string should be
@@ -63,7 +84,7 @@ char * String_Append(char *string, const char * stringWithFormat, ...) {
     va_end(argp);
 
     // Allocate enough memory, and generate the formatted string for reals
-    stringToAppend = calloc(len + 1, sizeof(char));
+    stringToAppend = mem_calloc(MEM_STRINGS, len + 1, sizeof(char));
     if (!stringToAppend) {
         stringToAppend = "";
     }
@@ -71,11 +92,11 @@ char * String_Append(char *string, const char * stringWithFormat, ...) {
     vsnprintf(stringToAppend, len + 1, fmt, argp);
     va_end(argp);
 
-    free(fmt);
+    mem_free(fmt);
 
     // Allocate enough memory and concatenate the two strings
     int32_t totalLength = strlen(string) + strlen(stringToAppend) + 1;
-    char *combinedString = calloc(totalLength, sizeof(char));
+    char *combinedString = mem_calloc(MEM_STRINGS, totalLength, sizeof(char));
     strcpy(combinedString, string);
     strcat(combinedString, stringToAppend);
 
@@ -83,7 +104,7 @@ char * String_Append(char *string, const char * stringWithFormat, ...) {
 }
 
 void String_Destroy(char *string) {
-    free(string);
+    mem_free(string);
 }
 
 char * String_Substring (int32_t startIndex, uint32_t len);
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 char * String_Create(const char * stringWithFormat, ...);
+char * String_Frame(const char * stringWithFormat, ...);
 char * String_Append(char *string, const char * stringWithFormat, ...);
 void String_Destroy(char *string);
 
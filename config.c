@@ -9,109 +9,299 @@ Key=Value
  .
  .
  .
+# Lines starting with a '#' are comments
 */
 
-#define CONFIG_MAX_LINE_LEN	256
+#define CONFIG_INDEX_SIZE		32		// Key slots in each entity's index (a power of 2)
+#define CONFIG_INDEX_MAX_KEYS	24		// Entities with more keys than this are searched in order
 
 typedef struct {
-	char *key;
+	char *key;				// Interned - every pair with the same key shares one string
 	char *value;
+	u32 hash;
+	i32 line;				// Where it was in the file (0 if it was added after parsing)
 } ConfigKeyValuePair;
 
 typedef struct {
 	char *name;
-	List *keyValuePairs;
+	ConfigKeyValuePair *pairs;
+	i32 pairCount;
+	i32 pairCapacity;		// 0 while the pairs are in the config's block
+	bool indexed;
+	u8 index[CONFIG_INDEX_SIZE];		// Pair number + 1 for each hash slot, 0 if the slot is empty
 } ConfigEntity;
 
 typedef struct {
 	List *entities;
+	void *block;			// The file text, entities and pairs, in one allocation
+	size_t blockSize;
+	char *filename;			// Also in the block
+	i32 errorCount;
 } Config;
 
 
-// Parse the given config file into an in-memory representation
-Config * config_file_parse(char * filename) {
-	Config *cfg = NULL;
+internal u32 
+config_hash(char *s) {
+	// FNV-1a
+	u32 hash = 2166136261u;
+	while (*s) {
+		hash = (hash ^ (u8)*s++) * 16777619u;
+	}
+	return hash;
+}
+
+internal void 
+config_index_add(ConfigEntity *entity, i32 pairNumber) {
+	// Add a pair to the entity's key index. If a key's in there twice, the 
+	// first one wins, same as a search in order would find.
+	if (!entity->indexed) { return; }
+	if (pairNumber >= CONFIG_INDEX_MAX_KEYS) {
+		entity->indexed = false;
+		return;
+	}
+
+	ConfigKeyValuePair *kv = &entity->pairs[pairNumber];
+	u32 slot = kv->hash & (CONFIG_INDEX_SIZE - 1);
+	while (entity->index[slot] != 0) {
+		ConfigKeyValuePair *other = &entity->pairs[entity->index[slot] - 1];
+		if (other->key == kv->key) { return; }
+		slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+	}
+	entity->index[slot] = (u8)(pairNumber + 1);
+}
 
-	// Open config file
+internal void 
+config_error(Config *cfg, char *filename, i32 line, i32 column, char *message) {
+	fprintf(stderr, "%s:%d:%d: %s\n", filename, line, column, message);
+	cfg->errorCount += 1;
+}
+
+
+// Parse the given config file into an in-memory representation. The whole 
+// file is read in at once and split up where it sits, so the names, keys and 
+// values all point into the one block, and freeing the config is one free.
+Config * config_file_parse(char * filename) {
 	FILE * configFile = fopen(filename, "r");
-	if (configFile) {
-		cfg = (Config *)calloc(1, sizeof(Config));
-		cfg->entities = list_new(free);
-		char buffer[CONFIG_MAX_LINE_LEN];
-
-		ConfigEntity *currentEntity = NULL;
-
-		// Loop through each line of the file
-		while (fgets(buffer, CONFIG_MAX_LINE_LEN, configFile) != NULL) {
-			if (buffer[0] == '[') {
-				// New entity - grab the entity name
-				char *entityName = strtok(buffer, "[]");	// grabs everything between brackets
-
-				// Create a new entity structure
-				ConfigEntity *entity = (ConfigEntity *)calloc(1, sizeof(ConfigEntity));
-				char *copy = calloc(strlen(entityName) + 1, sizeof(char)); 
-				strcpy(copy, entityName);
-				entity->name = copy;
-				entity->keyValuePairs = list_new(free);
+	if (configFile == NULL) {
+		return NULL;
+	}
+	fseek(configFile, 0, SEEK_END);
+	long fileSize = ftell(configFile);
+	fseek(configFile, 0, SEEK_SET);
+	if (fileSize < 0) { fileSize = 0; }
+
+	// Read the file, and count lines so we know the most entities and pairs there can be
+	char *text = mem_malloc(MEM_CONFIG, fileSize + 1);
+	size_t textLength = fread(text, 1, fileSize, configFile);
+	text[textLength] = '\0';
+	fclose(configFile);
+
+	i32 maxEntities = 0;
+	i32 maxPairs = 0;
+	for (size_t i = 0; i < textLength; i++) {
+		bool lineStart = (i == 0) || (text[i-1] == '\n');
+		if (lineStart) {
+			if (text[i] == '[') { maxEntities += 1; } else { maxPairs += 1; }
+		}
+	}
+
+	// Interned keys only need to be looked up while parsing
+	i32 internSize = 16;
+	while (internSize < maxPairs * 2) { internSize *= 2; }
+	char **interned = mem_calloc(MEM_CONFIG, internSize, sizeof(char *));
+
+	size_t entityBytes = maxEntities * sizeof(ConfigEntity);
+	size_t pairBytes = maxPairs * sizeof(ConfigKeyValuePair);
+	size_t blockSize = sizeof(Config) + entityBytes + pairBytes + textLength + 1 + strlen(filename) + 1;
+	u8 *block = mem_calloc(MEM_CONFIG, 1, blockSize);
+	Config *cfg = (Config *)block;
+	ConfigEntity *entities = (ConfigEntity *)(block + sizeof(Config));
+	ConfigKeyValuePair *pairs = (ConfigKeyValuePair *)(block + sizeof(Config) + entityBytes);
+	char *p = (char *)(block + sizeof(Config) + entityBytes + pairBytes);
+	memcpy(p, text, textLength + 1);
+	mem_free(text);
+
+	cfg->block = block;
+	cfg->blockSize = blockSize;
+	cfg->filename = p + textLength + 1;
+	strcpy(cfg->filename, filename);
+	cfg->entities = list_new(NULL);
+	i32 entityCount = 0;
+	i32 pairCount = 0;
+	ConfigEntity *currentEntity = NULL;
+
+	// Loop through each line of the file
+	i32 line = 1;
+	while (*p != '\0') {
+		char *lineStart = p;
+		char *lineEnd = strchr(p, '\n');
+		if (lineEnd == NULL) { lineEnd = p + strlen(p); }
+		char *next = (*lineEnd == '\n') ? lineEnd + 1 : lineEnd;
+		*lineEnd = '\0';
+		if ((lineEnd > lineStart) && (*(lineEnd - 1) == '\r')) {
+			*(lineEnd - 1) = '\0';
+		}
+
+		if (lineStart[0] == '[') {
+			// New entity - grab the entity name, from between the brackets
+			char *close = strchr(lineStart, ']');
+			if (close == NULL) {
+				config_error(cfg, filename, line, (i32)strlen(lineStart) + 1, "expected ']' after entity name");
+				currentEntity = NULL;
+			} else {
+				*close = '\0';
+				ConfigEntity *entity = &entities[entityCount++];
+				entity->name = lineStart + 1;
+				entity->pairs = &pairs[pairCount];
+				entity->indexed = true;
 				list_insert_after(cfg->entities, list_tail(cfg->entities), entity);
 				currentEntity = entity;
+			}
+
+		} else if ((lineStart[0] != '\0') && (lineStart[0] != ' ') && (lineStart[0] != '#')) {
+			// If we have key/value data, split it into its parts and add the pair to the entity.
+			char *equals = strchr(lineStart, '=');
+			if (equals == NULL) {
+				config_error(cfg, filename, line, (i32)strlen(lineStart) + 1, "expected '=' after key");
+			} else if (equals == lineStart) {
+				config_error(cfg, filename, line, 1, "expected a key before '='");
+			} else if (currentEntity == NULL) {
+				config_error(cfg, filename, line, 1, "key/value pair outside of an entity");
+			} else if (*(equals + 1) != '\0') {
+				*equals = '\0';
+				char *key = lineStart;
+				u32 hash = config_hash(key);
 
-			} else if ((buffer[0] != '\n') && (buffer[0] != ' ')) {
-				// If we have key/value data, parse it into its various parts and add the pair to the entity.
-				buffer[CONFIG_MAX_LINE_LEN-1] = '\0';	// Ensure that our buffer string is null-terminated
-				char *key = strtok(buffer, "=");
-				char *value = strtok(NULL, "\n");
-				if ((key != NULL) && (value != NULL)) {
-					ConfigKeyValuePair *kv = (ConfigKeyValuePair *)calloc(1, sizeof(ConfigKeyValuePair));
-					char *copyKey = calloc(strlen(key) + 1, sizeof(char)); 
-					strcpy(copyKey, key);
-					kv->key = copyKey;
-					char *copyValue = calloc(strlen(value) + 1, sizeof(char)); 
-					strcpy(copyValue, value);
-					kv->value = copyValue;
-
-					list_insert_after(currentEntity->keyValuePairs, list_tail(currentEntity->keyValuePairs), kv);					
+				// Intern the key
+				u32 slot = hash & (internSize - 1);
+				while ((interned[slot] != NULL) && (strcmp(interned[slot], key) != 0)) {
+					slot = (slot + 1) & (internSize - 1);
+				}
+				if (interned[slot] == NULL) {
+					interned[slot] = key;
 				}
 
-			} else {
-				// Blank line - just ignore it
+				ConfigKeyValuePair *kv = &pairs[pairCount++];
+				kv->key = interned[slot];
+				kv->value = equals + 1;
+				kv->hash = hash;
+				kv->line = line;
+				currentEntity->pairCount += 1;
+				config_index_add(currentEntity, currentEntity->pairCount - 1);
 			}
+
+		} else {
+			// Blank line or comment - just ignore it
 		}
+
+		p = next;
+		line += 1;
 	}
 
+	mem_free(interned);
 	return cfg;
 }
 
+void config_entity_destroy(Config *cfg, ConfigEntity *entity) {
+	// Entities and pairs added after parsing have their own memory - 
+	// everything else is in the block
+	u8 *block = (u8 *)cfg->block;
+	bool parsed = ((u8 *)entity >= block) && ((u8 *)entity < block + cfg->blockSize);
+	if (!parsed) {
+		for (i32 i = 0; i < entity->pairCount; i++) {
+			mem_free(entity->pairs[i].key);
+			mem_free(entity->pairs[i].value);
+		}
+		mem_free(entity->name);
+	}
+	if (entity->pairCapacity > 0) {
+		mem_free(entity->pairs);
+	}
+	if (!parsed) {
+		mem_free(entity);
+	}
+}
+
+void config_file_destroy(Config *cfg) {
+	ListElement *e = list_head(cfg->entities);
+	while (e != NULL) {
+		config_entity_destroy(cfg, (ConfigEntity *)e->data);
+		e = list_next(e);
+	}
+	list_destroy(cfg->entities);
+	mem_free(cfg->block);
+}
+
 // ConfigEntity * config_get_entity(Config * cfg, char * entityName) {
 // 	// TODO
 // }
 
 // Get a value for a given key in an entity
 char * config_entity_value(ConfigEntity *entity, char *key) {
-	ListElement *e = list_head(entity->keyValuePairs);
-	while (e != NULL) {
-		ConfigKeyValuePair *kv = (ConfigKeyValuePair *)e->data;
-		if (strcmp(key, kv->key) == 0) {
+	u32 hash = config_hash(key);
+	if (entity->indexed) {
+		u32 slot = hash & (CONFIG_INDEX_SIZE - 1);
+		while (entity->index[slot] != 0) {
+			ConfigKeyValuePair *kv = &entity->pairs[entity->index[slot] - 1];
+			if ((kv->hash == hash) && (strcmp(key, kv->key) == 0)) {
+				return kv->value;
+			}
+			slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+		}
+		return NULL;
+	}
+
+	for (i32 i = 0; i < entity->pairCount; i++) {
+		ConfigKeyValuePair *kv = &entity->pairs[i];
+		if ((kv->hash == hash) && (strcmp(key, kv->key) == 0)) {
 			return kv->value;
 		}
-		e = list_next(e);
 	}
 	
 	return NULL;
 }
 
-void config_entity_set_value(ConfigEntity *entity, char *key, char *value) {
-	// Add a new key-value pair to the entity
-
-	if (entity->keyValuePairs == NULL) {
-		entity->keyValuePairs = list_new(free);
+// Report a problem with the value of a key in a parsed entity. The offset is 
+// how far into the value it is.
+void config_value_error(Config *cfg, ConfigEntity *entity, char *key, i32 offset, char *message) {
+	for (i32 i = 0; i < entity->pairCount; i++) {
+		ConfigKeyValuePair *kv = &entity->pairs[i];
+		if (strcmp(key, kv->key) == 0) {
+			config_error(cfg, cfg->filename, kv->line, (i32)strlen(kv->key) + 2 + offset, message);
+			return;
+		}
 	}
+	config_error(cfg, cfg->filename, 0, 0, message);
+}
 
-	ConfigKeyValuePair *kv = calloc(1, sizeof(ConfigKeyValuePair));
-	kv->key = strdup(key);
-	kv->value = strdup(value);
+// Get a value for a given key as a number (0 if it's missing)
+i32 config_entity_int(ConfigEntity *entity, char *key) {
+	char *value = config_entity_value(entity, key);
+	return (value != NULL) ? atoi(value) : 0;
+}
 
-	list_insert_after(entity->keyValuePairs, list_tail(entity->keyValuePairs), kv);
+void config_entity_set_value(ConfigEntity *entity, char *key, char *value) {
+	// Add a new key-value pair to the entity. Entities made at runtime (or 
+	// added to after parsing) keep their pairs in their own memory.
+	if (entity->pairCount == entity->pairCapacity || entity->pairCapacity == 0) {
+		i32 capacity = (entity->pairCapacity == 0) ? entity->pairCount + 4 : entity->pairCapacity * 2;
+		ConfigKeyValuePair *pairs = mem_calloc(MEM_CONFIG, capacity, sizeof(ConfigKeyValuePair));
+		if (entity->pairCount > 0) {
+			memcpy(pairs, entity->pairs, entity->pairCount * sizeof(ConfigKeyValuePair));
+		}
+		if (entity->pairCapacity > 0) {
+			mem_free(entity->pairs);
+		}
+		entity->pairs = pairs;
+		entity->pairCapacity = capacity;
+	}
+
+	ConfigKeyValuePair *kv = &entity->pairs[entity->pairCount];
+	kv->key = mem_strdup(MEM_CONFIG, key);
+	kv->value = mem_strdup(MEM_CONFIG, value);
+	kv->hash = config_hash(kv->key);
+	entity->pairCount += 1;
+	config_index_add(entity, entity->pairCount - 1);
 }
 
 void config_file_write(char *filename, Config *config) {
@@ -123,12 +313,9 @@ void config_file_write(char *filename, Config *config) {
 			ConfigEntity *entity = (ConfigEntity *)e->data;
 			fprintf(configFile, "[%s]\n", entity->name);
 
-			ListElement *le = list_head(entity->keyValuePairs);
-			while (le != NULL) {
-				ConfigKeyValuePair *kv = (ConfigKeyValuePair *)le->data;
+			for (i32 i = 0; i < entity->pairCount; i++) {
+				ConfigKeyValuePair *kv = &entity->pairs[i];
 				fprintf(configFile, "%s=%s\n", kv->key, kv->value);
-
-				le = list_next(le);
 			}
 
 			e = list_next(e);
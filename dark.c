@@ -6,6 +6,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <SDL2/SDL.h>
 
@@ -25,6 +35,7 @@ typedef uint8_t		u8;
 typedef uint32_t	u32;
 typedef uint64_t	u64;
 typedef int8_t		i8;
+typedef int16_t		i16;
 typedef int32_t		i32;
 typedef int64_t		i64;
 
@@ -35,7 +46,14 @@ void quit_game();
 #define internal static
 #define local_persist static
 #define global_variable static
-
+#ifdef _MSC_VER
+#define thread_variable static __declspec(thread)
+#else
+#define thread_variable static _Thread_local
+#endif
+
+#include "mem.c"
+#include "rng.c"
 #include "util.c"
 #include "String.c"
 #include "list.c"
@@ -43,9 +61,12 @@ void quit_game();
 // #define HASHMAP_IMPLEMENTATION
 // #include "hashmap.h"
 #include "ui.c"
+#include "profile.c"
 #include "map.c"
 #include "game.c"
 #include "fov.c"
+#include "save.c"
+#include "replay.c"
 
 // Screen files
 #include "screen_in_game.c"
@@ -55,35 +76,206 @@ void quit_game();
 #include "screen_win_game.c"
 
 
+internal void
+render_view(UIView *v)
+{
+	if (v->profileScope < 0) {
+		v->profileScope = profile_scope_add(v->name);
+	}
+	ProfileMark mark = profile_begin(v->profileScope);
+	console_clear(v->console);
+	v->render(v->console);
+	profile_end(mark);
+}
+
+internal void
+render_views(UIScreen *screen)
+{
+	// Render views from back to front for the current screen
+	for (ListElement *e = list_head(screen->views); e != NULL; e = list_next(e)) {
+		UIView *v = (UIView *)list_data(e);
+		if (!v->hidden) {
+			render_view(v);
+		}
+	}
+}
+
 internal void 
 render_screen(SDL_Renderer *renderer, 
 				  SDL_Texture *screenTexture, 
 				  UIScreen *screen) 
 {
-
-	// Render views from back to front for the current screen
-	ListElement *e = list_head(screen->views);
-	while (e != NULL) {
+	ProfileMark mark = profile_begin(PROFILE_RENDER_SCREEN);
+	render_views(screen);
+	for (ListElement *e = list_head(screen->views); e != NULL; e = list_next(e)) {
 		UIView *v = (UIView *)list_data(e);
-		console_clear(v->console);
-		v->render(v->console);
+		if (!v->hidden) {
+			SDL_UpdateTexture(screenTexture, v->pixelRect, v->console->pixels, v->pixelRect->w * sizeof(u32));
+		}
+	}
+
+	// The profiler's overlay goes over whatever screen is showing
+	if (profileOverlayShown) {
+		UIView *v = profile_view();
+		render_view(v);
 		SDL_UpdateTexture(screenTexture, v->pixelRect, v->console->pixels, v->pixelRect->w * sizeof(u32));
-		e = list_next(e);
 	}
 
 	SDL_RenderClear(renderer);
 	SDL_RenderCopy(renderer, screenTexture, NULL, NULL);
 	SDL_RenderPresent(renderer);
+	profile_end(mark);
 }
 
 global_variable bool gameIsRunning = true;
+global_variable char *profileTraceFile = NULL;		// Written out on the way out, if set
 void quit_game() {
 	gameIsRunning = false;
 }
 
-int main() 
+internal void
+handle_event(u32 frame, SDL_Event event)
+{
+	if (event.type != SDL_KEYDOWN) {
+		return;
+	}
+	SDL_Keycode key = event.key.keysym.sym;
+	replay_record_key(frame, key);
+
+	// Handle "global" keypresses (those not handled on a screen-by-screen basis)
+	switch (key) {
+		case SDLK_t: {
+			asciiMode = !asciiMode;
+			if (currentlyInGame) {
+				ui_set_active_screen(screen_show_in_game());
+			}
+		}
+		break;
+
+		// // DEBUG - jump straight to win screen
+		case SDLK_w: {
+			ui_set_active_screen(screen_show_win_game());
+		}
+		break;
+
+		case SDLK_F3: {
+			profileOverlayShown = !profileOverlayShown;
+		}
+		break;
+
+		case SDLK_F4: {
+			profile_trace_write(PROFILE_TRACE_FILE);
+		}
+		break;
+
+		default:
+			break;
+	}
+
+	// Send the event to the currently active screen for handling
+	UIScreen *screenForInput = ui_get_active_screen(); 
+	screenForInput->handle_event(screenForInput, event);
+}
+
+internal i32
+replay_play() 
 {
-	srand((unsigned)time(NULL));
+	// Play a recording back through the same handlers, on the same frames,
+	// with no window and no waiting between frames
+	ui_set_active_screen(screen_show_launch());
+	currentlyInGame = false;
+
+	u32 frame = 0;
+	u64 start = SDL_GetPerformanceCounter();
+	while (gameIsRunning) {
+		playerTookTurn = false;
+		u64 frameStart = SDL_GetPerformanceCounter();
+		ProfileMark frameMark = profile_begin(PROFILE_FRAME);
+
+		SDL_Event event;
+		while (replay_next_event(frame, &event)) {
+			if (event.type == SDL_QUIT) {
+				quit_game();
+				break;
+			}
+			handle_event(frame, event);
+		}
+
+		if (currentlyInGame) {
+			game_update();
+		}
+		game_events_dispatch();
+		if (currentlyInGame && playerTookTurn) {
+			replay_turn(turnsTaken, SDL_GetPerformanceCounter() - frameStart);
+		}
+		profile_end(frameMark);
+		mem_arena_reset(&frameArena);
+		mem_frame_end();
+		frame += 1;
+	}
+
+	bool matched = replay_finish(frame, SDL_GetPerformanceCounter() - start);
+	level_pregen_cancel();
+	if (profileTraceFile != NULL) {
+		profile_trace_write(profileTraceFile);
+	}
+	profile_shutdown();
+	ui_screens_destroy();
+	font_cache_purge();
+	image_cache_purge();
+	game_shutdown();
+	mem_arena_free(&frameArena);
+	mem_leak_report();
+	return matched ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) 
+{
+	// A run can be replayed by passing its seed: dark -seed <number>
+	for (i32 i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-seed") == 0) {
+			fixedRunSeed = strtoull(argv[i + 1], NULL, 10);
+		}
+	}
+
+	// dark -compile-content turns the monster, item and level config into content.bin
+	// dark -watch-content reloads that config whenever it's saved (add 
+	// -rescale-monsters to update the monsters already out there, too)
+	// dark -record <file> records the session, and dark -replay <file> plays
+	// it back (without a window) to check it goes the same way, and how fast.
+	// Add -hash-log <file> to either to write out the world's hashes each turn.
+	// dark -profile-trace <file> writes out a Chrome trace of the last few 
+	// thousand timed scopes on each thread when the game quits.
+	profile_thread_begin("Main");
+	bool watchContent = false;
+	for (i32 i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-record") == 0) && (i + 1 < argc)) {
+			if (!replay_record_start(argv[++i])) { return 1; }
+		} else if ((strcmp(argv[i], "-replay") == 0) && (i + 1 < argc)) {
+			if (!replay_play_start(argv[++i])) { return 1; }
+		} else if ((strcmp(argv[i], "-hash-log") == 0) && (i + 1 < argc)) {
+			if (!replay_hash_log_start(argv[++i])) { return 1; }
+		} else if ((strcmp(argv[i], "-profile-trace") == 0) && (i + 1 < argc)) {
+			profileTraceFile = argv[++i];
+		} else if (strcmp(argv[i], "-compile-content") == 0) {
+			return content_compile() ? 0 : 1;
+		} else if (strcmp(argv[i], "-watch-content") == 0) {
+			watchContent = true;
+		} else if (strcmp(argv[i], "-rescale-monsters") == 0) {
+			contentRescaleMonsters = true;
+		}
+	}
+	// Everything that happens in a run is counted, and (unless it's being
+	// played back headless) written up in the message log
+	game_events_listen(run_stats_event);
+	if (replay_playing()) {
+		return replay_play();
+	}
+	game_events_listen(message_log_event);
+	if (watchContent && !replay_active()) {
+		// (Content changing part way through would spoil a recording)
+		content_watch_start();
+	}
 
 	SDL_Init(SDL_INIT_VIDEO);
 
@@ -105,69 +297,84 @@ int main()
 
 	currentlyInGame = false;
 
+	u32 frame = 0;
 	while (gameIsRunning) {
 		playerTookTurn = false;
 
 		SDL_Event event;
 		u32 timePerFrame = 1000 / FPS_LIMIT;
-		u32 frameStart = 0;
+		u32 frameStart = SDL_GetTicks();
+		ProfileMark frameMark = profile_begin(PROFILE_FRAME);
 		while (SDL_PollEvent(&event) != 0) {
-
-			frameStart = SDL_GetTicks();
-
 			if (event.type == SDL_QUIT) {
 				quit_game(); 
 				break;
 			}
-
-			// Handle "global" keypresses (those not handled on a screen-by-screen basis)
-			if (event.type == SDL_KEYDOWN) {
-				SDL_Keycode key = event.key.keysym.sym;
-
-				switch (key) {
-					case SDLK_t: {
-						asciiMode = !asciiMode;
-						if (currentlyInGame) {
-							ui_set_active_screen(screen_show_in_game());
-						}
-					}
-					break;
-
-					// // DEBUG - jump straight to win screen
-					case SDLK_w: {
-						ui_set_active_screen(screen_show_win_game());
-					}
-					break;
-
-					default:
-						break;
-				}
-			
-				// Send the event to the currently active screen for handling
-				UIScreen *screenForInput = ui_get_active_screen(); 
-				screenForInput->handle_event(screenForInput, event);
-			}
+			handle_event(frame, event);
 		}
 
+		// Swap in any content that was edited while we were running
+		content_reload_apply();
+
 		// If we're in-game, have the game update itself
 		if (currentlyInGame) {
 			game_update();		
 		}
 
+		// Let the message log (and anything else listening) know what happened
+		game_events_dispatch();
+
+		// Checkpoint the run after every turn, in case we crash
+		if (currentlyInGame && playerTookTurn) {
+			save_checkpoint();
+			replay_turn(turnsTaken, 0);
+		}
+
 		// Render the active screen
 		render_screen(renderer, screenTexture, ui_get_active_screen());
+		profile_end(frameMark);
+
+		// The frame's scratch strings are done with
+		mem_arena_reset(&frameArena);
+		mem_frame_end();
 
 		// Limit our FPS
 		i32 sleepTime = timePerFrame - (SDL_GetTicks() - frameStart);
 		if (sleepTime > 0) {
 			SDL_Delay(sleepTime);
 		}
+		frame += 1;
+	}
+	replay_finish(frame, 0);
+
+	// Save the run, so it can be continued next time
+	if (currentlyInGame) {
+		save_game(SAVE_FILE);
 	}
+	save_shutdown();
+
+	// Don't leave a level half-generated in the background
+	level_pregen_cancel();
+	content_watch_stop();
+	if (profileTraceFile != NULL) {
+		profile_trace_write(profileTraceFile);
+	}
+	profile_shutdown();
+
+	// Tear down all of our screens (and the fonts and images they were using), and the game
+	ui_screens_destroy();
+	font_cache_purge();
+	image_cache_purge();
+	game_shutdown();
+	mem_arena_free(&frameArena);
 
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 
 	SDL_Quit();
 
+	// Anything still allocated now was lost track of somewhere
+	mem_leak_report();
+
 	return 0;
 }
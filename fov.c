@@ -5,7 +5,7 @@
 #define FOV_DISTANCE	10
 
 typedef struct {
-	u32 x, y;
+	i32 x, y;
 } FovCell;
 
 typedef struct {
@@ -15,7 +15,7 @@ typedef struct {
 
 
 void add_shadow(Shadow s);
-bool cell_blocks_sight(u32 x, u32 y);
+bool cell_blocks_sight(i32 x, i32 y);
 bool cell_in_shadow(float cellSlope);
 float fov_distance_between(u32 x1, u32 y1, u32 x2, u32 y2);
 float line_slope_between(float x1, float y1, float x2, float y2);
@@ -24,19 +24,48 @@ FovCell map_cell_for_local_cell(u8 sector, FovCell heroMapCell, FovCell cellToTr
 internal Shadow knownShadows[10];
 internal u8 shadowCount = 0;
 
+// Where the hero was for the last calculation - only cells around there can be visible
+internal FovCell lastHeroCell = {-1, -1};
+
+
+internal void
+fov_reset() {
+	lastHeroCell = (FovCell) {-1, -1};
+}
 
 internal void 
-fov_calculate(u32 heroX, u32 heroY, u32 fovMap[][MAP_HEIGHT]) {
+fov_mark_seen() {
+	// Whatever's drawn in view has now been seen, and is remembered (drawn 
+	// faded) once it's out of view
+	if (lastHeroCell.x < 0) { return; }
+	for (i32 x = lastHeroCell.x - FOV_DISTANCE; x <= lastHeroCell.x + FOV_DISTANCE; x++) {
+		for (i32 y = lastHeroCell.y - FOV_DISTANCE; y <= lastHeroCell.y + FOV_DISTANCE; y++) {
+			if (!map_in_bounds(x, y) || !(map_cell_flags(x, y) & FOV_VISIBLE)) { continue; }
+			RenderCell *cell = render_cell_resolve(x, y);
+			for (i32 layer = LAYER_GROUND; layer <= LAYER_TOP; layer++) {
+				Visibility *vis = render_cell_layer(cell, layer);
+				if (vis != NULL) { vis->hasBeenSeen = true; }
+			}
+		}
+	}
+}
 
-	// Reset FOV to default state (hidden)
-	for (u32 x = 0; x < MAP_WIDTH; x++) {
-		for (u32 y = 0; y < MAP_HEIGHT; y++) {
-			fovMap[x][y] = 0;
+internal void 
+fov_calculate(i32 heroX, i32 heroY) {
+	ProfileMark mark = profile_begin(PROFILE_FOV);
+
+	// Reset FOV to default state (hidden) in the area that was visible last time
+	if (lastHeroCell.x >= 0) {
+		for (i32 x = lastHeroCell.x - FOV_DISTANCE; x <= lastHeroCell.x + FOV_DISTANCE; x++) {
+			for (i32 y = lastHeroCell.y - FOV_DISTANCE; y <= lastHeroCell.y + FOV_DISTANCE; y++) {
+				map_cell_clear_flags(x, y, FOV_VISIBLE);
+			}
 		}
 	}
+	lastHeroCell = (FovCell) {heroX, heroY};
 
 	// Mark hero cell visible
-	fovMap[heroX][heroY] = 1;
+	map_cell_set_flags(heroX, heroY, FOV_VISIBLE | FOV_SEEN);
 
 	// Loop through all 8 sectors around the player
 	for (u8 sector = 1; sector <= 8; sector++) {
@@ -55,14 +84,14 @@ fov_calculate(u32 heroX, u32 heroY, u32 fovMap[][MAP_HEIGHT]) {
 				FovCell mapCell = map_cell_for_local_cell(sector, heroCell, cellToTranslate);
 
 				// Is cell within map?
-				if ((mapCell.x < MAP_WIDTH) && (mapCell.y < MAP_HEIGHT)) {
+				if (map_in_bounds(mapCell.x, mapCell.y)) {
 					// Is cell within view distance?
 					if (fov_distance_between(0, 0, cellX, cellY) <= FOV_DISTANCE) {
 						// Is cell within known shadow?
 						float cellSlope = line_slope_between(0, 0, cellX, cellY);
 						if (!cell_in_shadow(cellSlope)) {
 							// No - Mark as visible
-							fovMap[mapCell.x][mapCell.y] = 1;
+							map_cell_set_flags(mapCell.x, mapCell.y, FOV_VISIBLE | FOV_SEEN);
 							// Is cell blocking?
 							if (cell_blocks_sight(mapCell.x, mapCell.y)) {
 								// Was the last cell blocking?
@@ -96,6 +125,7 @@ fov_calculate(u32 heroX, u32 heroY, u32 fovMap[][MAP_HEIGHT]) {
 		}
 	}
 
+	profile_end(mark);
 }
 
 void add_shadow(Shadow s) {
@@ -103,7 +133,11 @@ void add_shadow(Shadow s) {
 	shadowCount += 1;
 }
 
-bool cell_blocks_sight(u32 x, u32 y) {
+bool cell_blocks_sight(i32 x, i32 y) {
+	if (is_wall(x, y)) {
+		return true;
+	}
+
 	List *gos = game_objects_at_position(x, y);
 	if (gos != NULL) {
 		ListElement *e = list_head(gos);
@@ -111,7 +145,7 @@ bool cell_blocks_sight(u32 x, u32 y) {
 			GameObject *go = (GameObject *)list_data(e);
 			if (go->id != UNUSED) {
 				Physical *phys = (Physical *)game_object_get_component(go, COMP_PHYSICAL);
-				if (phys->blocksSight) {
+				if ((phys != NULL) && phys->blocksSight) {
 					return true;
 				}
 			}
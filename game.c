@@ -12,8 +12,6 @@
 #define LAYER_AIR		3
 #define LAYER_TOP		4
 
-#define MONSTER_TYPE_COUNT	100
-#define ITEM_TYPE_COUNT		100
 #define MAX_DUNGEON_LEVEL	20
 #define GEMS_PER_LEVEL		5
 
@@ -43,7 +41,7 @@ typedef struct {
 /* Components */
 typedef struct {
 	i32 objectId;
-	u8 x, y;	
+	i32 x, y;	
 	u8 layer;				// 1 is bottom layer
 } Position;
 
@@ -119,16 +117,224 @@ typedef struct {
 
 typedef struct {
 	i32 level;
-	bool (*mapWalls)[MAP_HEIGHT];
+	i32 width;
+	i32 height;
+	bool generateLazily;			// Huge levels are generated a chunk at a time, as the player gets near
+	u64 mapSeed;					// Seeds for the level's map and what's placed in it (per chunk, 
+	u64 spawnSeed;					// for lazily generated levels)
+	i32 stairsChunk;				// Chunks that get the stairs and gems, once they're generated
+	i32 gemChunks[GEMS_PER_LEVEL];
+	MapParams map;					// Which generator makes the map, and how it lays it out
+	bool *wholeMap;					// Lazily generated levels that are sliced from a whole map keep it here
 } DungeonLevel;
 
 
+/* Config Tables */
+
+// The config files are compiled into these once, when they're loaded, so 
+// spawning doesn't have to look anything up by name. Monsters and items are 
+// indexed by their config id, less one.
+
+typedef struct {
+	i32 id;							// 0 if no monster has this id
+	char *name;
+	asciiChar glyph;
+	u32 color;
+	u32 speed;
+	u32 frequency;
+	i32 maxHP;
+	i32 recoveryRate;
+	i32 toHit;
+	i32 attack;
+	i32 defense;
+	i32 appearance[MAX_DUNGEON_LEVEL];		// Relative chance of turning up on each level
+} MonsterDef;
+
+typedef struct {
+	i32 id;							// 0 if no item has this id
+	char *name;
+	asciiChar glyph;
+	u32 color;
+	i32 toHitModifier;
+	i32 attackModifier;
+	i32 defenseModifier;
+	i32 quantity;
+	i32 weight;
+	char *slot;
+	i32 appearance[MAX_DUNGEON_LEVEL];
+} ItemDef;
+
+typedef struct {
+	i32 maxMonsters;
+	i32 maxItems;
+	i32 width;
+	i32 height;
+	MapParams map;
+} LevelDef;
+
+
+/* Render Cells */
+typedef struct {
+	i16 layers[LAYER_TOP + 1];	// Id of the visible object on each layer of the cell (or UNUSED)
+	bool dirty;					// Set when the objects in the cell change, until re-resolved
+} RenderCell;
+
+
+/* Map Chunks */
+
+// Cell flags
+#define FOV_VISIBLE		0x01	// Cell is currently in the player's field of view
+#define FOV_SEEN		0x02	// Cell has been in the player's field of view at some point
+#define CELL_WALL		0x04	// Cell is solid rock
+
+#define CHUNK_CELLS			(CHUNK_SIZE * CHUNK_SIZE)
+#define CHUNK_CELL(x, y)	((((y) % CHUNK_SIZE) * CHUNK_SIZE) + ((x) % CHUNK_SIZE))
+#define CHUNK_HOT_RADIUS	2		// Chunks this close to the player's are generated and unpacked
+#define CHUNK_COLD_RADIUS	3		// Chunks further away than this are packed up
+
+// Levels bigger than this are generated lazily
+#define MAP_EAGER_MAX_CELLS		(128 * 128)
+
+typedef enum {
+	CHUNK_HOT,
+	CHUNK_COLD
+} ChunkState;
+
+typedef struct {
+	ChunkState state;
+	u8 *cells;						// Cell flags, while hot
+	RenderCell *renderCells;		// While hot
+	u8 *packed;						// Run-length encoded cell flags, while cold
+	u32 packedSize;
+	bool dirty;						// Changed since the last save
+} Chunk;
+
+
+/* Cell Objects */
+
+// The objects in each occupied cell are kept in a hash table keyed by cell, 
+// so its size depends on how many objects there are rather than the map size.
+#define CELL_OBJECTS_BITS		15
+#define CELL_OBJECTS_CAPACITY	(1 << CELL_OBJECTS_BITS)		// Comfortably more than MAX_GO
+
+typedef struct {
+	i32 cell;
+	List *objects;
+} CellObjects;
+
+
+/* Level Plans */
+
+typedef enum {
+	SPAWN_MONSTER,
+	SPAWN_ITEM,
+	SPAWN_GEM,
+	SPAWN_STAIRS
+} SpawnType;
+
+typedef struct {
+	SpawnType type;
+	i32 entityId;				// Config id of the monster or item
+	Point pt;
+} Spawn;
+
+typedef struct {
+	i32 chunkX, chunkY;
+	bool cells[CHUNK_CELLS];
+	List *spawns;
+} ChunkPlan;
+
+typedef struct {
+	// Everything needed to build a level, worked out without touching the 
+	// world state - so it can be done on a background thread
+	DungeonLevel *level;
+	bool *mapCells;				// The whole map, for levels that aren't generated lazily
+	List *spawns;
+	ChunkPlan *chunkPlans;		// The chunks around the start, for levels that are
+	i32 chunkPlanCount;
+	Point playerStart;
+} LevelPlan;
+
+
 /* Message Log */
+#define MESSAGE_LOG_SIZE		4096	// Messages kept to scroll back through (a power of 2)
+#define MESSAGE_INLINE_SIZE		96		// Messages shorter than this are kept in the log itself
+
 typedef struct {
-	char *msg;
+	char text[MESSAGE_INLINE_SIZE];
+	char *longText;			// For the odd message too long to keep inline
 	u32 fgColor;
+	u32 repeats;			// How many times in a row it's been said
 } Message;
 
+typedef struct {
+	Message messages[MESSAGE_LOG_SIZE];		// A ring - old messages are written over
+	u32 count;								// Added since the log was cleared
+} MessageLog;
+
+
+/* Game Events */
+
+// What happened during a tick, as far as anyone watching is concerned. The
+// systems just note these down as they go, and they're handed out to whoever's
+// listening (the message log, the run's stats) once the tick's done - so 
+// nothing's formatted while the simulation runs, or at all when running headless.
+#define GAME_EVENT_QUEUE_SIZE		256
+#define GAME_EVENT_MAX_LISTENERS	4
+#define GAME_EVENT_NAME_SIZE		32
+
+typedef enum {
+	EVENT_HIT,				// amount is the damage done (0 if none got through)
+	EVENT_MISS,
+	EVENT_KILL,
+	EVENT_DIED,				// The player
+	EVENT_PICKUP,
+	EVENT_PICKUP_GEM,		// amount is the gems left on the level
+	EVENT_TOO_HEAVY,
+	EVENT_CRUMBLE,			// amount is 1 if it was equipped
+	EVENT_DROP,
+	EVENT_CANT_DROP,
+	EVENT_DESCEND,			// amount is the new level
+	EVENT_NO_STAIRS,
+	EVENT_STAIRS_HERE,		// amount is the level
+	EVENT_ITEM_HERE
+} GameEventType;
+
+typedef struct {
+	GameEventType type;
+	bool byPlayer;							// For hits and misses, whose attack it was
+	i32 amount;
+	char name[GAME_EVENT_NAME_SIZE];		// Whatever the player hit, or was hit by, or picked up...
+} GameEvent;
+
+typedef void (*GameEventListener)(GameEvent *event);
+
+typedef struct {
+	i32 kills;
+	i32 attacks;			// The player's
+	i32 hits;
+	i32 damageDealt;
+	i32 damageTaken;
+	i32 itemsPickedUp;
+	i32 itemsCrumbled;
+} RunStats;
+
+
+/* Turn Stages */
+
+// The systems that run each turn, in order - the world's hash is taken after
+// each one when replaying, so a difference can be put down to one of them
+typedef enum {
+	TURN_STAGE_PLAYER,			// Whatever the player did
+	TURN_STAGE_CHUNKS,
+	TURN_STAGE_MOVEMENT,
+	TURN_STAGE_ITEMS,
+	TURN_STAGE_ENVIRONMENT,
+	TURN_STAGE_HEALTH,
+	TURN_STAGE_FOV,
+	TURN_STAGE_COUNT
+} TurnStage;
+
 
 /* Hall of Fame */
 typedef struct {
@@ -168,146 +374,785 @@ global_variable	bool playerTookTurn = false;
 
 global_variable	i32 currentLevelNumber;
 global_variable DungeonLevel *currentLevel;
-global_variable u32 fovMap[MAP_WIDTH][MAP_HEIGHT];
-global_variable i32 (*targetMap)[MAP_HEIGHT] = NULL;
-global_variable List *goPositions[MAP_WIDTH][MAP_HEIGHT];
+global_variable i32 turnsTaken = 0;
+
+// Random number streams - everything is derived from the run's seed, so a 
+// run can be reproduced from its seed alone
+#define RNG_STREAM_MAPGEN	1
+#define RNG_STREAM_SPAWN	2
+#define RNG_STREAM_AI		3
+#define RNG_STREAM_COMBAT	4
+
+// The next level is generated in the background while the current one is played
+global_variable SDL_Thread *pregenThread = NULL;
+global_variable LevelPlan *pregenPlan = NULL;
+
+global_variable u64 runSeed = 0;
+global_variable u64 fixedRunSeed = 0;		// Seed given on the command line (if any)
+global_variable RNG aiRng;
+global_variable RNG combatRng;
+
+// Per-cell world state for the current level
+#define MAP_IDX(x, y)	CELL_IDX(x, y, mapWidth)
+
+global_variable i32 mapWidth = 0;
+global_variable i32 mapHeight = 0;
+global_variable i32 chunksWide = 0;
+global_variable i32 chunksHigh = 0;
+global_variable Chunk **chunks = NULL;
+global_variable u64 mapHash = 0;			// Sum of map_cell_hash for every generated cell, kept as they change
+global_variable CellObjects cellObjects[CELL_OBJECTS_CAPACITY];
+global_variable u64 cellObjectsHash = 0;	// Sum of cell_objects_hash for every occupied cell
+global_variable u64 gameObjectsHash = 0;	// Sum of the hashes of the ids in use
+
+// The target map only covers the area around the player that monsters could 
+// plausibly be chasing them through, so its cost doesn't grow with the map.
+#define TARGET_MAP_RADIUS	32
+#define TARGET_MAP_SIZE		((TARGET_MAP_RADIUS * 2) + 1)
+#define TARGET_UNSET		9999
+
+global_variable i32 targetMap[TARGET_MAP_SIZE * TARGET_MAP_SIZE];
+global_variable i32 targetMapLeft = 0;
+global_variable i32 targetMapTop = 0;
+
+// Terrain isn't made of game objects - these describe how wall and floor cells look
+global_variable Visibility floorTerrain = {.objectId = UNUSED, .glyph = '.', .fgColor = 0x3e3c3cFF, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name = "Floor"};
+global_variable Visibility wallTerrain = {.objectId = UNUSED, .glyph = '#', .fgColor = 0x675644FF, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name = "Wall"};
+
 global_variable Config *monsterConfig = NULL;
-global_variable i32 monsterProbability[MONSTER_TYPE_COUNT][MAX_DUNGEON_LEVEL];		// TODO: dynamically size this based on actual count of monsters in config file
 global_variable Config *itemConfig = NULL;
-global_variable i32 itemProbability[ITEM_TYPE_COUNT][MAX_DUNGEON_LEVEL];		// TODO: dynamically size this based on actual count of monsters in config file
 global_variable Config *levelConfig = NULL;
-global_variable i32 maxMonsters[MAX_DUNGEON_LEVEL];
-global_variable i32 maxItems[MAX_DUNGEON_LEVEL];
-global_variable List *messageLog = NULL;
+global_variable MonsterDef *monsterDefs = NULL;
+global_variable i32 monsterDefCount = 0;				// Highest monster id in the config
+global_variable AliasTable monsterTables[MAX_DUNGEON_LEVEL];	// Which monsters turn up on each level
+global_variable ItemDef *itemDefs = NULL;
+global_variable i32 itemDefCount = 0;
+global_variable AliasTable itemTables[MAX_DUNGEON_LEVEL];
+global_variable LevelDef levelDefs[MAX_DUNGEON_LEVEL];
+global_variable MessageLog messageLog;
+global_variable GameEvent gameEvents[GAME_EVENT_QUEUE_SIZE];
+global_variable u32 gameEventCount = 0;
+global_variable GameEventListener gameEventListeners[GAME_EVENT_MAX_LISTENERS];
+global_variable i32 gameEventListenerCount = 0;
+global_variable RunStats runStats;
 global_variable Config *hofConfig = NULL;
 
 
 /* Necessary function declarations */
 
 void add_message(char *msg, u32 color);
+void message_log_clear();
+void game_events_clear();
+internal GameEvent *game_event_push(GameEventType type, GameObject *named);
 void generate_target_map(i32 targetX, i32 targetY);
 void combat_attack(GameObject *attacker, GameObject *defender);
-internal void fov_calculate(u32 heroX, u32 heroY, u32 fovMap[][MAP_HEIGHT]);
+internal void fov_calculate(i32 heroX, i32 heroY);
+internal void fov_mark_seen();
+internal void fov_reset();
 internal UIScreen * screen_show_endgame();
 internal UIScreen * screen_show_win_game();
 internal void game_over();
+void save_delete();
+void replay_run_seed(u64 *seed);
+void replay_stage(TurnStage stage);
+bool replay_playing();
 void item_toggle_equip(GameObject *item);
 void animateGem(u32 gameObjectId);
+void render_cell_invalidate(i32 x, i32 y);
+bool map_in_bounds(i32 x, i32 y);
+List *cell_objects_find(i32 x, i32 y, bool create);
+void cell_objects_add(GameObject *obj, i32 x, i32 y);
+void cell_objects_remove(GameObject *obj, i32 x, i32 y);
+void chunk_plan_build(DungeonLevel *level, i32 chunkX, i32 chunkY, ChunkPlan *plan);
+void chunk_plan_apply(ChunkPlan *plan);
 
 
 /* World State Management */
 
-void get_appearance_prob(Config *config, i32 (*probabilities)[MAX_DUNGEON_LEVEL]) {
-	ListElement *e = list_head(config->entities);
-	while (e != NULL) {
-		ConfigEntity *entity = (ConfigEntity *)e->data;
-		char *appearance_prob = config_entity_value(entity, "appearance_prob");
-		char *copy = (char *)calloc(strlen(appearance_prob) + 1, sizeof(char));
-		strcpy(copy, appearance_prob);
-
-		char *idString = config_entity_value(entity, "id");
-		i32 id = atoi(idString);
-
-		char *lvl = strtok(copy, ",");
-		if (lvl != NULL) {
-			i32 lastLvl = 0;
-			bool probData = true;
-			while (probData) {
-				char *prob = strtok(NULL, ",");
-				i32 lvlNum = atoi(lvl);
-				i32 probNum = atoi(prob);	
-
-				// Fill in the probabilities from our last filled level to the current level
-				for (i32 i = lastLvl; i < lvlNum; i++) {
-					probabilities[id-1][i] = probNum;							
-				}				
-
-				lastLvl = lvlNum;
-				lvl = strtok(NULL, ",");
-				if (lvl == NULL) {
-					probData = false;
-				}
-			}
+bool get_level_values(Config *config, ConfigEntity *entity, char *propertyName, i32 *maxCounts, i32 (*parse)(const char *)) {
+	// Per-level values are pairs of a level number and a value, where the 
+	// value holds for every level up to that one. Levels past the last one 
+	// there is are ignored. Values can't be negative - a parse function 
+	// returns -1 for something it doesn't understand.
+	char *countsString = config_entity_value(entity, propertyName);
+	if (countsString == NULL) {
+		// Property isn't in the config, so leave the defaults alone
+		return true;
+	}
+	char *copy = (char *)mem_calloc(MEM_CONFIG, strlen(countsString) + 1, sizeof(char));
+	strcpy(copy, countsString);
+
+	bool valid = true;
+	i32 lastLvl = 0;
+	char *lvl = copy;
+	while ((lastLvl < MAX_DUNGEON_LEVEL) && (*lvl != '\0')) {
+		char *sCount = strchr(lvl, ',');
+		if (sCount == NULL) {
+			config_value_error(config, entity, propertyName, (i32)(lvl - copy), "expected a value after the level number");
+			valid = false;
+			break;
+		}
+		*sCount++ = '\0';
+		char *next = strchr(sCount, ',');
+		if (next != NULL) { *next++ = '\0'; }
+
+		i32 lvlNum = atoi(lvl);
+		if (lvlNum <= lastLvl) {
+			config_value_error(config, entity, propertyName, (i32)(lvl - copy), "expected a level number higher than the last one");
+			valid = false;
+			break;
+		}
+		i32 maxCount = parse(sCount);
+		if (maxCount < 0) {
+			config_value_error(config, entity, propertyName, (i32)(sCount - copy), "bad value");
+			valid = false;
+			break;
 		}
 
-		free(copy);
-		e = list_next(e);
+		// Fill in the values from our last filled level to the current level
+		if (lvlNum > MAX_DUNGEON_LEVEL) { lvlNum = MAX_DUNGEON_LEVEL; }
+		for (i32 i = lastLvl; i < lvlNum; i++) {
+			maxCounts[i] = maxCount;
+		}
+
+		lastLvl = lvlNum;
+		lvl = (next != NULL) ? next : sCount + strlen(sCount);
 	}
 
+	mem_free(copy);
+	return valid;
 }
 
-void get_max_counts(ConfigEntity *entity, char *propertyName, i32 *maxCounts) {
-	char *countsString = config_entity_value(entity, propertyName);
-	char *copy = (char *)calloc(strlen(countsString) + 1, sizeof(char));
-	strcpy(copy, countsString);
+internal i32 
+config_count(const char *s) {
+	// Counts are numbers that aren't negative
+	char *end;
+	long n = strtol(s, &end, 10);
+	return ((end == s) || (*end != '\0') || (n < 0) || (n > INT32_MAX)) ? -1 : (i32)n;
+}
 
-	char *lvl = strtok(copy, ",");
-	if (lvl != NULL) {
-		i32 lastLvl = 0;
-		bool lvlCountData = true;
-		while (lvlCountData) {
-			char *sCount = strtok(NULL, ",");
-			i32 lvlNum = atoi(lvl);
-			i32 maxCount = atoi(sCount);
-
-			// Fill in the probabilities from our last filled level to the current level
-			for (i32 i = lastLvl; i < lvlNum; i++) {
-				maxCounts[i] = maxCount;
-			}				
-
-			lastLvl = lvlNum;
-			lvl = strtok(NULL, ",");
-			if (lvl == NULL) {
-				lvlCountData = false;
-			}
-		}
+bool get_max_counts(Config *config, ConfigEntity *entity, char *propertyName, i32 *maxCounts) {
+	return get_level_values(config, entity, propertyName, maxCounts, config_count);
+}
+
+internal i32 
+config_max_id(Config *config) {
+	i32 maxId = 0;
+	for (ListElement *e = list_head(config->entities); e != NULL; e = list_next(e)) {
+		i32 id = config_entity_int((ConfigEntity *)e->data, "id");
+		if (id > maxId) { maxId = id; }
+	}
+	return maxId;
+}
+
+MonsterDef * monster_defs_build(Config *config, i32 *count) {
+	// The table is as big as the highest id, so the config can have any number 
+	// of monsters. Any bad values are counted in the config's errors.
+	*count = config_max_id(config);
+	MonsterDef *defs = mem_calloc(MEM_CONFIG, *count + 1, sizeof(MonsterDef));
+	for (ListElement *e = list_head(config->entities); e != NULL; e = list_next(e)) {
+		ConfigEntity *entity = (ConfigEntity *)e->data;
+		i32 id = config_entity_int(entity, "id");
+		if (id < 1) { continue; }
+
+		MonsterDef *def = &defs[id-1];
+		def->id = id;
+		def->name = config_entity_value(entity, "name");
+		def->glyph = config_entity_int(entity, "vis_glyph");
+		char *color = config_entity_value(entity, "vis_color");
+		def->color = (color != NULL) ? (u32)xtoi(color) : 0xffffffff;
+		def->speed = config_entity_int(entity, "mv_speed");
+		def->frequency = config_entity_int(entity, "mv_frequency");
+		def->maxHP = config_entity_int(entity, "h_maxHP");
+		def->recoveryRate = config_entity_int(entity, "h_recRate");
+		def->toHit = config_entity_int(entity, "com_toHit");
+		def->attack = config_entity_int(entity, "com_attack");
+		def->defense = config_entity_int(entity, "com_defense");
+		get_max_counts(config, entity, "appearance_prob", def->appearance);
 	}
+	return defs;
+}
 
-	free(copy);
+void monster_defs_load(Config *config) {
+	mem_free(monsterDefs);
+	monsterDefs = monster_defs_build(config, &monsterDefCount);
 }
 
-void world_state_init() {
-	for (u32 i = 0; i < MAX_GO; i++) {
-		gameObjects[i].id = UNUSED;
+ItemDef * item_defs_build(Config *config, i32 *count) {
+	*count = config_max_id(config);
+	ItemDef *defs = mem_calloc(MEM_CONFIG, *count + 1, sizeof(ItemDef));
+	for (ListElement *e = list_head(config->entities); e != NULL; e = list_next(e)) {
+		ConfigEntity *entity = (ConfigEntity *)e->data;
+		i32 id = config_entity_int(entity, "id");
+		if (id < 1) { continue; }
+
+		ItemDef *def = &defs[id-1];
+		def->id = id;
+		def->name = config_entity_value(entity, "name");
+		def->glyph = config_entity_int(entity, "vis_glyph");
+		char *color = config_entity_value(entity, "vis_color");
+		def->color = (color != NULL) ? (u32)xtoi(color) : 0xffffffff;
+		def->toHitModifier = config_entity_int(entity, "com_toHitModifier");
+		def->attackModifier = config_entity_int(entity, "com_attackModifier");
+		def->defenseModifier = config_entity_int(entity, "com_defenseModifier");
+		def->quantity = config_entity_int(entity, "eq_quantity");
+		def->weight = config_entity_int(entity, "eq_weight");
+		def->slot = config_entity_value(entity, "eq_slot");
+		get_max_counts(config, entity, "appearance_prob", def->appearance);
 	}
-	positionComps = list_new(free);
-	visibilityComps = list_new(free);
-	physicalComps = list_new(free);
-	movementComps = list_new(free);
-	healthComps = list_new(free);
-	combatComps = list_new(free);
-	equipmentComps = list_new(free);
-	treasureComps = list_new(free);
-	animationComps = list_new(free);
-
-	carriedItems = list_new(free);
-	gemsFoundTotal = 0;
+	return defs;
+}
+
+void item_defs_load(Config *config) {
+	mem_free(itemDefs);
+	itemDefs = item_defs_build(config, &itemDefCount);
+}
+
+internal i32 
+config_map_width(const char *s) {
+	i32 width = config_count(s);
+	return (width > MAP_MAX_WIDTH) ? -1 : width;
+}
+
+internal i32 
+config_map_height(const char *s) {
+	i32 height = config_count(s);
+	return (height > MAP_MAX_HEIGHT) ? -1 : height;
+}
+
+void level_defs_build(Config *config, LevelDef *defs) {
+	// Fills in all MAX_DUNGEON_LEVEL defs
+	i32 maxMonsters[MAX_DUNGEON_LEVEL] = {0};
+	i32 maxItems[MAX_DUNGEON_LEVEL] = {0};
+	i32 mapWidths[MAX_DUNGEON_LEVEL];
+	i32 mapHeights[MAX_DUNGEON_LEVEL];
+	i32 mapGeneratorTypes[MAX_DUNGEON_LEVEL];
+	i32 roomFills[MAX_DUNGEON_LEVEL];
+	i32 roomMinSizes[MAX_DUNGEON_LEVEL];
+	i32 roomMaxSizes[MAX_DUNGEON_LEVEL];
+	for (i32 i = 0; i < MAX_DUNGEON_LEVEL; i++) {
+		mapWidths[i] = MAP_DEFAULT_WIDTH;
+		mapHeights[i] = MAP_DEFAULT_HEIGHT;
+		mapGeneratorTypes[i] = MAP_GEN_ROOMS;
+		roomFills[i] = ROOM_DEFAULT_FILL;
+		roomMinSizes[i] = ROOM_DEFAULT_MIN_SIZE;
+		roomMaxSizes[i] = ROOM_DEFAULT_MAX_SIZE;
+	}
+
+	ListElement *e = list_head(config->entities);
+	if (e != NULL) {
+		ConfigEntity *levelEntity = (ConfigEntity *)e->data;
+		get_max_counts(config, levelEntity, "max_monsters", maxMonsters);
+		get_max_counts(config, levelEntity, "max_items", maxItems);
+		get_level_values(config, levelEntity, "map_width", mapWidths, config_map_width);
+		get_level_values(config, levelEntity, "map_height", mapHeights, config_map_height);
+		get_level_values(config, levelEntity, "map_generator", mapGeneratorTypes, map_generator_from_name);
+		get_max_counts(config, levelEntity, "room_fill", roomFills);
+		get_max_counts(config, levelEntity, "room_min_size", roomMinSizes);
+		get_max_counts(config, levelEntity, "room_max_size", roomMaxSizes);
+	}
+
+	for (i32 i = 0; i < MAX_DUNGEON_LEVEL; i++) {
+		LevelDef *def = &defs[i];
+		def->maxMonsters = maxMonsters[i];
+		def->maxItems = maxItems[i];
+		def->width = (mapWidths[i] < MAP_MIN_WIDTH) ? MAP_MIN_WIDTH : mapWidths[i];
+		def->height = (mapHeights[i] < MAP_MIN_HEIGHT) ? MAP_MIN_HEIGHT : mapHeights[i];
+		def->map.generator = mapGeneratorTypes[i];
+		def->map.fillPercent = roomFills[i];
+		if (def->map.fillPercent < 0) { def->map.fillPercent = 0; }
+		if (def->map.fillPercent > ROOM_MAX_FILL) { def->map.fillPercent = ROOM_MAX_FILL; }
+		def->map.minSize = (roomMinSizes[i] < ROOM_SMALLEST_SIZE) ? ROOM_SMALLEST_SIZE : roomMinSizes[i];
+		def->map.maxSize = (roomMaxSizes[i] < def->map.minSize) ? def->map.minSize : roomMaxSizes[i];
+	}
+}
+
+void level_defs_load(Config *config) {
+	level_defs_build(config, levelDefs);
+}
+
+void content_tables_build() {
+	// Build the tables used to pick monsters and items for each level
+	i32 *weights = mem_calloc(MEM_CONFIG, monsterDefCount + itemDefCount + 1, sizeof(i32));
+	for (i32 lvl = 0; lvl < MAX_DUNGEON_LEVEL; lvl++) {
+		for (i32 i = 0; i < monsterDefCount; i++) {
+			weights[i] = monsterDefs[i].appearance[lvl];
+		}
+		alias_table_free(&monsterTables[lvl]);
+		alias_table_build(&monsterTables[lvl], weights, monsterDefCount);
+
+		for (i32 i = 0; i < itemDefCount; i++) {
+			weights[i] = itemDefs[i].appearance[lvl];
+		}
+		alias_table_free(&itemTables[lvl]);
+		alias_table_build(&itemTables[lvl], weights, itemDefCount);
+	}
+	mem_free(weights);
+}
 
-	// Parse necessary config files into memory
+bool content_load_text() {
+	// Parse the monster, item and level config, and compile them into tables
+	if (monsterConfig != NULL) { config_file_destroy(monsterConfig); }
+	if (itemConfig != NULL) { config_file_destroy(itemConfig); }
+	if (levelConfig != NULL) { config_file_destroy(levelConfig); }
 	monsterConfig = config_file_parse("monsters.cfg");
 	itemConfig = config_file_parse("items.cfg");
 	levelConfig = config_file_parse("levels.cfg");
+	if ((monsterConfig == NULL) || (itemConfig == NULL) || (levelConfig == NULL)) {
+		fprintf(stderr, "Missing monsters.cfg, items.cfg or levels.cfg\n");
+		return false;
+	}
+
+	monster_defs_load(monsterConfig);
+	item_defs_load(itemConfig);
+	level_defs_load(levelConfig);
+	return (monsterConfig->errorCount == 0) && (itemConfig->errorCount == 0) && (levelConfig->errorCount == 0);
+}
+
+
+/* Compiled Content */
+
+// The monster, item and level config can be compiled (dark -compile-content) 
+// into a blob that loads without any parsing. It's a header, then fixed 
+// layout records for the monsters, items and levels, then a table of the 
+// strings they use. Numbers are stored in the machine's own byte order.
 
-	// Generate our monster appearance probability data
-	get_appearance_prob(monsterConfig, monsterProbability);
+#define CONTENT_BLOB_FILE		"content.bin"
+#define CONTENT_BLOB_MAGIC		0x42434344		// "DCCB"
+#define CONTENT_BLOB_VERSION	1
+#define CONTENT_NO_STRING		0xffffffff
 
-	// Do the same for item probabilities
-	get_appearance_prob(itemConfig, itemProbability);
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 checksum;				// Of everything after the header
+	u32 monsterCount;
+	u32 itemCount;
+	u32 levelCount;
+	u32 stringBytes;
+} ContentHeader;
+
+typedef struct {
+	i32 id;
+	u32 name;					// Offsets into the string table
+	u32 glyph;
+	u32 color;
+	u32 speed;
+	u32 frequency;
+	i32 maxHP;
+	i32 recoveryRate;
+	i32 toHit;
+	i32 attack;
+	i32 defense;
+	i32 appearance[MAX_DUNGEON_LEVEL];
+} ContentMonster;
+
+typedef struct {
+	i32 id;
+	u32 name;
+	u32 glyph;
+	u32 color;
+	i32 toHitModifier;
+	i32 attackModifier;
+	i32 defenseModifier;
+	i32 quantity;
+	i32 weight;
+	u32 slot;
+	i32 appearance[MAX_DUNGEON_LEVEL];
+} ContentItem;
+
+typedef struct {
+	i32 maxMonsters;
+	i32 maxItems;
+	i32 width;
+	i32 height;
+	i32 generator;
+	i32 fillPercent;
+	i32 minSize;
+	i32 maxSize;
+} ContentLevel;
+
+global_variable u8 *contentBlob = NULL;		// Kept while the defs' strings point into it
+global_variable bool contentLoaded = false;
+
+
+internal u32 
+content_checksum(u8 *data, size_t size) {
+	// FNV-1a
+	u32 hash = 2166136261u;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+internal u32 
+content_add_string(char *strings, u32 *stringBytes, char *s) {
+	if (s == NULL) { return CONTENT_NO_STRING; }
+	u32 offset = *stringBytes;
+	if (strings != NULL) { strcpy(strings + offset, s); }
+	*stringBytes += strlen(s) + 1;
+	return offset;
+}
+
+bool content_blob_write(char *filename) {
+	// Write out the content that's currently loaded
+	u32 stringBytes = 0;
+	for (i32 i = 0; i < monsterDefCount; i++) {
+		content_add_string(NULL, &stringBytes, monsterDefs[i].name);
+	}
+	for (i32 i = 0; i < itemDefCount; i++) {
+		content_add_string(NULL, &stringBytes, itemDefs[i].name);
+		content_add_string(NULL, &stringBytes, itemDefs[i].slot);
+	}
+
+	size_t bodySize = (monsterDefCount * sizeof(ContentMonster)) + (itemDefCount * sizeof(ContentItem)) + 
+					  (MAX_DUNGEON_LEVEL * sizeof(ContentLevel)) + stringBytes;
+	u8 *blob = mem_calloc(MEM_CONFIG, 1, sizeof(ContentHeader) + bodySize);
+	ContentHeader *header = (ContentHeader *)blob;
+	ContentMonster *monsters = (ContentMonster *)(header + 1);
+	ContentItem *items = (ContentItem *)(monsters + monsterDefCount);
+	ContentLevel *levels = (ContentLevel *)(items + itemDefCount);
+	char *strings = (char *)(levels + MAX_DUNGEON_LEVEL);
+
+	stringBytes = 0;
+	for (i32 i = 0; i < monsterDefCount; i++) {
+		MonsterDef *def = &monsterDefs[i];
+		ContentMonster *rec = &monsters[i];
+		rec->id = def->id;
+		rec->name = content_add_string(strings, &stringBytes, def->name);
+		rec->glyph = def->glyph;
+		rec->color = def->color;
+		rec->speed = def->speed;
+		rec->frequency = def->frequency;
+		rec->maxHP = def->maxHP;
+		rec->recoveryRate = def->recoveryRate;
+		rec->toHit = def->toHit;
+		rec->attack = def->attack;
+		rec->defense = def->defense;
+		memcpy(rec->appearance, def->appearance, sizeof(rec->appearance));
+	}
+	for (i32 i = 0; i < itemDefCount; i++) {
+		ItemDef *def = &itemDefs[i];
+		ContentItem *rec = &items[i];
+		rec->id = def->id;
+		rec->name = content_add_string(strings, &stringBytes, def->name);
+		rec->glyph = def->glyph;
+		rec->color = def->color;
+		rec->toHitModifier = def->toHitModifier;
+		rec->attackModifier = def->attackModifier;
+		rec->defenseModifier = def->defenseModifier;
+		rec->quantity = def->quantity;
+		rec->weight = def->weight;
+		rec->slot = content_add_string(strings, &stringBytes, def->slot);
+		memcpy(rec->appearance, def->appearance, sizeof(rec->appearance));
+	}
+	for (i32 i = 0; i < MAX_DUNGEON_LEVEL; i++) {
+		LevelDef *def = &levelDefs[i];
+		levels[i] = (ContentLevel) {def->maxMonsters, def->maxItems, def->width, def->height, 
+			def->map.generator, def->map.fillPercent, def->map.minSize, def->map.maxSize};
+	}
+
+	header->magic = CONTENT_BLOB_MAGIC;
+	header->version = CONTENT_BLOB_VERSION;
+	header->monsterCount = monsterDefCount;
+	header->itemCount = itemDefCount;
+	header->levelCount = MAX_DUNGEON_LEVEL;
+	header->stringBytes = stringBytes;
+	header->checksum = content_checksum((u8 *)(header + 1), bodySize);
+
+	bool written = false;
+	FILE *file = fopen(filename, "wb");
+	if (file != NULL) {
+		written = (fwrite(blob, 1, sizeof(ContentHeader) + bodySize, file) == sizeof(ContentHeader) + bodySize);
+		fclose(file);
+	}
+	mem_free(blob);
+	return written;
+}
+
+internal char * 
+content_string(char *strings, u32 stringBytes, u32 offset, bool *valid) {
+	if (offset == CONTENT_NO_STRING) { return NULL; }
+	if (offset >= stringBytes) {
+		*valid = false;
+		return NULL;
+	}
+	return strings + offset;
+}
+
+internal bool 
+content_appearance_valid(i32 *appearance) {
+	for (i32 lvl = 0; lvl < MAX_DUNGEON_LEVEL; lvl++) {
+		if (appearance[lvl] < 0) { return false; }
+	}
+	return true;
+}
+
+internal bool 
+content_level_valid(ContentLevel *rec) {
+	// The same limits level_defs_load() clamps the text config to
+	return (rec->maxMonsters >= 0) && (rec->maxItems >= 0) && 
+		(rec->generator >= 0) && (rec->generator < MAP_GEN_COUNT) && 
+		(rec->width >= MAP_MIN_WIDTH) && (rec->height >= MAP_MIN_HEIGHT) && 
+		(rec->width <= MAP_MAX_WIDTH) && (rec->height <= MAP_MAX_HEIGHT) && 
+		(rec->fillPercent >= 0) && (rec->fillPercent <= ROOM_MAX_FILL) && 
+		(rec->minSize >= ROOM_SMALLEST_SIZE) && (rec->maxSize >= rec->minSize);
+}
+
+bool content_load_blob(char *filename) {
+	// Load compiled content, checking it over first. Returns false (leaving 
+	// the loaded content alone) if there's no blob, or it can't be used.
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	u8 *blob = NULL;
+	if (size >= (long)sizeof(ContentHeader)) {
+		blob = mem_malloc(MEM_CONFIG, size);
+		if (fread(blob, 1, size, file) != (size_t)size) {
+			mem_free(blob);
+			blob = NULL;
+		}
+	}
+	fclose(file);
+	if (blob == NULL) {
+		fprintf(stderr, "%s: too short to be compiled content\n", filename);
+		return false;
+	}
+
+	ContentHeader *header = (ContentHeader *)blob;
+	size_t bodySize = size - sizeof(ContentHeader);
+	char *problem = NULL;
+	if (header->magic != CONTENT_BLOB_MAGIC) {
+		problem = "not compiled content";
+	} else if (header->version != CONTENT_BLOB_VERSION) {
+		problem = "compiled by a different version of the game";
+	} else if (header->levelCount != MAX_DUNGEON_LEVEL) {
+		problem = "wrong number of levels";
+	} else if (((u64)header->monsterCount * sizeof(ContentMonster)) + ((u64)header->itemCount * sizeof(ContentItem)) + 
+				(MAX_DUNGEON_LEVEL * sizeof(ContentLevel)) + header->stringBytes != bodySize) {
+		problem = "wrong size";
+	} else if (content_checksum(blob + sizeof(ContentHeader), bodySize) != header->checksum) {
+		problem = "checksum doesn't match";
+	}
+
+	ContentMonster *monsters = (ContentMonster *)(header + 1);
+	ContentItem *items = (ContentItem *)(monsters + header->monsterCount);
+	ContentLevel *levels = (ContentLevel *)(items + header->itemCount);
+	char *strings = (char *)(levels + MAX_DUNGEON_LEVEL);
+	if ((problem == NULL) && (header->stringBytes > 0) && (strings[header->stringBytes - 1] != '\0')) {
+		problem = "string table isn't terminated";
+	}
+
+	// The defs point straight at the blob's strings
+	MonsterDef *newMonsters = NULL;
+	ItemDef *newItems = NULL;
+	if (problem == NULL) {
+		bool valid = true;
+		newMonsters = mem_calloc(MEM_CONFIG, header->monsterCount + 1, sizeof(MonsterDef));
+		for (u32 i = 0; i < header->monsterCount; i++) {
+			ContentMonster *rec = &monsters[i];
+			MonsterDef *def = &newMonsters[i];
+			if (((rec->id != 0) && (rec->id != (i32)i + 1)) || !content_appearance_valid(rec->appearance)) {
+				valid = false;
+			}
+			def->id = rec->id;
+			def->name = content_string(strings, header->stringBytes, rec->name, &valid);
+			def->glyph = rec->glyph;
+			def->color = rec->color;
+			def->speed = rec->speed;
+			def->frequency = rec->frequency;
+			def->maxHP = rec->maxHP;
+			def->recoveryRate = rec->recoveryRate;
+			def->toHit = rec->toHit;
+			def->attack = rec->attack;
+			def->defense = rec->defense;
+			memcpy(def->appearance, rec->appearance, sizeof(def->appearance));
+		}
+		newItems = mem_calloc(MEM_CONFIG, header->itemCount + 1, sizeof(ItemDef));
+		for (u32 i = 0; i < header->itemCount; i++) {
+			ContentItem *rec = &items[i];
+			ItemDef *def = &newItems[i];
+			if (((rec->id != 0) && (rec->id != (i32)i + 1)) || !content_appearance_valid(rec->appearance)) {
+				valid = false;
+			}
+			def->id = rec->id;
+			def->name = content_string(strings, header->stringBytes, rec->name, &valid);
+			def->glyph = rec->glyph;
+			def->color = rec->color;
+			def->toHitModifier = rec->toHitModifier;
+			def->attackModifier = rec->attackModifier;
+			def->defenseModifier = rec->defenseModifier;
+			def->quantity = rec->quantity;
+			def->weight = rec->weight;
+			def->slot = content_string(strings, header->stringBytes, rec->slot, &valid);
+			memcpy(def->appearance, rec->appearance, sizeof(def->appearance));
+		}
+		for (u32 i = 0; i < MAX_DUNGEON_LEVEL; i++) {
+			if (!content_level_valid(&levels[i])) {
+				valid = false;
+			}
+		}
+		if (!valid) {
+			problem = "bad record";
+		}
+	}
+
+	if (problem != NULL) {
+		fprintf(stderr, "%s: %s\n", filename, problem);
+		mem_free(newMonsters);
+		mem_free(newItems);
+		mem_free(blob);
+		return false;
+	}
+
+	mem_free(monsterDefs);
+	monsterDefs = newMonsters;
+	monsterDefCount = header->monsterCount;
+	mem_free(itemDefs);
+	itemDefs = newItems;
+	itemDefCount = header->itemCount;
+	for (u32 i = 0; i < MAX_DUNGEON_LEVEL; i++) {
+		ContentLevel *rec = &levels[i];
+		levelDefs[i] = (LevelDef) {rec->maxMonsters, rec->maxItems, rec->width, rec->height, 
+			{rec->generator, rec->fillPercent, rec->minSize, rec->maxSize}};
+	}
+
+	mem_free(contentBlob);
+	contentBlob = blob;
+	return true;
+}
+
+internal void 
+content_blob_check_age(char *filename) {
+	// The blob isn't rebuilt by itself, so say if the config has changed since
+	char *sources[] = {"monsters.cfg", "items.cfg", "levels.cfg"};
+	struct stat blobInfo;
+	if (stat(filename, &blobInfo) != 0) { return; }
+	for (u32 i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+		struct stat info;
+		if ((stat(sources[i], &info) == 0) && (info.st_mtime > blobInfo.st_mtime)) {
+			fprintf(stderr, "%s: older than %s - run dark -compile-content to update it\n", filename, sources[i]);
+		}
+	}
+}
 
-	// Get level generation config information
-	ListElement *e = list_head(levelConfig->entities);
+void content_load() {
+	// Use compiled content if there is any, otherwise the text config
+	if (content_load_blob(CONTENT_BLOB_FILE)) {
+		content_blob_check_age(CONTENT_BLOB_FILE);
+	} else {
+		content_load_text();
+	}
+	content_tables_build();
+	contentLoaded = true;
+}
+
+void content_unload() {
+	for (i32 lvl = 0; lvl < MAX_DUNGEON_LEVEL; lvl++) {
+		alias_table_free(&monsterTables[lvl]);
+		alias_table_free(&itemTables[lvl]);
+	}
+	mem_free(monsterDefs);
+	monsterDefs = NULL;
+	monsterDefCount = 0;
+	mem_free(itemDefs);
+	itemDefs = NULL;
+	itemDefCount = 0;
+	if (monsterConfig != NULL) { config_file_destroy(monsterConfig); }
+	if (itemConfig != NULL) { config_file_destroy(itemConfig); }
+	if (levelConfig != NULL) { config_file_destroy(levelConfig); }
+	monsterConfig = NULL;
+	itemConfig = NULL;
+	levelConfig = NULL;
+	mem_free(contentBlob);
+	contentBlob = NULL;
+	contentLoaded = false;
+}
+
+bool content_compile() {
+	// Compile the text config into a blob (from the command line)
+	if (!content_load_text()) {
+		return false;
+	}
+	return content_blob_write(CONTENT_BLOB_FILE);
+}
+
+internal void
+visibility_free(void *data) {
+	Visibility *vis = (Visibility *)data;
+	mem_free(vis->name);
+	mem_free(vis);
+}
+
+internal void
+equipment_free(void *data) {
+	Equipment *equip = (Equipment *)data;
+	mem_free(equip->slot);
+	mem_free(equip);
+}
+
+internal void
+component_remove(List *components, void *comp) {
+	// Take a component out of its list, and free it
+	ListElement *e = list_search(components, comp);
 	if (e != NULL) {
-		ConfigEntity *levelEntity = (ConfigEntity *)e->data;
-		get_max_counts(levelEntity, "max_monsters", maxMonsters);
-		get_max_counts(levelEntity, "max_items", maxItems);
+		list_remove(components, e);
+		components->destroy(comp);
 	}
+}
 
-	// Clear our message log if necessary
-	if (messageLog != NULL) {
-		list_destroy(messageLog);
-		messageLog = NULL;
+void world_state_destroy() {
+	// Free the components, and the lists that refer to game objects (which
+	// live in gameObjects, so aren't freed themselves)
+	List **lists[] = {
+		&positionComps, &visibilityComps, &physicalComps, &movementComps, &healthComps,
+		&combatComps, &equipmentComps, &treasureComps, &animationComps, &carriedItems
+	};
+	for (u32 i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		if (*lists[i] != NULL) {
+			list_destroy(*lists[i]);
+			*lists[i] = NULL;
+		}
 	}
-	
+	for (u32 i = 0; i < MAX_GO; i++) {
+		gameObjects[i].id = UNUSED;
+		for (i32 comp = 0; comp < COMPONENT_COUNT; comp++) {
+			gameObjects[i].components[comp] = NULL;
+		}
+	}
+	gameObjectsHash = 0;
+	player = NULL;
+	message_log_clear();
+	game_events_clear();
+	memset(&runStats, 0, sizeof(runStats));
+}
+
+void world_state_init() {
+	// Start over with an empty world (throwing away whatever was there)
+	world_state_destroy();
+	positionComps = list_new(mem_free);
+	visibilityComps = list_new(visibility_free);
+	physicalComps = list_new(mem_free);
+	movementComps = list_new(mem_free);
+	healthComps = list_new(mem_free);
+	combatComps = list_new(mem_free);
+	equipmentComps = list_new(equipment_free);
+	treasureComps = list_new(mem_free);
+	animationComps = list_new(mem_free);
+
+	carriedItems = list_new(NULL);
+	gemsFoundTotal = 0;
+
+	// Load the monster, item and level content (just the once)
+	if (!contentLoaded) {
+		content_load();
+	}
+
 	// TODO: Other one-time data generation using config data?
 
 }
@@ -322,6 +1167,7 @@ GameObject *game_object_create() {
 		if (gameObjects[i].id == UNUSED) {
 			go = &gameObjects[i];
 			go->id = i;
+			gameObjectsHash += rng_derive_seed(i, 0);
 			break;
 		}
 	}
@@ -346,12 +1192,12 @@ void game_object_update_component(GameObject *obj,
 				Position *pos = obj->components[COMP_POSITION];
 				bool addedNew = false;
 				if (pos == NULL) {
-					pos = (Position *)calloc(1, sizeof(Position));
+					pos = (Position *)mem_calloc(MEM_ECS, 1, sizeof(Position));
 					addedNew = true;
 				} else {
 					// Remove game obj from the position helper DS
-					List *ls = goPositions[pos->x][pos->y];
-					list_remove_element_with_data(ls, obj);
+					cell_objects_remove(obj, pos->x, pos->y);
+					render_cell_invalidate(pos->x, pos->y);
 				}
 				Position *posData = (Position *)compData;
 				pos->objectId = obj->id;
@@ -367,24 +1213,20 @@ void game_object_update_component(GameObject *obj,
 				obj->components[comp] = pos;
 
 				// Update our helper DS 
-				List *gos = goPositions[posData->x][posData->y];
-				if (gos == NULL) {
-					gos = list_new(free);
-					goPositions[posData->x][posData->y] = gos;
-				}
-				list_insert_after(gos, NULL, obj);
+				cell_objects_add(obj, posData->x, posData->y);
+				render_cell_invalidate(posData->x, posData->y);
 
 			} else {
 				// Clear component 
 				Position *pos = obj->components[COMP_POSITION];
 				if (pos != NULL) {
-					list_remove_element_with_data(positionComps, pos);	
+					// Remove game obj from the position helper DS
+					cell_objects_remove(obj, pos->x, pos->y);
+					render_cell_invalidate(pos->x, pos->y);
+
+					component_remove(positionComps, pos);	
 				}
 				obj->components[comp] = NULL;
-
-				// Remove game obj from the position helper DS
-				List *ls = goPositions[pos->x][pos->y];
-				list_remove_element_with_data(ls, obj);
 			}
 
 			break;
@@ -395,7 +1237,7 @@ void game_object_update_component(GameObject *obj,
 				Visibility *vis = obj->components[COMP_VISIBILITY];
 				bool addedNew = false;
 				if (vis == NULL)  {
-					vis = (Visibility *)calloc(1, sizeof(Visibility));
+					vis = (Visibility *)mem_calloc(MEM_ECS, 1, sizeof(Visibility));
 					addedNew = true;
 				}
 				Visibility *visData = (Visibility *)compData;
@@ -406,8 +1248,11 @@ void game_object_update_component(GameObject *obj,
 				vis->hasBeenSeen = visData->hasBeenSeen;
 				vis->visibleOutsideFOV = visData->visibleOutsideFOV;
 				if (visData->name != NULL) {
-					vis->name = calloc(strlen(visData->name) + 1, sizeof(char));
-					strcpy(vis->name, visData->name);
+					// (Copied before the old name goes, in case they're the same)
+					char *name = mem_calloc(MEM_ECS, strlen(visData->name) + 1, sizeof(char));
+					strcpy(name, visData->name);
+					mem_free(vis->name);
+					vis->name = name;
 				}
 
 				if (addedNew) {
@@ -420,11 +1265,17 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Visibility *vis = obj->components[COMP_VISIBILITY];
 				if (vis != NULL) {
-					list_remove_element_with_data(visibilityComps, vis);				
+					component_remove(visibilityComps, vis);				
 				}
 				obj->components[comp] = NULL;
 			}
 
+			// Whatever is drawn in the object's cell may have changed
+			Position *visPos = obj->components[COMP_POSITION];
+			if (visPos != NULL) {
+				render_cell_invalidate(visPos->x, visPos->y);
+			}
+
 			break;
 		}
 
@@ -433,7 +1284,7 @@ void game_object_update_component(GameObject *obj,
 				Physical *phys = obj->components[COMP_PHYSICAL];
 				bool addedNew = false;
 				if (phys == NULL) {
-					phys = (Physical *)calloc(1, sizeof(Physical));
+					phys = (Physical *)mem_calloc(MEM_ECS, 1, sizeof(Physical));
 					addedNew = true;
 				}
 				Physical *physData = (Physical *)compData;
@@ -450,7 +1301,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Physical *phys = obj->components[COMP_PHYSICAL];
 				if (phys != NULL) {
-					list_remove_element_with_data(physicalComps, phys);				
+					component_remove(physicalComps, phys);				
 				}
 				obj->components[comp] = NULL;
 			}
@@ -463,7 +1314,7 @@ void game_object_update_component(GameObject *obj,
 				Movement *mv = obj->components[COMP_MOVEMENT];
 				bool addedNew = false;
 				if (mv == NULL) {
-					mv = (Movement *)calloc(1, sizeof(Movement));
+					mv = (Movement *)mem_calloc(MEM_ECS, 1, sizeof(Movement));
 					addedNew = true;
 				}
 				Movement *mvData = (Movement *)compData;
@@ -483,7 +1334,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Movement *mv = obj->components[COMP_MOVEMENT];
 				if (mv != NULL) {
-					list_remove_element_with_data(movementComps, mv);				
+					component_remove(movementComps, mv);				
 				}
 				obj->components[comp] = NULL;				
 			}
@@ -496,7 +1347,7 @@ void game_object_update_component(GameObject *obj,
 				Health *hlth = obj->components[COMP_HEALTH];
 				bool addedNew = false;
 				if (hlth == NULL) {
-					hlth = (Health *)calloc(1, sizeof(Health));
+					hlth = (Health *)mem_calloc(MEM_ECS, 1, sizeof(Health));
 					addedNew = true;
 				}
 				Health *hlthData = (Health *)compData;
@@ -515,7 +1366,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Health *h = obj->components[COMP_HEALTH];
 				if (h != NULL) {
-					list_remove_element_with_data(healthComps, h);				
+					component_remove(healthComps, h);				
 				}
 				obj->components[comp] = NULL;				
 			}
@@ -528,7 +1379,7 @@ void game_object_update_component(GameObject *obj,
 				Combat *com = obj->components[COMP_COMBAT];
 				bool addedNew = false;
 				if (com == NULL) {
-					com = (Combat *)calloc(1, sizeof(Combat));
+					com = (Combat *)mem_calloc(MEM_ECS, 1, sizeof(Combat));
 					addedNew = true;
 				}
 				Combat *combatData = (Combat *)compData;
@@ -549,7 +1400,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Combat *c = obj->components[COMP_COMBAT];
 				if (c != NULL) {
-					list_remove_element_with_data(combatComps, c);				
+					component_remove(combatComps, c);				
 				}
 				obj->components[comp] = NULL;				
 			}
@@ -562,7 +1413,7 @@ void game_object_update_component(GameObject *obj,
 				Equipment *equip = obj->components[COMP_EQUIPMENT];
 				bool addedNew = false;
 				if (equip == NULL) {
-					equip = (Equipment *)calloc(1, sizeof(Equipment));
+					equip = (Equipment *)mem_calloc(MEM_ECS, 1, sizeof(Equipment));
 					addedNew = true;
 				}
 
@@ -572,8 +1423,10 @@ void game_object_update_component(GameObject *obj,
 				equip->weight = equipData->weight;
 				equip->lifetime = equipData->lifetime;
 				if (equipData->slot != NULL) {
-					equip->slot = calloc(strlen(equipData->slot) + 1, sizeof(char));
-					strcpy(equip->slot, equipData->slot);
+					char *slot = mem_calloc(MEM_ECS, strlen(equipData->slot) + 1, sizeof(char));
+					strcpy(slot, equipData->slot);
+					mem_free(equip->slot);
+					equip->slot = slot;
 				}
 				equip->isEquipped = equipData->isEquipped;
 
@@ -586,7 +1439,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Equipment *e = obj->components[COMP_EQUIPMENT];
 				if (e != NULL) {
-					list_remove_element_with_data(equipmentComps, e);				
+					component_remove(equipmentComps, e);				
 				}
 				obj->components[comp] = NULL;				
 			}
@@ -599,7 +1452,7 @@ void game_object_update_component(GameObject *obj,
 				Treasure *treas = obj->components[COMP_TREASURE];
 				bool addedNew = false;
 				if (treas == NULL) {
-					treas = (Treasure *)calloc(1, sizeof(Treasure));
+					treas = (Treasure *)mem_calloc(MEM_ECS, 1, sizeof(Treasure));
 					addedNew = true;
 				}
 
@@ -616,7 +1469,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Treasure *t = obj->components[COMP_TREASURE];
 				if (t != NULL) {
-					list_remove_element_with_data(treasureComps, t);				
+					component_remove(treasureComps, t);				
 				}
 				obj->components[comp] = NULL;				
 			}
@@ -629,7 +1482,7 @@ void game_object_update_component(GameObject *obj,
 				Animation *anim = obj->components[COMP_ANIMATION];
 				bool addedNew = false;
 				if (anim == NULL) {
-					anim = (Animation *)calloc(1, sizeof(Animation));
+					anim = (Animation *)mem_calloc(MEM_ECS, 1, sizeof(Animation));
 					addedNew = true;
 				}
 
@@ -650,7 +1503,7 @@ void game_object_update_component(GameObject *obj,
 				// Clear component 
 				Animation *a = obj->components[COMP_ANIMATION];
 				if (a != NULL) {
-					list_remove_element_with_data(animationComps, a);				
+					component_remove(animationComps, a);				
 				}
 				obj->components[comp] = NULL;				
 			}
@@ -664,315 +1517,1267 @@ void game_object_update_component(GameObject *obj,
 
 }
 
-void game_object_destroy(GameObject *obj) {
-	ListElement *elementToRemove = list_search(positionComps, obj->components[COMP_POSITION]);
-	if (elementToRemove != NULL ) { list_remove(positionComps, elementToRemove); }
-
-	elementToRemove = list_search(visibilityComps, obj->components[COMP_VISIBILITY]);
-	if (elementToRemove != NULL ) { list_remove(visibilityComps, elementToRemove); }
+void game_object_destroy(GameObject *obj) {
+	// Take the object off the map before we lose track of where it was
+	Position *pos = obj->components[COMP_POSITION];
+	if (pos != NULL) {
+		cell_objects_remove(obj, pos->x, pos->y);
+		render_cell_invalidate(pos->x, pos->y);
+	}
+
+	List *lists[COMPONENT_COUNT] = {
+		[COMP_POSITION] = positionComps,
+		[COMP_VISIBILITY] = visibilityComps,
+		[COMP_PHYSICAL] = physicalComps,
+		[COMP_HEALTH] = healthComps,
+		[COMP_MOVEMENT] = movementComps,
+		[COMP_COMBAT] = combatComps,
+		[COMP_EQUIPMENT] = equipmentComps,
+		[COMP_TREASURE] = treasureComps,
+		[COMP_ANIMATION] = animationComps
+	};
+	for (i32 comp = 0; comp < COMPONENT_COUNT; comp++) {
+		component_remove(lists[comp], obj->components[comp]);
+	}
+
+	gameObjectsHash -= rng_derive_seed(obj->id, 0);
+	obj->id = UNUSED;
+	for (i32 i = 0; i < COMPONENT_COUNT; i++) {
+		obj->components[i] = NULL;
+	}
+}
+
+
+void *game_object_get_component(GameObject *obj, 
+								GameComponentType comp) {
+	return obj->components[comp];
+}
+
+List *game_objects_at_position(i32 x, i32 y) {
+	// Most cells never have anything in them, so rather than give every cell 
+	// its own list, the empty ones (and anywhere off the map) share this one.
+	local_persist List noObjects = {0};
+	List *objects = cell_objects_find(x, y, false);
+	if (objects == NULL) { 
+		return &noObjects; 
+	}
+	return objects;
+}
+
+
+/* Cell Objects */
+
+internal u32 
+cell_objects_slot(i32 cell) {
+	return ((u32)cell * 2654435761u) >> (32 - CELL_OBJECTS_BITS);
+}
+
+List *cell_objects_find(i32 x, i32 y, bool create) {
+	// Returns the list of objects in the given cell, adding one if asked to
+	if (!map_in_bounds(x, y)) { return NULL; }
+
+	i32 cell = MAP_IDX(x, y);
+	u32 slot = cell_objects_slot(cell);
+	while (cellObjects[slot].cell != UNUSED) {
+		if (cellObjects[slot].cell == cell) {
+			return cellObjects[slot].objects;
+		}
+		slot = (slot + 1) & (CELL_OBJECTS_CAPACITY - 1);
+	}
+
+	if (!create) { return NULL; }
+
+	// Lists here only point at entries in gameObjects, so they don't own their data
+	cellObjects[slot].cell = cell;
+	cellObjects[slot].objects = list_new(NULL);
+	return cellObjects[slot].objects;
+}
+
+u64 cell_objects_hash(i32 cell, List *objects) {
+	// What a cell's objects add to the hash of every cell's. The order counts,
+	// since the most recent arrival on a layer is the one that's drawn.
+	u64 hash = (u64)cell;
+	for (ListElement *e = list_head(objects); e != NULL; e = list_next(e)) {
+		hash = rng_derive_seed(hash, ((GameObject *)list_data(e))->id + 1);
+	}
+	return hash;
+}
+
+void cell_objects_add(GameObject *obj, i32 x, i32 y) {
+	// Put the object on top of the given cell's objects
+	List *objects = cell_objects_find(x, y, true);
+	if (objects == NULL) { return; }
+	i32 cell = MAP_IDX(x, y);
+	if (list_size(objects) > 0) { cellObjectsHash -= cell_objects_hash(cell, objects); }
+	list_insert_after(objects, NULL, obj);
+	cellObjectsHash += cell_objects_hash(cell, objects);
+}
+
+void cell_objects_remove(GameObject *obj, i32 x, i32 y) {
+	// Take the object out of the given cell, and drop the cell's list once it's empty
+	i32 cell = MAP_IDX(x, y);
+	u32 slot = cell_objects_slot(cell);
+	while (cellObjects[slot].cell != cell) {
+		if (cellObjects[slot].cell == UNUSED) { return; }
+		slot = (slot + 1) & (CELL_OBJECTS_CAPACITY - 1);
+	}
+
+	List *objects = cellObjects[slot].objects;
+	cellObjectsHash -= cell_objects_hash(cell, objects);
+	list_remove_element_with_data(objects, obj);
+	if (list_size(objects) > 0) {
+		cellObjectsHash += cell_objects_hash(cell, objects);
+		return;
+	}
+	list_destroy(objects);
+
+	// Shuffle any entries that were displaced past this slot back into the gap, 
+	// so lookups never stop short at an empty slot
+	u32 hole = slot;
+	u32 next = (hole + 1) & (CELL_OBJECTS_CAPACITY - 1);
+	while (cellObjects[next].cell != UNUSED) {
+		u32 home = cell_objects_slot(cellObjects[next].cell);
+		if (((next - home) & (CELL_OBJECTS_CAPACITY - 1)) >= ((next - hole) & (CELL_OBJECTS_CAPACITY - 1))) {
+			cellObjects[hole] = cellObjects[next];
+			hole = next;
+		}
+		next = (next + 1) & (CELL_OBJECTS_CAPACITY - 1);
+	}
+	cellObjects[hole].cell = UNUSED;
+	cellObjects[hole].objects = NULL;
+}
+
+
+/* Map Storage */
+
+bool map_in_bounds(i32 x, i32 y) {
+	return (x >= 0) && (x < mapWidth) && (y >= 0) && (y < mapHeight);
+}
+
+internal void 
+chunk_destroy(Chunk *chunk) {
+	mem_free(chunk->cells);
+	mem_free(chunk->renderCells);
+	mem_free(chunk->packed);
+	mem_free(chunk);
+}
+
+void map_storage_destroy() {
+	// Clear out the per-cell world state left over from the previous level 
+	// (or game)
+	for (i32 i = 0; i < CELL_OBJECTS_CAPACITY; i++) {
+		if (cellObjects[i].objects != NULL) {
+			list_destroy(cellObjects[i].objects);
+		}
+		cellObjects[i].cell = UNUSED;
+		cellObjects[i].objects = NULL;
+	}
+
+	if (chunks != NULL) {
+		for (i32 i = 0; i < chunksWide * chunksHigh; i++) {
+			if (chunks[i] != NULL) {
+				chunk_destroy(chunks[i]);
+			}
+		}
+		mem_free(chunks);
+		chunks = NULL;
+	}
+}
+
+void map_storage_init(i32 width, i32 height) {
+	// Set up the per-cell world state for an empty map of the new size
+	map_storage_destroy();
+
+	mapWidth = width;
+	mapHeight = height;
+	mapHash = 0;
+	cellObjectsHash = 0;
+	chunksWide = (width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	chunksHigh = (height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	chunks = mem_calloc(MEM_MAPGEN, chunksWide * chunksHigh, sizeof(Chunk *));
+
+	fov_reset();
+}
+
+internal u64
+map_cell_hash(i32 chunkIndex, i32 cell, u8 flags) {
+	// What a cell adds to the map's hash. Adding these up means the hash can
+	// be kept up to date a cell at a time.
+	return rng_derive_seed(((u64)chunkIndex * CHUNK_CELLS) + cell, flags + 1);
+}
+
+internal void
+map_hash_add_packed(i32 chunkIndex, u8 *packed, u32 packedSize) {
+	// Add the cells of a chunk that's arrived packed (from a save)
+	i32 cell = 0;
+	for (u32 p = 0; p + 1 < packedSize; p += 2) {
+		for (i32 i = 0; i < packed[p]; i++) {
+			mapHash += map_cell_hash(chunkIndex, cell++, packed[p + 1]);
+		}
+	}
+}
+
+internal u32 
+chunk_cells_pack(u8 *cells, u8 ignoreFlags, u8 *buffer) {
+	// Run-length encode the cell flags as (count, flags) pairs, into a buffer 
+	// big enough for CHUNK_CELLS * 2 bytes. Returns the packed size.
+	u32 size = 0;
+	i32 i = 0;
+	while (i < CHUNK_CELLS) {
+		u8 flags = cells[i] & ~ignoreFlags;
+		u8 count = 0;
+		while ((i < CHUNK_CELLS) && ((cells[i] & ~ignoreFlags) == flags) && (count < 255)) {
+			count += 1;
+			i += 1;
+		}
+		buffer[size++] = count;
+		buffer[size++] = flags;
+	}
+	return size;
+}
+
+internal bool 
+chunk_packed_valid(u8 *packed, u32 packedSize) {
+	// Checks that packed cells (from a save, say) unpack to exactly one chunk
+	u32 cells = 0;
+	for (u32 p = 0; p + 1 < packedSize; p += 2) {
+		cells += packed[p];
+	}
+	return ((packedSize % 2) == 0) && (cells == CHUNK_CELLS);
+}
+
+internal void 
+chunk_pack(Chunk *chunk) {
+	// Far off chunks are mostly long runs of rock and remembered floor, so 
+	// they pack down a lot
+	local_persist u8 buffer[CHUNK_CELLS * 2];
+	u32 size = chunk_cells_pack(chunk->cells, 0, buffer);
+
+	chunk->packed = mem_malloc(MEM_MAPGEN, size);
+	memcpy(chunk->packed, buffer, size);
+	chunk->packedSize = size;
+
+	mem_free(chunk->cells);
+	mem_free(chunk->renderCells);
+	chunk->cells = NULL;
+	chunk->renderCells = NULL;
+	chunk->state = CHUNK_COLD;
+	chunk->dirty = true;
+}
+
+internal void 
+chunk_unpack(Chunk *chunk) {
+	chunk->cells = mem_malloc(MEM_MAPGEN, CHUNK_CELLS * sizeof(u8));
+	i32 i = 0;
+	for (u32 p = 0; p < chunk->packedSize; p += 2) {
+		memset(&chunk->cells[i], chunk->packed[p + 1], chunk->packed[p]);
+		i += chunk->packed[p];
+	}
+
+	// Render cells aren't kept while packed, so work them all out again
+	chunk->renderCells = mem_calloc(MEM_MAPGEN, CHUNK_CELLS, sizeof(RenderCell));
+	for (i32 c = 0; c < CHUNK_CELLS; c++) {
+		chunk->renderCells[c].dirty = true;
+	}
+
+	mem_free(chunk->packed);
+	chunk->packed = NULL;
+	chunk->packedSize = 0;
+	chunk->state = CHUNK_HOT;
+	chunk->dirty = true;
+}
+
+internal Chunk * 
+chunk_create(i32 chunkX, i32 chunkY, bool *mapCells, i32 left, i32 top, i32 width) {
+	// Create a chunk with its walls copied out of the given map cells, which 
+	// start at the given map position
+	Chunk *chunk = mem_calloc(MEM_MAPGEN, 1, sizeof(Chunk));
+	chunk->state = CHUNK_HOT;
+	chunk->dirty = true;
+	chunk->cells = mem_malloc(MEM_MAPGEN, CHUNK_CELLS * sizeof(u8));
+	chunk->renderCells = mem_calloc(MEM_MAPGEN, CHUNK_CELLS, sizeof(RenderCell));
+
+	i32 chunkIndex = (chunkY * chunksWide) + chunkX;
+	for (i32 cy = 0; cy < CHUNK_SIZE; cy++) {
+		for (i32 cx = 0; cx < CHUNK_SIZE; cx++) {
+			i32 x = (chunkX * CHUNK_SIZE) + cx;
+			i32 y = (chunkY * CHUNK_SIZE) + cy;
+			bool wall = !map_in_bounds(x, y) || mapCells[CELL_IDX(x - left, y - top, width)];
+			chunk->cells[CHUNK_CELL(cx, cy)] = wall ? CELL_WALL : 0;
+			chunk->renderCells[CHUNK_CELL(cx, cy)].dirty = true;
+			mapHash += map_cell_hash(chunkIndex, CHUNK_CELL(cx, cy), chunk->cells[CHUNK_CELL(cx, cy)]);
+		}
+	}
+
+	chunks[chunkIndex] = chunk;
+	return chunk;
+}
+
+internal u32 
+chunk_door_offset(u32 seed, i32 chunkX, i32 chunkY, u32 side) {
+	// Where along an edge the door between two chunks goes. Both chunks work 
+	// it out from the level's seed, so it lines up whichever is made first.
+	u32 h = seed ^ ((u32)chunkX * 73856093u) ^ ((u32)chunkY * 19349663u) ^ (side * 83492791u);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	return (h % (CHUNK_SIZE - 2)) + 1;
+}
+
+internal void 
+chunk_generate(i32 chunkX, i32 chunkY) {
+	ChunkPlan plan;
+	chunk_plan_build(currentLevel, chunkX, chunkY, &plan);
+	chunk_plan_apply(&plan);
+	list_destroy(plan.spawns);
+}
+
+void map_chunks_update(i32 x, i32 y) {
+	// Make sure everything around the given position has been generated and 
+	// unpacked, and pack away the chunks that are now far enough off.
+	i32 nearX = x / CHUNK_SIZE;
+	i32 nearY = y / CHUNK_SIZE;
+	for (i32 chunkY = 0; chunkY < chunksHigh; chunkY++) {
+		for (i32 chunkX = 0; chunkX < chunksWide; chunkX++) {
+			i32 distance = abs(chunkX - nearX);
+			if (abs(chunkY - nearY) > distance) { distance = abs(chunkY - nearY); }
+			Chunk *chunk = chunks[(chunkY * chunksWide) + chunkX];
+			if (distance <= CHUNK_HOT_RADIUS) {
+				if (chunk == NULL) {
+					chunk_generate(chunkX, chunkY);
+				} else if (chunk->state == CHUNK_COLD) {
+					chunk_unpack(chunk);
+				}
+			} else if ((distance > CHUNK_COLD_RADIUS) && (chunk != NULL) && (chunk->state == CHUNK_HOT)) {
+				chunk_pack(chunk);
+			}
+		}
+	}
+}
+
+internal Chunk *
+map_chunk_for_cell(i32 x, i32 y) {
+	// Returns the chunk holding the given cell (unpacking it if need be), or 
+	// NULL if it's off the map or hasn't been generated yet
+	if (!map_in_bounds(x, y)) { return NULL; }
+	Chunk *chunk = chunks[((y / CHUNK_SIZE) * chunksWide) + (x / CHUNK_SIZE)];
+	if ((chunk != NULL) && (chunk->state == CHUNK_COLD)) {
+		chunk_unpack(chunk);
+	}
+	return chunk;
+}
+
+bool map_chunk_is_hot(i32 x, i32 y) {
+	if (!map_in_bounds(x, y)) { return false; }
+	Chunk *chunk = chunks[((y / CHUNK_SIZE) * chunksWide) + (x / CHUNK_SIZE)];
+	return (chunk != NULL) && (chunk->state == CHUNK_HOT);
+}
+
+u8 map_cell_flags(i32 x, i32 y) {
+	Chunk *chunk = map_chunk_for_cell(x, y);
+	if (chunk == NULL) {
+		// Anywhere off the map (or not generated yet) is unseen solid rock
+		return CELL_WALL;
+	}
+	return chunk->cells[CHUNK_CELL(x, y)];
+}
+
+bool is_wall(i32 x, i32 y) {
+	return (map_cell_flags(x, y) & CELL_WALL) != 0;
+}
+
+internal void
+map_cell_change(i32 x, i32 y, u8 setFlags, u8 clearFlags) {
+	Chunk *chunk = map_chunk_for_cell(x, y);
+	if (chunk == NULL) {
+		return;
+	}
+	u8 *cell = &chunk->cells[CHUNK_CELL(x, y)];
+	u8 flags = (*cell | setFlags) & ~clearFlags;
+	if (flags != *cell) {
+		i32 chunkIndex = ((y / CHUNK_SIZE) * chunksWide) + (x / CHUNK_SIZE);
+		mapHash += map_cell_hash(chunkIndex, CHUNK_CELL(x, y), flags) - map_cell_hash(chunkIndex, CHUNK_CELL(x, y), *cell);
+		*cell = flags;
+		chunk->dirty = true;
+	}
+}
+
+void map_cell_set_flags(i32 x, i32 y, u8 flags) {
+	map_cell_change(x, y, flags, 0);
+}
+
+void map_cell_clear_flags(i32 x, i32 y, u8 flags) {
+	map_cell_change(x, y, 0, flags);
+}
+
+
+/* Render Cells */
+
+void render_cell_invalidate(i32 x, i32 y) {
+	// Packed chunks don't have render cells - they're all rebuilt on unpacking
+	if (map_chunk_is_hot(x, y)) {
+		Chunk *chunk = chunks[((y / CHUNK_SIZE) * chunksWide) + (x / CHUNK_SIZE)];
+		chunk->renderCells[CHUNK_CELL(x, y)].dirty = true;
+	}
+}
+
+RenderCell *render_cell_resolve(i32 x, i32 y) {
+	// Work out which object is visible on each layer of the given cell. Cells 
+	// are only re-resolved after something in them has changed.
+	Chunk *chunk = map_chunk_for_cell(x, y);
+	assert(chunk != NULL);
+	RenderCell *cell = &chunk->renderCells[CHUNK_CELL(x, y)];
+	if (cell->dirty) {
+		for (i32 layer = LAYER_UNSET; layer <= LAYER_TOP; layer++) {
+			cell->layers[layer] = UNUSED;
+		}
+
+		// Objects are added to the head of the position list, so the most 
+		// recent arrival on a layer wins (e.g. a corpse over the floor).
+		ListElement *e = list_head(game_objects_at_position(x, y));
+		while (e != NULL) {
+			GameObject *go = (GameObject *)list_data(e);
+			Position *p = (Position *)game_object_get_component(go, COMP_POSITION);
+			Visibility *vis = (Visibility *)game_object_get_component(go, COMP_VISIBILITY);
+			if (p != NULL && vis != NULL && p->layer <= LAYER_TOP && cell->layers[p->layer] == UNUSED) {
+				cell->layers[p->layer] = go->id;
+			}
+			e = list_next(e);
+		}
+
+		cell->dirty = false;
+	}
+
+	return cell;
+}
+
+Visibility *render_cell_layer(RenderCell *cell, i32 layer) {
+	// Returns the Visibility of the object drawn on the given layer of a cell, if any
+	i16 id = cell->layers[layer];
+	if (id == UNUSED) { return NULL; }
+	return (Visibility *)game_object_get_component(&gameObjects[id], COMP_VISIBILITY);
+}
+
+
+/* Game objects */
+
+void item_add(char *name, i32 x, i32 y, u8 layer, asciiChar glyph, u32 fgColor, 
+	i32 hitMod, i32 attMod, i32 defMod, i32 quantity, i32 weight, char *slot) {
+
+	GameObject *item = game_object_create();
+	Position pos = {.objectId = item->id, .x = x, .y = y, .layer = layer};
+	game_object_update_component(item, COMP_POSITION, &pos);
+	Physical phys = {.objectId = item->id, .blocksMovement = false, .blocksSight = false};
+	game_object_update_component(item, COMP_PHYSICAL, &phys);
+	Visibility vis = {.objectId = item->id, .glyph = glyph, .fgColor = fgColor, .bgColor = 0x00000000, .visibleOutsideFOV = false, .name = name};
+	game_object_update_component(item, COMP_VISIBILITY, &vis);
+	Combat com = {.objectId = item->id, .toHitModifier = hitMod, .attackModifier = attMod, .defenseModifier = defMod };
+	game_object_update_component(item, COMP_COMBAT, &com);
+	Equipment eq = {.objectId = item->id, .quantity = quantity, .weight = weight, .slot = slot, .lifetime = EQUIP_LIFETIME};
+	game_object_update_component(item, COMP_EQUIPMENT, &eq);
+}
+
+void npc_add(char *name, i32 x, i32 y, u8 layer, asciiChar glyph, u32 fgColor, 
+	u32 speed, u32 frequency, i32 maxHP, i32 hpRecRate, 
+	i32 toHit, i32 hitMod, i32 attack, i32 defense, i32 attMod, i32 defMod) {
+	
+	GameObject *npc = game_object_create();
+	Position pos = {.objectId = npc->id, .x = x, .y = y, .layer = layer};
+	game_object_update_component(npc, COMP_POSITION, &pos);
+	Visibility vis = {.objectId = npc->id, .glyph = glyph, .fgColor = fgColor, .bgColor = 0x00000000, .visibleOutsideFOV = false, .name = name};
+	game_object_update_component(npc, COMP_VISIBILITY, &vis);
+	Physical phys = {.objectId = npc->id, .blocksMovement = true, .blocksSight = false};
+	game_object_update_component(npc, COMP_PHYSICAL, &phys);
+	Movement mv = {.objectId = npc->id, .speed = speed, .frequency = frequency, .ticksUntilNextMove = frequency, 
+		.chasingPlayer = false, .turnsSincePlayerSeen = 0};
+	game_object_update_component(npc, COMP_MOVEMENT, &mv);
+	Health hlth = {.objectId = npc->id, .currentHP = maxHP, .maxHP = maxHP, .recoveryRate = hpRecRate};
+	game_object_update_component(npc, COMP_HEALTH, &hlth);
+	Combat com = {.objectId = npc->id, .attack = attack, .defense = defense, .toHit = toHit, .toHitModifier = hitMod, .attackModifier = attMod, .defenseModifier = defMod};
+	game_object_update_component(npc, COMP_COMBAT, &com);
+}
+
+
+/* Level Management */
+
+i32 item_for_level(RNG *rng, i32 level) {
+	// Returns the id of an item, or 0 if none can turn up on this level
+	return alias_table_pick(&itemTables[level-1], rng) + 1;
+}
+
+i32 monster_for_level(RNG *rng, i32 level) {
+	return alias_table_pick(&monsterTables[level-1], rng) + 1;
+}
+
+void level_add_monster(i32 monsterId, Point pt) {
+	if ((monsterId < 1) || (monsterId > monsterDefCount)) { return; }
+	MonsterDef *def = &monsterDefs[monsterId-1];
+	if (def->id == 0) { return; }
+
+	npc_add(def->name, pt.x, pt.y, LAYER_TOP, def->glyph, def->color, def->speed, def->frequency, 
+		def->maxHP, def->recoveryRate, def->toHit, 0, def->attack, def->defense, 0, 0);
+}
+
+void level_add_item(i32 itemId, Point pt) {
+	if ((itemId < 1) || (itemId > itemDefCount)) { return; }
+	ItemDef *def = &itemDefs[itemId-1];
+	if (def->id == 0) { return; }
+
+	item_add(def->name, pt.x, pt.y, LAYER_MID, def->glyph, def->color, def->toHitModifier, 
+		def->attackModifier, def->defenseModifier, def->quantity, def->weight, def->slot);
+}
+
+void level_add_gem(Point pt) {
+	GameObject *gem = game_object_create();
+	Position gemPos = {.objectId = gem->id, .x = pt.x, .y = pt.y, .layer = LAYER_MID};
+	game_object_update_component(gem, COMP_POSITION, &gemPos);
+	Visibility vis = {.objectId = gem->id, .glyph = 4, .fgColor = 0x753aabff, .bgColor = 0x00000000, .visibleOutsideFOV = false, .name="Gem"};
+	game_object_update_component(gem, COMP_VISIBILITY, &vis);
+	Physical phys = {.objectId = gem->id, .blocksMovement = false, .blocksSight = false};
+	game_object_update_component(gem, COMP_PHYSICAL, &phys);
+	Treasure treas = {.objectId = gem->id, .value = 1};
+	game_object_update_component(gem, COMP_TREASURE, &treas);
+	Animation anim = {.objectId = gem->id, .keyFrameInterval = 3, .ticksUntilKeyframe = 3, .finished = false, .keyframeAnimation = animateGem, .value1 = 0};
+	game_object_update_component(gem, COMP_ANIMATION, &anim);
+}
+
+void level_add_stairs(i32 levelNumber, Point pt) {
+	GameObject *stairs = game_object_create();
+	Position stairPos = {.objectId = stairs->id, .x = pt.x, .y = pt.y, .layer = LAYER_MID};
+	game_object_update_component(stairs, COMP_POSITION, &stairPos);
+	if (levelNumber < 20) {
+		Visibility vis = {.objectId = stairs->id, .glyph = '>', .fgColor = 0xffd700ff, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name="Stairs"};
+		game_object_update_component(stairs, COMP_VISIBILITY, &vis);
+	} else {
+		Visibility vis = {.objectId = stairs->id, .glyph = 15, .fgColor = 0x80ff80ff, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name="Stairs"};
+		game_object_update_component(stairs, COMP_VISIBILITY, &vis);
+	}
+	Physical phys = {.objectId = stairs->id, .blocksMovement = false, .blocksSight = false};
+	game_object_update_component(stairs, COMP_PHYSICAL, &phys);
+}
+
+void level_spawns_apply(i32 levelNumber, List *spawns) {
+	// Create the objects set out in a level (or chunk) plan
+	for (ListElement *e = list_head(spawns); e != NULL; e = list_next(e)) {
+		Spawn *spawn = (Spawn *)list_data(e);
+		switch (spawn->type) {
+			case SPAWN_MONSTER:
+				level_add_monster(spawn->entityId, spawn->pt);
+				break;
+			case SPAWN_ITEM:
+				level_add_item(spawn->entityId, spawn->pt);
+				break;
+			case SPAWN_GEM:
+				level_add_gem(spawn->pt);
+				break;
+			case SPAWN_STAIRS:
+				level_add_stairs(levelNumber, spawn->pt);
+				break;
+		}
+	}
+}
+
+
+/* Level Plans */
+
+internal void 
+plan_add_spawn(List *spawns, SpawnType type, i32 entityId, Point pt) {
+	Spawn *spawn = mem_calloc(MEM_MAPGEN, 1, sizeof(Spawn));
+	spawn->type = type;
+	spawn->entityId = entityId;
+	spawn->pt = pt;
+	list_insert_after(spawns, list_tail(spawns), spawn);
+}
+
+internal void 
+plan_add_spawns(RNG *rng, i32 levelNumber, List *spawns, OpenCells *open, i32 left, i32 top, 
+				i32 monsters, i32 items, i32 gems, bool stairs) {
+	// Plan where things go in a map (or chunk) whose top left is at left, top. 
+	// Everything goes in its own reachable cell - stairs and gems first, so 
+	// they're never left out if the map runs out of room.
+	Point pt;
+	if (stairs && open_cells_take(rng, open, &pt)) {
+		plan_add_spawn(spawns, SPAWN_STAIRS, 0, (Point) {left + pt.x, top + pt.y});
+	}
+
+	for (i32 i = 0; i < gems; i++) {
+		if (open_cells_take(rng, open, &pt)) {
+			plan_add_spawn(spawns, SPAWN_GEM, 0, (Point) {left + pt.x, top + pt.y});
+		}
+	}
+
+	for (i32 i = 0; i < monsters; i++) {
+		// Consult our monster appearance data to determine what monster to generate.
+		i32 monsterId = monster_for_level(rng, levelNumber);
+		if (open_cells_take(rng, open, &pt)) {
+			plan_add_spawn(spawns, SPAWN_MONSTER, monsterId, (Point) {left + pt.x, top + pt.y});
+		}
+	}
+
+	for (i32 i = 0; i < items; i++) {
+		// Consult our item appearance data to determine what item to generate.
+		i32 itemId = item_for_level(rng, levelNumber);
+		if (open_cells_take(rng, open, &pt)) {
+			plan_add_spawn(spawns, SPAWN_ITEM, itemId, (Point) {left + pt.x, top + pt.y});
+		}
+	}
+}
+
+i32 level_chunk_share(RNG *rng, DungeonLevel *level, i32 levelTotal) {
+	// How many of a level-wide total of things belong in one chunk - the 
+	// fractional part is rolled for, so the level gets about the right number
+	i32 levelCells = level->width * level->height;
+	i32 share = (levelTotal * CHUNK_CELLS) / levelCells;
+	i32 remainder = (levelTotal * CHUNK_CELLS) % levelCells;
+	if ((i32)rng_range(rng, levelCells) < remainder) {
+		share += 1;
+	}
+	return share;
+}
+
+bool *level_whole_map(DungeonLevel *level) {
+	// The whole map of a lazily generated level that's sliced up into chunks, 
+	// generated the first time it's needed (after loading a save, say)
+	if (level->wholeMap == NULL) {
+		RNG mapRng;
+		rng_seed(&mapRng, level->mapSeed);
+		level->wholeMap = mem_calloc(MEM_MAPGEN, level->width * level->height, sizeof(bool));
+		map_generate(&mapRng, level->wholeMap, level->width, level->height, level->map);
+	}
+	return level->wholeMap;
+}
+
+internal void 
+level_chunk_slice(DungeonLevel *level, i32 chunkX, i32 chunkY, bool *cells) {
+	bool *wholeMap = level_whole_map(level);
+	for (i32 cy = 0; cy < CHUNK_SIZE; cy++) {
+		memcpy(&cells[CHUNK_CELL(0, cy)], &wholeMap[CELL_IDX(chunkX * CHUNK_SIZE, (chunkY * CHUNK_SIZE) + cy, level->width)], 
+			   CHUNK_SIZE * sizeof(bool));
+	}
+}
+
+void chunk_plan_build(DungeonLevel *level, i32 chunkX, i32 chunkY, ChunkPlan *plan) {
+	// Plan one chunk of a lazily generated level. Each chunk is generated by 
+	// itself, with doors on its edges to join it up with its neighbours - 
+	// unless the level's generator needs to see the whole map, when the chunk 
+	// is a slice of that.
+	i32 levelChunksWide = level->width / CHUNK_SIZE;
+	i32 levelChunksHigh = level->height / CHUNK_SIZE;
+
+	// Each chunk has its own streams, so it comes out the same whenever it's generated
+	i32 chunkIdx = (chunkY * levelChunksWide) + chunkX;
+	RNG mapRng;
+	RNG spawnRng;
+	rng_seed(&mapRng, rng_derive_seed(level->mapSeed, chunkIdx));
+	rng_seed(&spawnRng, rng_derive_seed(level->spawnSeed, chunkIdx));
+
+	plan->chunkX = chunkX;
+	plan->chunkY = chunkY;
+	if (map_generator_needs_whole_map(level->map.generator)) {
+		level_chunk_slice(level, chunkX, chunkY, plan->cells);
+	} else {
+		// Doors on the right and bottom edges belong to this chunk, and doors 
+		// on the left and top belong to the neighbours on those sides
+		u32 seed = (u32)level->mapSeed;
+		Point doors[4];
+		i32 doorCount = 0;
+		if (chunkX > 0) {
+			doors[doorCount++] = (Point) {0, chunk_door_offset(seed, chunkX - 1, chunkY, 0)};
+		}
+		if (chunkX < levelChunksWide - 1) {
+			doors[doorCount++] = (Point) {CHUNK_SIZE - 1, chunk_door_offset(seed, chunkX, chunkY, 0)};
+		}
+		if (chunkY > 0) {
+			doors[doorCount++] = (Point) {chunk_door_offset(seed, chunkX, chunkY - 1, 1), 0};
+		}
+		if (chunkY < levelChunksHigh - 1) {
+			doors[doorCount++] = (Point) {chunk_door_offset(seed, chunkX, chunkY, 1), CHUNK_SIZE - 1};
+		}
+		map_generate_chunk(&mapRng, plan->cells, doors, doorCount, level->map);
+	}
+
+	// Place this chunk's share of the level's monsters and items, along with 
+	// any gems or stairs that were set aside for it
+	LevelDef *def = &levelDefs[level->level-1];
+	i32 monsters = level_chunk_share(&spawnRng, level, def->maxMonsters);
+	i32 items = level_chunk_share(&spawnRng, level, def->maxItems);
+	i32 gems = 0;
+	for (i32 i = 0; i < GEMS_PER_LEVEL; i++) {
+		if (level->gemChunks[i] == chunkIdx) { gems += 1; }
+	}
+
+	plan->spawns = list_new(mem_free);
+	OpenCells open = open_cells_new(plan->cells, CHUNK_SIZE, CHUNK_SIZE);
+	plan_add_spawns(&spawnRng, level->level, plan->spawns, &open, chunkX * CHUNK_SIZE, chunkY * CHUNK_SIZE, 
+					monsters, items, gems, (level->stairsChunk == chunkIdx));
+	open_cells_free(&open);
+}
+
+void chunk_plan_apply(ChunkPlan *plan) {
+	chunk_create(plan->chunkX, plan->chunkY, plan->cells, plan->chunkX * CHUNK_SIZE, plan->chunkY * CHUNK_SIZE, CHUNK_SIZE);
+	level_spawns_apply(currentLevel->level, plan->spawns);
+}
+
+DungeonLevel * level_new(i32 levelNumber) {
+	// Set out the size and seeds of a level, ready for planning
+	DungeonLevel *level = mem_calloc(MEM_MAPGEN, 1, sizeof(DungeonLevel));
+	level->level = levelNumber;
+	LevelDef *def = &levelDefs[levelNumber-1];
+	level->width = def->width;
+	level->height = def->height;
+	level->map = def->map;
+	level->stairsChunk = UNUSED;
+	for (i32 i = 0; i < GEMS_PER_LEVEL; i++) {
+		level->gemChunks[i] = UNUSED;
+	}
+
+	// Each level gets its own streams, so it comes out the same for a given 
+	// run seed no matter what happened on the levels before it
+	level->mapSeed = rng_derive_seed(rng_derive_seed(runSeed, RNG_STREAM_MAPGEN), levelNumber);
+	level->spawnSeed = rng_derive_seed(rng_derive_seed(runSeed, RNG_STREAM_SPAWN), levelNumber);
+
+	if (level->width * level->height > MAP_EAGER_MAX_CELLS) {
+		// Huge levels are built up a chunk at a time, so they need to be made 
+		// of whole chunks
+		level->generateLazily = true;
+		level->width = ((level->width + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+		level->height = ((level->height + CHUNK_SIZE - 1) / CHUNK_SIZE) * CHUNK_SIZE;
+	}
+
+	return level;
+}
+
+void level_free(DungeonLevel *level) {
+	if (level != NULL) {
+		mem_free(level->wholeMap);
+		mem_free(level);
+	}
+}
+
+internal i32 
+level_random_chunk(RNG *rng, DungeonLevel *level, i32 chunkCount) {
+	// A random chunk of a lazily generated level. Slices of a whole map can be 
+	// solid rock, so for those it's one with somewhere to stand in it.
+	i32 chunkIdx = rng_range(rng, chunkCount);
+	if (level->wholeMap == NULL) {
+		return chunkIdx;
+	}
+	i32 levelChunksWide = level->width / CHUNK_SIZE;
+	for (i32 tries = 0; tries < chunkCount * 4; tries++) {
+		bool cells[CHUNK_CELLS];
+		level_chunk_slice(level, chunkIdx % levelChunksWide, chunkIdx / levelChunksWide, cells);
+		for (i32 c = 0; c < CHUNK_CELLS; c++) {
+			if (!cells[c]) { return chunkIdx; }
+		}
+		chunkIdx = rng_range(rng, chunkCount);
+	}
+	return chunkIdx;
+}
+
+void level_plan_fill(LevelPlan *plan) {
+	// Generate the map and work out where everything goes. This only reads the 
+	// level config, so it's safe to run on a background thread.
+	DungeonLevel *level = plan->level;
+	RNG mapRng;
+	RNG spawnRng;
+	rng_seed(&mapRng, level->mapSeed);
+	rng_seed(&spawnRng, level->spawnSeed);
+	plan->spawns = list_new(mem_free);
+
+	if (level->generateLazily) {
+		// Decide up front which chunks get the stairs and gems, then plan the 
+		// area around where the player starts. The rest of the level gets 
+		// generated (and populated) as the player explores it.
+		i32 levelChunksWide = level->width / CHUNK_SIZE;
+		i32 levelChunksHigh = level->height / CHUNK_SIZE;
+		i32 chunkCount = levelChunksWide * levelChunksHigh;
+		if (map_generator_needs_whole_map(level->map.generator)) {
+			level_whole_map(level);
+		}
+		i32 startChunk = level_random_chunk(&spawnRng, level, chunkCount);
+		do {
+			level->stairsChunk = level_random_chunk(&spawnRng, level, chunkCount);
+		} while (level->stairsChunk == startChunk);
+		for (i32 i = 0; i < GEMS_PER_LEVEL; i++) {
+			level->gemChunks[i] = level_random_chunk(&spawnRng, level, chunkCount);
+		}
+
+		i32 startX = startChunk % levelChunksWide;
+		i32 startY = startChunk / levelChunksWide;
+		i32 planSize = (CHUNK_HOT_RADIUS * 2) + 1;
+		plan->chunkPlans = mem_calloc(MEM_MAPGEN, planSize * planSize, sizeof(ChunkPlan));
+		for (i32 chunkY = startY - CHUNK_HOT_RADIUS; chunkY <= startY + CHUNK_HOT_RADIUS; chunkY++) {
+			for (i32 chunkX = startX - CHUNK_HOT_RADIUS; chunkX <= startX + CHUNK_HOT_RADIUS; chunkX++) {
+				if ((chunkX >= 0) && (chunkX < levelChunksWide) && (chunkY >= 0) && (chunkY < levelChunksHigh)) {
+					ChunkPlan *chunkPlan = &plan->chunkPlans[plan->chunkPlanCount++];
+					chunk_plan_build(level, chunkX, chunkY, chunkPlan);
+
+					if ((chunkX == startX) && (chunkY == startY)) {
+						// Start the player somewhere in the middle chunk that nothing else is in
+						bool taken[CHUNK_CELLS] = {0};
+						for (ListElement *e = list_head(chunkPlan->spawns); e != NULL; e = list_next(e)) {
+							Spawn *spawn = (Spawn *)list_data(e);
+							taken[CHUNK_CELL(spawn->pt.x, spawn->pt.y)] = true;
+						}
+						OpenCells open = open_cells_new(chunkPlan->cells, CHUNK_SIZE, CHUNK_SIZE);
+						open_cells_exclude(&open, taken);
+						Point pt;
+						if (!open_cells_take(&spawnRng, &open, &pt)) {
+							pt = map_nearest_open_cell((Point) {CHUNK_SIZE / 2, CHUNK_SIZE / 2}, chunkPlan->cells, CHUNK_SIZE, CHUNK_SIZE);
+						}
+						open_cells_free(&open);
+						plan->playerStart = (Point) {(chunkX * CHUNK_SIZE) + pt.x, (chunkY * CHUNK_SIZE) + pt.y};
+					}
+				}
+			}
+		}
+
+	} else {
+		// Generate the whole level map
+		plan->mapCells = mem_calloc(MEM_MAPGEN, level->width * level->height, sizeof(bool));
+		map_generate(&mapRng, plan->mapCells, level->width, level->height, level->map);
+
+		// A staircase, gems, and monsters and items (in the numbers given in 
+		// the level config), then the player - all in cells of their own 
+		// that can be reached from each other
+		OpenCells open = open_cells_new(plan->mapCells, level->width, level->height);
+		plan_add_spawns(&spawnRng, level->level, plan->spawns, &open, 0, 0, 
+						levelDefs[level->level-1].maxMonsters, levelDefs[level->level-1].maxItems, GEMS_PER_LEVEL, true);
+		if (!open_cells_take(&spawnRng, &open, &plan->playerStart)) {
+			plan->playerStart = map_nearest_open_cell((Point) {0, 0}, plan->mapCells, level->width, level->height);
+		}
+		open_cells_free(&open);
+	}
+}
+
+LevelPlan * level_plan_new(i32 levelNumber) {
+	LevelPlan *plan = mem_calloc(MEM_MAPGEN, 1, sizeof(LevelPlan));
+	plan->level = level_new(levelNumber);
+	return plan;
+}
+
+void level_plan_destroy(LevelPlan *plan) {
+	for (i32 i = 0; i < plan->chunkPlanCount; i++) {
+		list_destroy(plan->chunkPlans[i].spawns);
+	}
+	mem_free(plan->chunkPlans);
+	if (plan->spawns != NULL) { list_destroy(plan->spawns); }
+	mem_free(plan->mapCells);
+	level_free(plan->level);		// NULL once the level has been put into play
+	mem_free(plan);
+}
+
+internal int 
+level_pregen_run(void *data) {
+	profile_thread_begin("LevelPregen");
+	ProfileMark mark = profile_begin(PROFILE_LEVEL_PREGEN);
+	level_plan_fill((LevelPlan *)data);
+	profile_end(mark);
+	profile_thread_end();
+	return 0;
+}
+
+void level_pregen_start(i32 levelNumber) {
+	// The plan is set up here, since it needs the run seed - everything after 
+	// that happens on the worker thread
+	pregenPlan = level_plan_new(levelNumber);
+	pregenThread = SDL_CreateThread(level_pregen_run, "LevelPregen", pregenPlan);
+	if (pregenThread == NULL) {
+		// No thread, so just do the work now
+		level_plan_fill(pregenPlan);
+	}
+}
+
+LevelPlan * level_pregen_finish() {
+	// Wait for the background level (if any) to be done, and hand it over
+	if (pregenThread != NULL) {
+		SDL_WaitThread(pregenThread, NULL);
+		pregenThread = NULL;
+	}
+	LevelPlan *plan = pregenPlan;
+	pregenPlan = NULL;
+	return plan;
+}
+
+void level_pregen_cancel() {
+	LevelPlan *plan = level_pregen_finish();
+	if (plan != NULL) {
+		level_plan_destroy(plan);
+	}
+}
 
-	elementToRemove = list_search(physicalComps, obj->components[COMP_PHYSICAL]);
-	if (elementToRemove != NULL ) { list_remove(physicalComps, elementToRemove); }
 
-	elementToRemove = list_search(movementComps, obj->components[COMP_MOVEMENT]);
-	if (elementToRemove != NULL ) { list_remove(movementComps, elementToRemove); }
+/* Content Hot Reload */
 
-	elementToRemove = list_search(healthComps, obj->components[COMP_HEALTH]);
-	if (elementToRemove != NULL ) { list_remove(healthComps, elementToRemove); }
+// With dark -watch-content, the monster, item and level config files are 
+// watched on a background thread (with inotify on Linux, or by checking their 
+// modification times elsewhere). A file that changes is parsed again there, 
+// and its defs are built and checked over, and the main thread swaps them in 
+// between frames.
 
-	elementToRemove = list_search(combatComps, obj->components[COMP_COMBAT]);
-	if (elementToRemove != NULL ) { list_remove(combatComps, elementToRemove); }
+#define CONTENT_WATCH_INTERVAL	250		// ms between checks for the watcher to stop (or files to change)
 
-	elementToRemove = list_search(equipmentComps, obj->components[COMP_EQUIPMENT]);
-	if (elementToRemove != NULL ) { list_remove(equipmentComps, elementToRemove); }
+typedef enum {
+	CONTENT_MONSTERS,
+	CONTENT_ITEMS,
+	CONTENT_LEVELS,
+	CONTENT_FILE_COUNT
+} ContentFile;
+
+global_variable char *contentFileNames[CONTENT_FILE_COUNT] = {"monsters.cfg", "items.cfg", "levels.cfg"};
+global_variable SDL_Thread *contentWatchThread = NULL;
+global_variable SDL_atomic_t contentWatchStop;
+global_variable void *contentReloaded[CONTENT_FILE_COUNT];	// ContentReloads waiting to be swapped in
+global_variable bool contentRescaleMonsters = false;		// Update live monsters when their config changes
 
-	elementToRemove = list_search(treasureComps, obj->components[COMP_TREASURE]);
-	if (elementToRemove != NULL ) { list_remove(treasureComps, elementToRemove); }
+typedef struct {
+	Config *config;
+	void *defs;				// The MonsterDefs, ItemDefs or LevelDefs built from it
+	i32 defCount;
+} ContentReload;
 
-	elementToRemove = list_search(animationComps, obj->components[COMP_ANIMATION]);
-	if (elementToRemove != NULL ) { list_remove(animationComps, elementToRemove); }
 
-	// TODO: Clean up other components used by this object
+internal void 
+content_reload_destroy(ContentReload *reload) {
+	config_file_destroy(reload->config);
+	mem_free(reload->defs);
+	mem_free(reload);
+}
 
-	obj->id = UNUSED;
-	for (i32 i = 0; i < COMPONENT_COUNT; i++) {
-		obj->components[i] = NULL;
+internal void 
+content_watch_reparse(ContentFile file) {
+	Config *config = config_file_parse(contentFileNames[file]);
+	if (config == NULL) {
+		fprintf(stderr, "%s: not reloaded\n", contentFileNames[file]);
+		return;
 	}
-}
 
+	// The defs are built here, off to the side, so that every value is 
+	// checked before anything the game is using changes
+	ContentReload *reload = mem_calloc(MEM_CONFIG, 1, sizeof(ContentReload));
+	reload->config = config;
+	switch (file) {
+		case CONTENT_MONSTERS:
+			reload->defs = monster_defs_build(config, &reload->defCount);
+			break;
+		case CONTENT_ITEMS:
+			reload->defs = item_defs_build(config, &reload->defCount);
+			break;
+		default:
+			reload->defs = mem_calloc(MEM_CONFIG, MAX_DUNGEON_LEVEL, sizeof(LevelDef));
+			reload->defCount = MAX_DUNGEON_LEVEL;
+			level_defs_build(config, reload->defs);
+			break;
+	}
+	if (config->errorCount > 0) {
+		// Probably saved with a mistake in it (each one's been reported with 
+		// its line) - keep the old content until it's fixed
+		fprintf(stderr, "%s: not reloaded\n", contentFileNames[file]);
+		content_reload_destroy(reload);
+		return;
+	}
 
-void *game_object_get_component(GameObject *obj, 
-								GameComponentType comp) {
-	return obj->components[comp];
+	// If the last reload hasn't been picked up yet, this one replaces it
+	ContentReload *unclaimed = SDL_AtomicSetPtr(&contentReloaded[file], reload);
+	if (unclaimed != NULL) {
+		content_reload_destroy(unclaimed);
+	}
 }
 
-List *game_objects_at_position(u32 x, u32 y) {
-	return goPositions[x][y];
+internal time_t 
+content_file_modified(char *filename) {
+	struct stat info;
+	return (stat(filename, &info) == 0) ? info.st_mtime : 0;
 }
 
+internal int 
+content_watch_poll(void *data) {
+	(void)data;
+	time_t modified[CONTENT_FILE_COUNT];
+	for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+		modified[f] = content_file_modified(contentFileNames[f]);
+	}
 
-/* Game objects */
-
-void floor_add(u8 x, u8 y) {
-	GameObject *floor = game_object_create();
-	Position floorPos = {.objectId = floor->id, .x = x, .y = y, .layer = LAYER_GROUND};
-	game_object_update_component(floor, COMP_POSITION, &floorPos);
-	Visibility floorVis = {.objectId = floor->id, .glyph = '.', .fgColor = 0x3e3c3cFF, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name="Floor"};
-	game_object_update_component(floor, COMP_VISIBILITY, &floorVis);
-	Physical floorPhys = {.objectId = floor->id, .blocksMovement = false, .blocksSight = false};
-	game_object_update_component(floor, COMP_PHYSICAL, &floorPhys);
+	while (!SDL_AtomicGet(&contentWatchStop)) {
+		SDL_Delay(CONTENT_WATCH_INTERVAL);
+		for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+			time_t t = content_file_modified(contentFileNames[f]);
+			if (t != modified[f]) {
+				modified[f] = t;
+				content_watch_reparse(f);
+			}
+		}
+	}
+	return 0;
 }
 
-void item_add(char *name, u8 x, u8 y, u8 layer, asciiChar glyph, u32 fgColor, 
-	i32 hitMod, i32 attMod, i32 defMod, i32 quantity, i32 weight, char *slot) {
+#ifdef __linux__
+internal int 
+content_watch_run(void *data) {
+	// Editors often save by writing a new file and renaming it over the old 
+	// one, so watch the directory rather than the files themselves
+	int fd = inotify_init1(IN_NONBLOCK);
+	if ((fd < 0) || (inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+		if (fd >= 0) { close(fd); }
+		return content_watch_poll(data);
+	}
 
-	GameObject *item = game_object_create();
-	Position pos = {.objectId = item->id, .x = x, .y = y, .layer = layer};
-	game_object_update_component(item, COMP_POSITION, &pos);
-	Physical phys = {.objectId = item->id, .blocksMovement = false, .blocksSight = false};
-	game_object_update_component(item, COMP_PHYSICAL, &phys);
-	Visibility vis = {.objectId = item->id, .glyph = glyph, .fgColor = fgColor, .bgColor = 0x00000000, .visibleOutsideFOV = false, .name = name};
-	game_object_update_component(item, COMP_VISIBILITY, &vis);
-	Combat com = {.objectId = item->id, .toHitModifier = hitMod, .attackModifier = attMod, .defenseModifier = defMod };
-	game_object_update_component(item, COMP_COMBAT, &com);
-	Equipment eq = {.objectId = item->id, .quantity = quantity, .weight = weight, .slot = slot, .lifetime = EQUIP_LIFETIME};
-	game_object_update_component(item, COMP_EQUIPMENT, &eq);
-}
+	u8 buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (!SDL_AtomicGet(&contentWatchStop)) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		if (poll(&pfd, 1, CONTENT_WATCH_INTERVAL) <= 0) { continue; }
+
+		// Only parse each file once, however many events it got
+		bool changed[CONTENT_FILE_COUNT] = {false};
+		ssize_t length;
+		while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+			u8 *p = buffer;
+			while (p < buffer + length) {
+				struct inotify_event *event = (struct inotify_event *)p;
+				for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+					if ((event->len > 0) && (strcmp(event->name, contentFileNames[f]) == 0)) {
+						changed[f] = true;
+					}
+				}
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+			if (changed[f]) { content_watch_reparse(f); }
+		}
+	}
 
-void npc_add(char *name, u8 x, u8 y, u8 layer, asciiChar glyph, u32 fgColor, 
-	u32 speed, u32 frequency, i32 maxHP, i32 hpRecRate, 
-	i32 toHit, i32 hitMod, i32 attack, i32 defense, i32 attMod, i32 defMod) {
-	
-	GameObject *npc = game_object_create();
-	Position pos = {.objectId = npc->id, .x = x, .y = y, .layer = layer};
-	game_object_update_component(npc, COMP_POSITION, &pos);
-	Visibility vis = {.objectId = npc->id, .glyph = glyph, .fgColor = fgColor, .bgColor = 0x00000000, .visibleOutsideFOV = false, .name = name};
-	game_object_update_component(npc, COMP_VISIBILITY, &vis);
-	Physical phys = {.objectId = npc->id, .blocksMovement = true, .blocksSight = false};
-	game_object_update_component(npc, COMP_PHYSICAL, &phys);
-	Movement mv = {.objectId = npc->id, .speed = speed, .frequency = frequency, .ticksUntilNextMove = frequency, 
-		.chasingPlayer = false, .turnsSincePlayerSeen = 0};
-	game_object_update_component(npc, COMP_MOVEMENT, &mv);
-	Health hlth = {.objectId = npc->id, .currentHP = maxHP, .maxHP = maxHP, .recoveryRate = hpRecRate};
-	game_object_update_component(npc, COMP_HEALTH, &hlth);
-	Combat com = {.objectId = npc->id, .attack = attack, .defense = defense, .toHit = toHit, .toHitModifier = hitMod, .attackModifier = attMod, .defenseModifier = defMod};
-	game_object_update_component(npc, COMP_COMBAT, &com);
+	close(fd);
+	return 0;
 }
+#else
+#define content_watch_run	content_watch_poll
+#endif
 
-void wall_add(u8 x, u8 y) {
-	GameObject *wall = game_object_create();
-	Position wallPos = {.objectId = wall->id, .x = x, .y = y, .layer = LAYER_GROUND};
-	game_object_update_component(wall, COMP_POSITION, &wallPos);
-	Visibility wallVis = {wall->id, '#', 0x675644FF, 0x00000000, .visibleOutsideFOV = true, .name="Wall"};
-	game_object_update_component(wall, COMP_VISIBILITY, &wallVis);
-	Physical wallPhys = {wall->id, true, true};
-	game_object_update_component(wall, COMP_PHYSICAL, &wallPhys);
+void content_watch_start() {
+	SDL_AtomicSet(&contentWatchStop, 0);
+	contentWatchThread = SDL_CreateThread(content_watch_run, "ContentWatch", NULL);
 }
 
+void content_watch_stop() {
+	if (contentWatchThread != NULL) {
+		SDL_AtomicSet(&contentWatchStop, 1);
+		SDL_WaitThread(contentWatchThread, NULL);
+		contentWatchThread = NULL;
+	}
+	for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+		ContentReload *unclaimed = SDL_AtomicSetPtr(&contentReloaded[f], NULL);
+		if (unclaimed != NULL) { content_reload_destroy(unclaimed); }
+	}
+}
 
-/* Level Management */
-
-Point level_get_open_point(bool (*mapCells)[MAP_HEIGHT]) {
-	// Return a random position within the level that is open
-	for (;;) {
-		u32 x = rand() % MAP_WIDTH;
-		u32 y = rand() % MAP_HEIGHT;
-		if (mapCells[x][y] == false) {
-			bool isOccupied = false;
-			List *objs = game_objects_at_position(x, y);
-			ListElement *le = list_head(objs);
-			while (le != NULL) {
-				Equipment *eq = (Equipment *)game_object_get_component(le->data, COMP_EQUIPMENT);
-				Health *h = (Health *)game_object_get_component(le->data, COMP_HEALTH);
-				Treasure *t = (Treasure *)game_object_get_component(le->data, COMP_TREASURE);
-				if ((eq != NULL) || (h != NULL) || (t != NULL)) { 
-					isOccupied = true;
-					break; 
-				}
-				le = list_next(le);
-			}
-			if (!isOccupied) {
-				return (Point) {x, y};
-			}
+internal MonsterDef * 
+content_monster_named(MonsterDef *defs, i32 count, char *name) {
+	for (i32 i = 0; i < count; i++) {
+		if ((defs[i].id != 0) && (defs[i].name != NULL) && (strcmp(defs[i].name, name) == 0)) {
+			return &defs[i];
 		}
 	}
+	return NULL;
 }
 
-i32 item_for_level(i32 level) {
-	u32 r = rand() % 100;
-	u32 accum = 0;
-	for (int i = 0; i < ITEM_TYPE_COUNT; i++) {
-		accum += itemProbability[i][level-1];
-		if (accum >= r) {
-			return i + 1;
+internal void 
+content_rescale_monsters(MonsterDef *oldDefs, i32 oldCount) {
+	// Live monsters only remember their name, so that's how they're matched 
+	// up with the def they were made from. Their HP keeps the same proportion.
+	for (ListElement *e = list_head(healthComps); e != NULL; e = list_next(e)) {
+		Health *hlth = (Health *)list_data(e);
+		if (hlth->objectId == player->id) { continue; }
+		GameObject *npc = &gameObjects[hlth->objectId];
+		Visibility *vis = (Visibility *)game_object_get_component(npc, COMP_VISIBILITY);
+		if ((vis == NULL) || (vis->name == NULL)) { continue; }
+		MonsterDef *oldDef = content_monster_named(oldDefs, oldCount, vis->name);
+		if ((oldDef == NULL) || (oldDef->id > monsterDefCount)) { continue; }
+		MonsterDef *def = &monsterDefs[oldDef->id - 1];
+		if (def->id == 0) { continue; }
+
+		if ((hlth->currentHP > 0) && (hlth->maxHP > 0)) {
+			hlth->currentHP = (hlth->currentHP * def->maxHP) / hlth->maxHP;
+			if (hlth->currentHP < 1) { hlth->currentHP = 1; }
+		}
+		hlth->maxHP = def->maxHP;
+		hlth->recoveryRate = def->recoveryRate;
+
+		Combat *com = (Combat *)game_object_get_component(npc, COMP_COMBAT);
+		if (com != NULL) {
+			com->toHit = def->toHit;
+			com->attack = def->attack;
+			com->defense = def->defense;
+		}
+		Movement *mv = (Movement *)game_object_get_component(npc, COMP_MOVEMENT);
+		if (mv != NULL) {
+			mv->speed = def->speed;
+			mv->frequency = def->frequency;
+		}
+		vis->glyph = def->glyph;
+		vis->fgColor = def->color;
+		if (strcmp(vis->name, def->name) != 0) {
+			mem_free(vis->name);
+			vis->name = String_Create("%s", def->name);
 		}
 	}
-	return 1;
 }
 
-i32 monster_for_level(i32 level) {
-	u32 r = rand() % 100;
-	u32 accum = 0;
-	for (int i = 0; i < MONSTER_TYPE_COUNT; i++) {
-		accum += monsterProbability[i][level-1];
-		if (accum >= r) {
-			return i + 1;
+void content_reload_apply() {
+	// Called between frames, to swap in whatever the watcher has built
+	ContentReload *reloaded[CONTENT_FILE_COUNT];
+	bool anyReloaded = false;
+	for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+		reloaded[f] = SDL_AtomicSetPtr(&contentReloaded[f], NULL);
+		anyReloaded = anyReloaded || (reloaded[f] != NULL);
+	}
+	if (!anyReloaded) {
+		return;
+	}
+	if (!contentLoaded) {
+		// It'll all be parsed fresh when a game starts
+		for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+			if (reloaded[f] != NULL) { content_reload_destroy(reloaded[f]); }
 		}
+		return;
 	}
-	return 1;
-}
 
-ConfigEntity * get_entity_with_id(Config *config, i32 id) {
-	ListElement *e = list_head(config->entities);
-	while (e != NULL) {
-		ConfigEntity *entity = (ConfigEntity *)e->data;
-		i32 eId = atoi(config_entity_value(entity, "id"));
-		if (eId == id) {
-			return entity;
+	// The next level is planned from the tables in the background, so that has 
+	// to finish first - then it's planned again, with the new content
+	LevelPlan *plan = level_pregen_finish();
+	i32 pregenLevel = 0;
+	if (plan != NULL) {
+		pregenLevel = plan->level->level;
+		level_plan_destroy(plan);
+	}
+
+	if (reloaded[CONTENT_MONSTERS] != NULL) {
+		// The old defs (and the config their names are in) are kept until the 
+		// live monsters have been matched up with the new ones
+		ContentReload *reload = reloaded[CONTENT_MONSTERS];
+		MonsterDef *oldDefs = monsterDefs;
+		i32 oldCount = monsterDefCount;
+		Config *oldConfig = monsterConfig;
+		monsterDefs = reload->defs;
+		monsterDefCount = reload->defCount;
+		monsterConfig = reload->config;
+		if (contentRescaleMonsters && currentlyInGame) {
+			content_rescale_monsters(oldDefs, oldCount);
 		}
+		mem_free(oldDefs);
+		if (oldConfig != NULL) { config_file_destroy(oldConfig); }
+		mem_free(reload);
+	}
+	if (reloaded[CONTENT_ITEMS] != NULL) {
+		ContentReload *reload = reloaded[CONTENT_ITEMS];
+		if (itemConfig != NULL) { config_file_destroy(itemConfig); }
+		mem_free(itemDefs);
+		itemConfig = reload->config;
+		itemDefs = reload->defs;
+		itemDefCount = reload->defCount;
+		mem_free(reload);
+	}
+	if (reloaded[CONTENT_LEVELS] != NULL) {
+		ContentReload *reload = reloaded[CONTENT_LEVELS];
+		if (levelConfig != NULL) { config_file_destroy(levelConfig); }
+		levelConfig = reload->config;
+		memcpy(levelDefs, reload->defs, sizeof(levelDefs));
+		mem_free(reload->defs);
+		mem_free(reload);
+	}
+	content_tables_build();
 
-		e = list_next(e);
+	if (pregenLevel > 0) {
+		level_pregen_start(pregenLevel);
 	}
 
-	return NULL;
+	for (i32 f = 0; f < CONTENT_FILE_COUNT; f++) {
+		if (reloaded[f] != NULL) { fprintf(stderr, "Reloaded %s\n", contentFileNames[f]); }
+	}
 }
 
 
 DungeonLevel * level_init(i32 levelToGenerate, GameObject *player) {
-	// Clear the previous level data from the world state
-	// Note: We start at index 1 because the player is at index 0 and we want to keep them!
-	for (u32 i = 1; i < MAX_GO; i++) {
-		if ((gameObjects[i].id != player->id) && 
-			(gameObjects[i].id != UNUSED) &&
-			list_search(carriedItems, &gameObjects[i]) == NULL) {
+	ProfileMark mark = profile_begin(PROFILE_LEVEL_INIT);
 
+	// Use the level that was generated in the background, if it's the right one
+	LevelPlan *plan = level_pregen_finish();
+	if ((plan != NULL) && (plan->level->level != levelToGenerate)) {
+		level_plan_destroy(plan);
+		plan = NULL;
+	}
+
+	// Clear the previous level data from the world state - everything except 
+	// the player and what they're carrying goes
+	local_persist bool keep[MAX_GO];
+	memset(keep, 0, sizeof(keep));
+	keep[player->id] = true;
+	for (ListElement *e = list_head(carriedItems); e != NULL; e = list_next(e)) {
+		keep[((GameObject *)list_data(e))->id] = true;
+	}
+	for (u32 i = 0; i < MAX_GO; i++) {
+		if ((gameObjects[i].id != UNUSED) && !keep[i]) {
 			game_object_destroy(&gameObjects[i]);
 		}
 	}
 
+	// The player is the only thing left on the map - take them off it too, so 
+	// the map storage can be rebuilt for the new level
+	game_object_update_component(player, COMP_POSITION, NULL);
+
+	if (currentLevel != NULL) {
+		level_free(currentLevel);
+		currentLevel = NULL;
+	}
+
 	// Check for game win scenario
 	if (levelToGenerate == 21) {
+		if (plan != NULL) { level_plan_destroy(plan); }
 		game_over();
 		ui_set_active_screen(screen_show_win_game());
+		profile_end(mark);
 		return NULL;
 	}
 
-	// Generate a level map into the world state
-	bool (*mapCells)[MAP_HEIGHT] = calloc(MAP_WIDTH * MAP_HEIGHT, sizeof(bool));
-
-	map_generate(mapCells);
-
-	for (u32 x = 0; x < MAP_WIDTH; x++) {
-		for (u32 y = 0; y < MAP_HEIGHT; y++) {
-			if (mapCells[x][y]) {
-				wall_add(x, y);
-			} else {
-				floor_add(x, y);
-			}
-		}
+	if (plan == NULL) {
+		plan = level_plan_new(levelToGenerate);
+		level_plan_fill(plan);
 	}
 
-	// Create DungeonLevel Object and store relevant info
-	DungeonLevel *level = calloc(1, sizeof(DungeonLevel));
-	level->level = levelToGenerate;
-	level->mapWalls = mapCells;
+	// Put the planned level into play
+	DungeonLevel *level = plan->level;
+	map_storage_init(level->width, level->height);
+	currentLevel = level;
 
-	// Grab the number of monsters to generate for this level from level config
-	i32 monstersToAdd = maxMonsters[levelToGenerate-1];
-	for (i32 i = 0; i < monstersToAdd; i++) {
-		// Consult our monster appearance data to determine what monster to generate.
-		i32 monsterId = monster_for_level(levelToGenerate);
-		ConfigEntity *monsterEntity = get_entity_with_id(monsterConfig, monsterId);
-
-		if (monsterEntity != NULL) {
-			// Add the monster		
-			Point pt = level_get_open_point(mapCells);
-			char *name = config_entity_value(monsterEntity, "name");
-			char *glyph = config_entity_value(monsterEntity, "vis_glyph");
-			asciiChar g = atoi(glyph);
-			char *color = config_entity_value(monsterEntity, "vis_color");
-			u32 c = xtoi(color);
-			char *speed = config_entity_value(monsterEntity, "mv_speed");
-			u32 s = atoi(speed);
-			char *freq = config_entity_value(monsterEntity, "mv_frequency");
-			u32 f = atoi(freq);
-			char *maxHP = config_entity_value(monsterEntity, "h_maxHP");
-			i32 hp = atoi(maxHP);
-			char *recRate = config_entity_value(monsterEntity, "h_recRate");
-			i32 rr = atoi(recRate);
-			i32 hit = atoi(config_entity_value(monsterEntity, "com_toHit"));
-			i32 att = atoi(config_entity_value(monsterEntity, "com_attack"));
-			i32 def = atoi(config_entity_value(monsterEntity, "com_defense"));
-
-			npc_add(name, pt.x, pt.y, LAYER_TOP, g, c, s, f, hp, rr, hit, 0, att, def, 0, 0);
-		}
-	}
-
-	// Sprinkle some items throughout the level
-	i32 itemsToAdd = maxItems[levelToGenerate-1];
-	for (i32 i = 0; i < itemsToAdd; i++) {
-		// Consult our item appearance data to determine what item to generate.
-		i32 itemId = item_for_level(levelToGenerate);
-		ConfigEntity *entity = get_entity_with_id(itemConfig, itemId);
-
-		if (entity != NULL) {
-			// Add the item		
-			Point pt = level_get_open_point(mapCells);
-			char *name = config_entity_value(entity, "name");
-			char *glyph = config_entity_value(entity, "vis_glyph");
-			asciiChar g = atoi(glyph);
-			char *color = config_entity_value(entity, "vis_color");
-			u32 c = xtoi(color);
-
-			i32 toHitMod = atoi(config_entity_value(entity, "com_toHitModifier"));
-			i32 attMod = atoi(config_entity_value(entity, "com_attackModifier"));
-			i32 defMod = atoi(config_entity_value(entity, "com_defenseModifier"));
-
-			i32 qty = atoi(config_entity_value(entity, "eq_quantity"));
-			char *slot = config_entity_value(entity, "eq_slot");
-			i32 weight = atoi(config_entity_value(entity, "eq_weight"));
-
-			item_add(name, pt.x, pt.y, LAYER_MID, g, c, toHitMod, attMod, defMod, qty, weight, slot);
+	if (level->generateLazily) {
+		for (i32 i = 0; i < plan->chunkPlanCount; i++) {
+			chunk_plan_apply(&plan->chunkPlans[i]);
 		}
-	}
-	
-	// Place gems in random positions around the level
-	gemsFoundThisLevel = 0;
-	for (i32 i = 0; i < GEMS_PER_LEVEL; i++) {
-		GameObject *gem = game_object_create();
-		Point ptGem = level_get_open_point(mapCells);
-		Position gemPos = {.objectId = gem->id, .x = ptGem.x, .y = ptGem.y, .layer = LAYER_MID};
-		game_object_update_component(gem, COMP_POSITION, &gemPos);
-		Visibility vis = {.objectId = gem->id, .glyph = 4, .fgColor = 0x753aabff, .bgColor = 0x00000000, .visibleOutsideFOV = false, .name="Gem"};
-		game_object_update_component(gem, COMP_VISIBILITY, &vis);
-		Physical phys = {.objectId = gem->id, .blocksMovement = false, .blocksSight = false};
-		game_object_update_component(gem, COMP_PHYSICAL, &phys);
-		Treasure treas = {.objectId = gem->id, .value = 1};
-		game_object_update_component(gem, COMP_TREASURE, &treas);
-		Animation anim = {.objectId = gem->id, .keyFrameInterval = 3, .ticksUntilKeyframe = 3, .finished = false, .keyframeAnimation = animateGem, .value1 = 0};
-		game_object_update_component(gem, COMP_ANIMATION, &anim);
-	}
-
-	// Place a staircase in a random position in the level
-	GameObject *stairs = game_object_create();
-	Point ptStairs = level_get_open_point(mapCells);
-	Position stairPos = {.objectId = stairs->id, .x = ptStairs.x, .y = ptStairs.y, .layer = LAYER_MID};
-	game_object_update_component(stairs, COMP_POSITION, &stairPos);
-	if (levelToGenerate < 20) {
-		Visibility vis = {.objectId = stairs->id, .glyph = '>', .fgColor = 0xffd700ff, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name="Stairs"};
-		game_object_update_component(stairs, COMP_VISIBILITY, &vis);
 	} else {
-		Visibility vis = {.objectId = stairs->id, .glyph = 15, .fgColor = 0x80ff80ff, .bgColor = 0x00000000, .visibleOutsideFOV = true, .name="Stairs"};
-		game_object_update_component(stairs, COMP_VISIBILITY, &vis);
+		for (i32 chunkY = 0; chunkY < chunksHigh; chunkY++) {
+			for (i32 chunkX = 0; chunkX < chunksWide; chunkX++) {
+				chunk_create(chunkX, chunkY, plan->mapCells, 0, 0, level->width);
+			}
+		}
+		level_spawns_apply(level->level, plan->spawns);
 	}
-	Physical phys = {.objectId = stairs->id, .blocksMovement = false, .blocksSight = false};
-	game_object_update_component(stairs, COMP_PHYSICAL, &phys);
+	gemsFoundThisLevel = 0;
 
 	// Place our player in a random position in the level
-	Point pt = level_get_open_point(mapCells);
+	Point pt = plan->playerStart;
 	Position pos = {.objectId = player->id, .x = pt.x, .y = pt.y, .layer = LAYER_TOP};
 	game_object_update_component(player, COMP_POSITION, &pos);
+	map_chunks_update(pt.x, pt.y);
+
+	plan->level = NULL;
+	level_plan_destroy(plan);
+
+	// Get to work on the next level while this one is played
+	if (levelToGenerate < MAX_DUNGEON_LEVEL) {
+		level_pregen_start(levelToGenerate + 1);
+	}
 
+	profile_end(mark);
 	return level;
 }
 
@@ -1000,13 +2805,10 @@ void level_descend() {
 
 		if (currentLevelNumber <= 20) {
 			Position *playerPos = (Position *)game_object_get_component(player, COMP_POSITION);
-			fov_calculate(playerPos->x, playerPos->y, fovMap);
+			fov_calculate(playerPos->x, playerPos->y);
 			generate_target_map(playerPos->x, playerPos->y);
 
-			char *msg = String_Create("You descend further, and are now on level %d.", currentLevelNumber);
-			add_message("---------------------------------------------------", 0x555555ff);
-			add_message(msg, 0x990000ff);
-			String_Destroy(msg);
+			game_event_push(EVENT_DESCEND, NULL)->amount = currentLevelNumber;
 		}
 
 		// Buff the player's base attack and defense
@@ -1015,7 +2817,7 @@ void level_descend() {
 		combatStats->defense += 1;
 
 	} else {
-		add_message("There are no stairs here, you silly person.", 0x555555ff);
+		game_event_push(EVENT_NO_STAIRS, NULL);
 	}
 
 }
@@ -1024,54 +2826,222 @@ void level_descend() {
 
 
 /* Message */
-void add_message(char *msg, u32 color) {
+u32 message_log_size() {
+	return (messageLog.count < MESSAGE_LOG_SIZE) ? messageLog.count : MESSAGE_LOG_SIZE;
+}
+
+Message * message_log_get(u32 age) {
+	// The newest message is age 0
+	if (age >= message_log_size()) {
+		return NULL;
+	}
+	return &messageLog.messages[(messageLog.count - 1 - age) & (MESSAGE_LOG_SIZE - 1)];
+}
+
+char * message_text(Message *m) {
+	return (m->longText != NULL) ? m->longText : m->text;
+}
+
+void message_log_clear() {
+	for (u32 i = 0; i < MESSAGE_LOG_SIZE; i++) {
+		mem_free(messageLog.messages[i].longText);
+		messageLog.messages[i].longText = NULL;
+	}
+	messageLog.count = 0;
+}
 
-	Message *m = calloc(1, sizeof(Message));
-	if (msg != NULL) {
-		m->msg = calloc(strlen(msg) + 1, sizeof(char));
-		strcpy(m->msg, msg);		
+void message_log_put(char *msg, u32 color, u32 repeats) {
+	// Write the message over the oldest one in the log
+	Message *m = &messageLog.messages[messageLog.count & (MESSAGE_LOG_SIZE - 1)];
+	messageLog.count += 1;
+	mem_free(m->longText);
+	m->longText = NULL;
+	if (msg == NULL) {
+		msg = "";
+	}
+	size_t length = strlen(msg);
+	if (length < MESSAGE_INLINE_SIZE) {
+		memcpy(m->text, msg, length + 1);
 	} else {
-		m->msg = "";
+		m->text[0] = '\0';
+		m->longText = mem_strdup(MEM_UI, msg);
 	}
 	m->fgColor = color;
+	m->repeats = repeats;
+}
+
+void add_message(char *msg, u32 color) {
+	// The same thing said again just counts up the last message
+	Message *last = message_log_get(0);
+	if ((last != NULL) && (msg != NULL) && (last->fgColor == color) && (strcmp(message_text(last), msg) == 0)) {
+		last->repeats += 1;
+		return;
+	}
+	message_log_put(msg, color, 1);
+}
+
+
+/* Game Events */
+
+void game_events_listen(GameEventListener listener) {
+	assert(gameEventListenerCount < GAME_EVENT_MAX_LISTENERS);
+	gameEventListeners[gameEventListenerCount++] = listener;
+}
+
+void game_events_dispatch() {
+	// Hand out everything that happened since last time, in order
+	for (u32 i = 0; i < gameEventCount; i++) {
+		for (i32 l = 0; l < gameEventListenerCount; l++) {
+			gameEventListeners[l](&gameEvents[i]);
+		}
+	}
+	gameEventCount = 0;
+}
+
+void game_events_clear() {
+	gameEventCount = 0;
+}
 
-	// Add message to log
-	if (messageLog == NULL) {
-		messageLog = list_new(NULL);
+internal GameEvent *
+game_event_push(GameEventType type, GameObject *named) {
+	// Note down that something happened (to the named object, if there is 
+	// one - its name's copied, since it may be gone by the time anyone looks)
+	if (gameEventCount == GAME_EVENT_QUEUE_SIZE) {
+		game_events_dispatch();
 	}
-	list_insert_after(messageLog, list_tail(messageLog), m);
+	GameEvent *event = &gameEvents[gameEventCount++];
+	event->type = type;
+	event->byPlayer = false;
+	event->amount = 0;
+	event->name[0] = '\0';
+	Visibility *v = (named != NULL) ? game_object_get_component(named, COMP_VISIBILITY) : NULL;
+	if ((v != NULL) && (v->name != NULL)) {
+		size_t length = strlen(v->name);
+		if (length >= GAME_EVENT_NAME_SIZE) { length = GAME_EVENT_NAME_SIZE - 1; }
+		memcpy(event->name, v->name, length);
+		event->name[length] = '\0';
+	}
+	return event;
+}
 
-	// If our log has exceeded 20 messages, cull the older messages
-	if (list_size(messageLog) > 20) {
-		list_remove(messageLog, NULL);  // Remove the oldest message
+void message_log_event(GameEvent *event) {
+	// Put what happened into words, for the message log
+	char *name = event->name;
+	switch (event->type) {
+		case EVENT_HIT:
+			if (event->amount == 0) {
+				add_message(event->byPlayer ? "Your attack didn't do any damage." : 
+							"The creature's pathetic attack didn't do any damage.", 0xCCCCCCFF);
+			} else if (event->byPlayer) {
+				add_message(String_Frame("You hit the %s for %d damage.", name, event->amount), 0xCCCCCCFF);
+			} else {
+				add_message(String_Frame("The %s hits you for %d damage.", name, event->amount), 0xCCCCCCFF);
+			}
+			break;
+		case EVENT_MISS:
+			if (event->byPlayer) {
+				add_message("Your attack misses.", 0xCCCCCCFF);
+			} else {
+				add_message(String_Frame("The %s misses you.", name), 0xCCCCCCFF);
+			}
+			break;
+		case EVENT_KILL:
+			add_message(String_Frame("You killed the %s.", name), 0xff9900FF);
+			break;
+		case EVENT_DIED:
+			add_message("You have died.", 0xCC0000FF);
+			break;
+		case EVENT_PICKUP:
+			add_message(String_Frame("You picked up the %s.", name), 0x009900ff);
+			break;
+		case EVENT_PICKUP_GEM:
+			add_message(String_Frame("You picked up the %s. Gems left on level:%d", name, event->amount), 0x753aabff);
+			break;
+		case EVENT_TOO_HEAVY:
+			add_message("You are carrying too much already.", 0x990000ff);
+			break;
+		case EVENT_CRUMBLE:
+			if (event->amount) {
+				add_message(String_Frame("The %s crumbles in your hands.", name), 0x990000ff);
+			} else {
+				add_message(String_Frame("The %s you are carrying crumbles to dust.", name), 0x990000ff);
+			}
+			break;
+		case EVENT_DROP:
+			add_message(String_Frame("You dropped the %s.", name), 0x990000ff);
+			break;
+		case EVENT_CANT_DROP:
+			add_message("Can't drop here.", 0x990000ff);
+			break;
+		case EVENT_DESCEND:
+			add_message("---------------------------------------------------", 0x555555ff);
+			add_message(String_Frame("You descend further, and are now on level %d.", event->amount), 0x990000ff);
+			break;
+		case EVENT_NO_STAIRS:
+			add_message("There are no stairs here, you silly person.", 0x555555ff);
+			break;
+		case EVENT_STAIRS_HERE:
+			if (event->amount < 20) {
+				add_message("There are stairs down here. [D]escend?", 0xffd700ff);
+			} else {
+				add_message("There is a glowing portal here. [E]nter?", 0xffd700ff);
+			}
+			break;
+		case EVENT_ITEM_HERE:
+			add_message(String_Frame("There is a %s here. [G]et it?", name), 0x009900ff);
+			break;
 	}
+}
 
+void run_stats_event(GameEvent *event) {
+	// Keep count of how the run's going
+	switch (event->type) {
+		case EVENT_HIT:
+			if (event->byPlayer) {
+				runStats.attacks += 1;
+				runStats.hits += 1;
+				runStats.damageDealt += event->amount;
+			} else {
+				runStats.damageTaken += event->amount;
+			}
+			break;
+		case EVENT_MISS:
+			if (event->byPlayer) { runStats.attacks += 1; }
+			break;
+		case EVENT_KILL:
+			runStats.kills += 1;
+			break;
+		case EVENT_PICKUP:
+		case EVENT_PICKUP_GEM:
+			runStats.itemsPickedUp += 1;
+			break;
+		case EVENT_CRUMBLE:
+			runStats.itemsCrumbled += 1;
+			break;
+		default:
+			break;
+	}
 }
 
 /* Movement System */
 
 bool can_move(Position pos) {
-	bool moveAllowed = true;
+	if (is_wall(pos.x, pos.y)) {
+		return false;
+	}
 
-	if ((pos.x >= 0) && (pos.x < NUM_COLS) && (pos.y >= 0) && (pos.y < NUM_ROWS)) {
-		ListElement *e = list_head(positionComps);
-		while (e != NULL) {
-			Position *p = (Position *)list_data(e);
-			if (p->x == pos.x && p->y == pos.y) {
-				Physical *phys = (Physical *)game_object_get_component(&gameObjects[p->objectId], COMP_PHYSICAL);
-				if (phys->blocksMovement == true) {
-					moveAllowed = false;
-					break;
-				}
-			}		
-			e = list_next(e);
+	// Only the objects in the destination cell can block us
+	ListElement *e = list_head(game_objects_at_position(pos.x, pos.y));
+	while (e != NULL) {
+		GameObject *go = (GameObject *)list_data(e);
+		Physical *phys = (Physical *)game_object_get_component(go, COMP_PHYSICAL);
+		if ((phys != NULL) && (phys->blocksMovement == true)) {
+			return false;
 		}
-
-	} else {
-		moveAllowed = false;
+		e = list_next(e);
 	}
 
-	return moveAllowed;
+	return true;
 }
 
 
@@ -1080,61 +3050,57 @@ typedef struct {
 	i32 weight;
 } TargetPoint;
 
-bool is_wall(i32 x, i32 y) {
-	return currentLevel->mapWalls[x][y];
+i32 target_map_value(i32 x, i32 y) {
+	// Distance from the given cell to the target, or TARGET_UNSET if it's out of range
+	i32 tx = x - targetMapLeft;
+	i32 ty = y - targetMapTop;
+	if ((tx < 0) || (tx >= TARGET_MAP_SIZE) || (ty < 0) || (ty >= TARGET_MAP_SIZE)) {
+		return TARGET_UNSET;
+	}
+	return targetMap[CELL_IDX(tx, ty, TARGET_MAP_SIZE)];
 }
 
 // TODO: Allow for a list of target points to be provided, with differing starting weights/priorities?
 void generate_target_map(i32 targetX, i32 targetY) { // List *targetPoints) {
-	// Clean up any previously generated target map
-	if (targetMap != NULL) {
-		free(targetMap);
-	}
-
-	i32 (* dmap)[MAP_HEIGHT] = calloc(MAP_WIDTH * MAP_HEIGHT, sizeof(i32));
-	i32 UNSET = 9999;
-
-	for (i32 x = 0; x < MAP_WIDTH; x++) {
-		for (i32 y = 0; y < MAP_HEIGHT; y++) {
-			dmap[x][y] = UNSET;
-		}
+	// Breadth-first fill outward from the target, limited to a window around it
+	local_persist i32 queue[TARGET_MAP_SIZE * TARGET_MAP_SIZE];
+	ProfileMark mark = profile_begin(PROFILE_TARGET_MAP);
+
+	targetMapLeft = targetX - TARGET_MAP_RADIUS;
+	targetMapTop = targetY - TARGET_MAP_RADIUS;
+	for (i32 i = 0; i < TARGET_MAP_SIZE * TARGET_MAP_SIZE; i++) {
+		targetMap[i] = TARGET_UNSET;
 	}
 
 	// Set our target point(s)
-	dmap[targetX][targetY] = 0;
+	i32 head = 0;
+	i32 tail = 0;
+	targetMap[CELL_IDX(TARGET_MAP_RADIUS, TARGET_MAP_RADIUS, TARGET_MAP_SIZE)] = 0;
+	queue[tail++] = CELL_IDX(TARGET_MAP_RADIUS, TARGET_MAP_RADIUS, TARGET_MAP_SIZE);
 
 	// Calculate our target map
-	bool changesMade = true;
-	while (changesMade) {
-		changesMade = false;
-
-		for (i32 x = 0; x < MAP_WIDTH; x++) {
-			for (i32 y = 0; y < MAP_HEIGHT; y++) {
-				i32 currCellValue = dmap[x][y];
-				if (currCellValue != UNSET) {
-					// Check cells around this one and update them if warranted
-					if ((!is_wall(x+1, y)) && (dmap[x+1][y] > currCellValue + 1)) { 
-						dmap[x+1][y] = currCellValue + 1;
-						changesMade = true;
-					}
-					if ((!is_wall(x-1, y)) && (dmap[x-1][y] > currCellValue + 1)) { 
-						dmap[x-1][y] = currCellValue + 1;
-						changesMade = true;
-					}
-					if ((!is_wall(x, y-1)) && (dmap[x][y-1] > currCellValue + 1)) { 
-						dmap[x][y-1] = currCellValue + 1;
-						changesMade = true;
-					}
-					if ((!is_wall(x, y+1)) && (dmap[x][y+1] > currCellValue + 1)) { 
-						dmap[x][y+1] = currCellValue + 1;
-						changesMade = true;
-					}
-				}
+	i32 dx[4] = {1, -1, 0, 0};
+	i32 dy[4] = {0, 0, -1, 1};
+	while (head < tail) {
+		i32 idx = queue[head++];
+		i32 tx = idx % TARGET_MAP_SIZE;
+		i32 ty = idx / TARGET_MAP_SIZE;
+		i32 nextValue = targetMap[idx] + 1;
+
+		for (i32 d = 0; d < 4; d++) {
+			i32 nx = tx + dx[d];
+			i32 ny = ty + dy[d];
+			if ((nx < 0) || (nx >= TARGET_MAP_SIZE) || (ny < 0) || (ny >= TARGET_MAP_SIZE)) { continue; }
+			if (is_wall(nx + targetMapLeft, ny + targetMapTop)) { continue; }
+
+			i32 nIdx = CELL_IDX(nx, ny, TARGET_MAP_SIZE);
+			if (targetMap[nIdx] > nextValue) {
+				targetMap[nIdx] = nextValue;
+				queue[tail++] = nIdx;
 			}
 		}
 	}
-
-	targetMap = dmap;
+	profile_end(mark);
 }
 
 void movement_update() {
@@ -1143,6 +3109,13 @@ void movement_update() {
 	while (e != NULL) {
 		Movement *mv = (Movement *)list_data(e);
 
+		// Anything out in the packed up parts of the level stays put until the player gets near
+		Position *curPos = (Position *)game_object_get_component(&gameObjects[mv->objectId], COMP_POSITION);
+		if (!map_chunk_is_hot(curPos->x, curPos->y)) {
+			e = list_next(e);
+			continue;
+		}
+
 		// Determine if the object is going to move this tick
 		mv->ticksUntilNextMove -= 1;
 		if (mv->ticksUntilNextMove <= 0) {
@@ -1155,7 +3128,7 @@ void movement_update() {
 
 			// If the player can see the monster, the monster can see the player
 			bool giveChase = false;
-			if (fovMap[p->x][p->y] > 0) {
+			if (map_cell_flags(p->x, p->y) & FOV_VISIBLE) {
 				// Player is visible
 				giveChase = true;
 				mv->chasingPlayer = true;
@@ -1172,7 +3145,7 @@ void movement_update() {
 			i32 speedCounter = mv->speed;
 			while (speedCounter > 0) {
 				// Determine if we're currently in combat range of the player
-				if ((fovMap[p->x][p->y] > 0) && (targetMap[p->x][p->y] == 1)) {
+				if ((map_cell_flags(p->x, p->y) & FOV_VISIBLE) && (target_map_value(p->x, p->y) == 1)) {
 					// Combat range - so attack the player
 					combat_attack(&gameObjects[mv->objectId], player);
 
@@ -1182,26 +3155,26 @@ void movement_update() {
 						// Evaluate all cardinal direction cells and pick randomly between optimal moves 
 						Position moves[4];
 						i32 moveCount = 0;
-						i32 currTargetValue = targetMap[p->x][p->y];
-						if (targetMap[p->x - 1][p->y] < currTargetValue) {
+						i32 currTargetValue = target_map_value(p->x, p->y);
+						if (target_map_value(p->x - 1, p->y) < currTargetValue) {
 							Position np = newPos;
 							np.x -= 1;	
 							moves[moveCount] = np;					
 							moveCount += 1;
 						}
-						if (targetMap[p->x][p->y - 1] < currTargetValue) { 
+						if (target_map_value(p->x, p->y - 1) < currTargetValue) { 
 							Position np = newPos;
 							np.y -= 1;						
 							moves[moveCount] = np;					
 							moveCount += 1;
 						}
-						if (targetMap[p->x + 1][p->y] < currTargetValue) { 
+						if (target_map_value(p->x + 1, p->y) < currTargetValue) { 
 							Position np = newPos;
 							np.x += 1;						
 							moves[moveCount] = np;					
 							moveCount += 1;
 						}
-						if (targetMap[p->x][p->y + 1] < currTargetValue) { 
+						if (target_map_value(p->x, p->y + 1) < currTargetValue) { 
 							Position np = newPos;
 							np.y += 1;						
 							moves[moveCount] = np;					
@@ -1209,13 +3182,13 @@ void movement_update() {
 						}
 
 						if (moveCount > 0) {
-							u32 moveIdx = rand() % moveCount;
+							u32 moveIdx = rng_range(&aiRng, moveCount);
 							newPos = moves[moveIdx];
 						}
 
 					} else {
 						// Move randomly?
-						u32 dir = rand() % 4;
+						u32 dir = rng_range(&aiRng, 4);
 						switch (dir) {
 							case 0:
 								newPos.x -= 1;
@@ -1258,9 +3231,7 @@ void health_check_death(GameObject *go) {
 	if (h->currentHP <= 0) {
 		// Death!
 		if (go == player) {
-			char *msg = String_Create("You have died.");
-			add_message(msg, 0xCC0000FF);
-			String_Destroy(msg);
+			game_event_push(EVENT_DIED, NULL);
 			game_over();
 			ui_set_active_screen(screen_show_endgame());
 			currentlyInGame = false;			
@@ -1271,12 +3242,11 @@ void health_check_death(GameObject *go) {
 			vis->glyph = '%';
 			vis->fgColor = 0x990000FF;
 
-			char *msg = String_Create("You killed the %s.", vis->name);
-			add_message(msg, 0xff9900FF);
-			String_Destroy(msg);
+			game_event_push(EVENT_KILL, go);
 
 			Position *pos = (Position *)game_object_get_component(go, COMP_POSITION);
 			pos->layer = LAYER_GROUND;
+			render_cell_invalidate(pos->x, pos->y);
 
 			Physical *phys = (Physical *)game_object_get_component(go, COMP_PHYSICAL);
 			phys->blocksMovement = false;
@@ -1321,12 +3291,13 @@ void health_removal_update() {
 	ListElement *e = list_head(healthComps);
 	while (e != NULL) {
 		Health *h = (Health *)list_data(e);
-		if (h->currentHP <= 0) {
+		// (The player is never removed - their death ends the game instead)
+		if ((h->currentHP <= 0) && (h->objectId != player->id)) {
 			if (h->ticksUntilRemoval <= 0) {
 				// Remove object and all related components from world state
-				GameObject goToDestroy = gameObjects[h->objectId];
+				GameObject *goToDestroy = &gameObjects[h->objectId];
 				e = list_next(e);	// Grab the next element in the list, because we're about to destroy this one
-				game_object_destroy(&goToDestroy);
+				game_object_destroy(goToDestroy);
 
 			} else {
 				h->ticksUntilRemoval -= 1;
@@ -1356,28 +3327,10 @@ void combat_deal_damage(GameObject *attacker, GameObject *defender) {
 		totDef += monsterMod;		
 	}
 
-	if (totDef >= totAtt) {
-		if (attacker == player) {
-			add_message("Your attack didn't do any damage.", 0xCCCCCCFF);
-		} else {
-			add_message("The creature's pathetic attack didn't do any damage.", 0xCCCCCCFF);
-		}
-
-	} else {
-		if (attacker == player) {
-			Visibility *vis = game_object_get_component(defender, COMP_VISIBILITY);
-			char *msg = String_Create("You hit the %s for %d damage.", vis->name, (totAtt - totDef));
-			add_message(msg, 0xCCCCCCFF);
-			String_Destroy(msg);
-
-		} else {
-			Visibility *vis = game_object_get_component(attacker, COMP_VISIBILITY);
-			char *msg = String_Create("The %s hits you for %d damage.", vis->name, (totAtt - totDef));
-			add_message(msg, 0xCCCCCCFF);
-			String_Destroy(msg);
-		}
-
-
+	GameEvent *event = game_event_push(EVENT_HIT, (attacker == player) ? defender : attacker);
+	event->byPlayer = (attacker == player);
+	if (totDef < totAtt) {
+		event->amount = totAtt - totDef;
 		defHealth->currentHP -= (totAtt - totDef);
 
 		health_check_death(defender);
@@ -1388,22 +3341,15 @@ void combat_attack(GameObject *attacker, GameObject *defender) {
 	Combat *att = (Combat *)game_object_get_component(attacker, COMP_COMBAT);
 	Combat *def = (Combat *)game_object_get_component(defender, COMP_COMBAT);
 
-	i32 hitRoll = (rand() % 100) + 1;
+	i32 hitRoll = rng_range(&combatRng, 100) + 1;
 	i32 hitWindow = (att->toHit + att->toHitModifier);
 	if ((hitRoll < hitWindow) || (hitRoll == 100)) {
 		// We have a hit
 		combat_deal_damage(attacker, defender);
 	} else {
 		// Missed
-		if (attacker == player) {
-			add_message("Your attack misses.", 0xCCCCCCFF);
-
-		} else {
-			Visibility *vis = game_object_get_component(attacker, COMP_VISIBILITY);
-			char *msg = String_Create("The %s misses you.", vis->name);
-			add_message(msg, 0xCCCCCCFF);
-			String_Destroy(msg);
-		}
+		GameEvent *event = game_event_push(EVENT_MISS, (attacker == player) ? defender : attacker);
+		event->byPlayer = (attacker == player);
 	}
 }
 
@@ -1452,12 +3398,7 @@ void item_get() {
 		gemsFoundThisLevel += 1;
 		gemsFoundTotal += 1;
 
-		Visibility *v = (Visibility *)game_object_get_component(itemObj, COMP_VISIBILITY);
-		if (v != NULL) {
-			char *msg = String_Create("You picked up the %s. Gems left on level:%d", v->name, GEMS_PER_LEVEL - gemsFoundThisLevel);
-			add_message(msg, 0x753aabff);
-			String_Destroy(msg);
-		}
+		game_event_push(EVENT_PICKUP_GEM, itemObj)->amount = GEMS_PER_LEVEL - gemsFoundThisLevel;
 
 		// Destroy the gem game object - we don't need it anymore.
 		game_object_update_component(itemObj, COMP_POSITION, NULL);		// remove it from position tracking lists
@@ -1474,21 +3415,13 @@ void item_get() {
 			// Remove the item from the map (take away its Position comp)
 			game_object_update_component(itemObj, COMP_POSITION, NULL);
 
-			// Write an appropriate message to the log
-			Visibility *v = (Visibility *)game_object_get_component(itemObj, COMP_VISIBILITY);
-			if (v != NULL) {
-				char *msg = String_Create("You picked up the %s.", v->name);
-				add_message(msg, 0x009900ff);
-				String_Destroy(msg);
-			}
+			game_event_push(EVENT_PICKUP, itemObj);
 
 			playerTookTurn = true;
 
 		} else {
 			// Too much to carry
-			char *msg = String_Create("You are carrying too much already.");
-			add_message(msg, 0x990000ff);
-			String_Destroy(msg);
+			game_event_push(EVENT_TOO_HEAVY, itemObj);
 		}
 	}
 }
@@ -1496,6 +3429,7 @@ void item_get() {
 void item_lifetime_update() {
 	ListElement *e = list_head(carriedItems);
 	while (e != NULL) {
+		ListElement *next = list_next(e);	// Grab this now, since the item may be removed from the list below
 		GameObject *go = (GameObject *)list_data(e);
 		Equipment *eq = game_object_get_component(go, COMP_EQUIPMENT);
 		eq->lifetime -= 1;
@@ -1512,21 +3446,12 @@ void item_lifetime_update() {
 			// Remove from carried items
 			list_remove_element_with_data(carriedItems, go);
 			
-			// Display a message to the player
-			Visibility *v = (Visibility *)game_object_get_component(go, COMP_VISIBILITY);
-			char *msg;
-			if (wasEquipped) {
-				msg = String_Create("The %s crumbles in your hands.", v->name);
-			} else {
-				msg = String_Create("The %s you are carrying crumbles to dust.", v->name);
-			}
-			add_message(msg, 0x990000ff);
-			String_Destroy(msg);
+			game_event_push(EVENT_CRUMBLE, go)->amount = wasEquipped;
 			
 			game_object_destroy(go);
 		}
 
-		e = list_next(e);
+		e = next;
 	}
 }
 
@@ -1603,16 +3528,10 @@ void item_drop(GameObject *item) {
 		// Remove from carried items
 		list_remove_element_with_data(carriedItems, item);
 
-		// Display a message to the player
-		Visibility *v = (Visibility *)game_object_get_component(item, COMP_VISIBILITY);
-		char *msg = String_Create("You dropped the %s.", v->name);
-		add_message(msg, 0x990000ff);
-		String_Destroy(msg);
+		game_event_push(EVENT_DROP, item);
 
 	} else {
-		char *msg = String_Create("Can't drop here.");
-		add_message(msg, 0x990000ff);
-		String_Destroy(msg);
+		game_event_push(EVENT_CANT_DROP, item);
 	}
 
 }
@@ -1637,24 +3556,12 @@ void environment_update(Position *playerPos) {
 		}
 		Visibility *v = (Visibility *)game_object_get_component(go, COMP_VISIBILITY);
 		if ((v != NULL) && (String_Equals(v->name, "Stairs"))) {
-			char *msg;
-			if (currentLevelNumber < 20) {
-				msg = String_Create("There are stairs down here. [D]escend?", v->name);
-			} else {
-				msg = String_Create("There is a glowing portal here. [E]nter?", v->name);
-			}
-			add_message(msg, 0xffd700ff);
-			String_Destroy(msg);
+			game_event_push(EVENT_STAIRS_HERE, NULL)->amount = currentLevelNumber;
 		}
 		e = list_next(e);
 	}
-	if (itemObj != NULL) {
-		Visibility *v = (Visibility *)game_object_get_component(itemObj, COMP_VISIBILITY);
-		if (v != NULL) {
-			char *msg = String_Create("There is a %s here. [G]et it?", v->name);
-			add_message(msg, 0x009900ff);
-			String_Destroy(msg);
-		}
+	if ((itemObj != NULL) && (game_object_get_component(itemObj, COMP_VISIBILITY) != NULL)) {
+		game_event_push(EVENT_ITEM_HERE, itemObj);
 	}
 }
 
@@ -1693,8 +3600,18 @@ internal void
 game_new()
 {
 	// -- Start a brand new game --
+	level_pregen_cancel();
 	world_state_init();
 
+	// Pick the seed that everything random in this run comes from
+	runSeed = fixedRunSeed;
+	if (runSeed == 0) {
+		runSeed = ((u64)time(NULL) << 32) ^ SDL_GetPerformanceCounter();
+	}
+	replay_run_seed(&runSeed);
+	rng_seed(&aiRng, rng_derive_seed(runSeed, RNG_STREAM_AI));
+	rng_seed(&combatRng, rng_derive_seed(runSeed, RNG_STREAM_COMBAT));
+
 	// Create our player
 	player = game_object_create();
 	Visibility vis = {.objectId=player->id, .glyph='@', .fgColor=0x00FF00FF, .bgColor=0x00000000, .hasBeenSeen=true, .name="Player"};
@@ -1706,47 +3623,132 @@ game_new()
 	Combat com = {.objectId = player->id, .toHit=80, .toHitModifier=0, .attack = 5, .defense = 2, .attackModifier = 0, .defenseModifier = 0};
 	game_object_update_component(player, COMP_COMBAT, &com);
 
-	playerName = name_create();
+	RNG nameRng;
+	rng_seed(&nameRng, rng_derive_seed(runSeed, RNG_STREAM_SPAWN));
+	mem_free(playerName);
+	playerName = name_create(&nameRng);
 
 	// Create a level and place our player in it
+	turnsTaken = 0;
 	currentLevelNumber = 1;
 	currentLevel = level_init(currentLevelNumber, player);
 	Position *playerPos = (Position *)game_object_get_component(player, COMP_POSITION);
 
-	fov_calculate(playerPos->x, playerPos->y, fovMap);
+	fov_calculate(playerPos->x, playerPos->y);
 
 	generate_target_map(playerPos->x, playerPos->y);
+
+	// Note the seed, so the run can be reproduced
+	char *msg = String_Frame("Run seed: %llu", (unsigned long long)runSeed);
+	add_message(msg, 0x555555ff);
+}
+
+void game_shutdown() {
+	// Let go of everything the game's holding on to, on the way out
+	level_pregen_cancel();
+	world_state_destroy();
+	map_storage_destroy();
+	level_free(currentLevel);
+	currentLevel = NULL;
+	mem_free(playerName);
+	playerName = NULL;
+	if (hofConfig != NULL) {
+		config_file_destroy(hofConfig);
+		hofConfig = NULL;
+	}
+	if (contentLoaded) {
+		content_unload();
+	}
 }
 
 internal void
 game_update() 
 {
+	ProfileMark updateMark = profile_begin(PROFILE_GAME_UPDATE);
+
 	// Have things move themselves around the dungeon if the player moved
 	if (playerTookTurn) {
+		turnsTaken += 1;
+		replay_stage(TURN_STAGE_PLAYER);
 		Position *playerPos = (Position *)game_object_get_component(player, COMP_POSITION);
+		ProfileMark mark = profile_begin(PROFILE_CHUNKS);
+		map_chunks_update(playerPos->x, playerPos->y);
+		profile_end(mark);
 		generate_target_map(playerPos->x, playerPos->y);
+		replay_stage(TURN_STAGE_CHUNKS);
+
+		mark = profile_begin(PROFILE_MOVEMENT);
 		movement_update();		
+		profile_end(mark);
+		replay_stage(TURN_STAGE_MOVEMENT);
+
+		mark = profile_begin(PROFILE_ITEMS);
 		item_lifetime_update();
+		profile_end(mark);
+		replay_stage(TURN_STAGE_ITEMS);
+
+		mark = profile_begin(PROFILE_ENVIRONMENT);
 		environment_update(playerPos);
+		profile_end(mark);
+		replay_stage(TURN_STAGE_ENVIRONMENT);
 
+		mark = profile_begin(PROFILE_HEALTH);
 		health_removal_update();
+		profile_end(mark);
+		replay_stage(TURN_STAGE_HEALTH);
 	}
 
 	// Recalculate the FOV if warranted
 	if (recalculateFOV) {
 		Position *pos = (Position *)game_object_get_component(player, COMP_POSITION);
-		fov_calculate(pos->x, pos->y, fovMap);
+		fov_calculate(pos->x, pos->y);
 		recalculateFOV = false;
 	}
+	if (playerTookTurn) {
+		replay_stage(TURN_STAGE_FOV);
+	}
+	fov_mark_seen();
 
 	// Check for animation updates
+	ProfileMark mark = profile_begin(PROFILE_ANIMATION);
 	animation_update();
+	profile_end(mark);
+
+	profile_end(updateMark);
+}
+
+internal ConfigEntity *
+hof_entity_new() {
+	// An entry for the HoF, for the run that just ended
+	ConfigEntity *entity = (ConfigEntity *)mem_calloc(MEM_CONFIG, 1, sizeof(ConfigEntity));
+	entity->name = String_Create("%s", "RECORD");
+	config_entity_set_value(entity, "name", playerName);
+
+	char value[32];
+	snprintf(value, sizeof(value), "%d", gemsFoundTotal);
+	config_entity_set_value(entity, "gems", value);
+	snprintf(value, sizeof(value), "%d", currentLevelNumber);
+	config_entity_set_value(entity, "level", value);
+
+	time_t rawTime;
+	time(&rawTime);
+	struct tm *today = localtime(&rawTime);
+	snprintf(value, sizeof(value), "%d/%d/%d", today->tm_mon + 1, today->tm_mday, today->tm_year + 1900);
+	config_entity_set_value(entity, "date", value);
+	return entity;
 }
 
 internal void
 game_over() {
 	// Do endgame processing -- 
 
+	// The run is over, so there's nothing to continue (a replayed run leaves
+	// the save and the HoF alone)
+	if (replay_playing()) {
+		return;
+	}
+	save_delete();
+
 	// Load the existing HoF data if necessary
 	if (hofConfig == NULL) {
 		hofConfig = config_file_parse("hof.cfg");
@@ -1764,16 +3766,7 @@ game_over() {
 		// If the current game's score is higher than this entry's score, it made the list right here
 		if (gemsFoundTotal >= gemCount) {
 			// Create a new config entity and load it up with this game's data
-			ConfigEntity *newEntity = (ConfigEntity *)calloc(1, sizeof(ConfigEntity));
-			newEntity->name = String_Create("%s", "RECORD");
-			config_entity_set_value(newEntity, "name", playerName);
-			config_entity_set_value(newEntity, "gems", String_Create("%d", gemsFoundTotal));
-			config_entity_set_value(newEntity, "level", String_Create("%d", currentLevelNumber));
-
-			time_t rawTime;
-			time(&rawTime);
-			struct tm *today = localtime(&rawTime);
-			config_entity_set_value(newEntity, "date", String_Create("%d/%d/%d", today->tm_mon + 1, today->tm_mday, today->tm_year + 1900));
+			ConfigEntity *newEntity = hof_entity_new();
 
 			// Insert an element containing new entity before the element 
 			// with the entity we're comparing to
@@ -1790,16 +3783,7 @@ game_over() {
 	// HoF contains fewer than 10 entries, add this game to the end.
 	if ((!hofUpdated) && (list_size(hofConfig->entities) < 10)) {
 		// Create a new config entity and load it up with this game's data
-		ConfigEntity *newEntity = (ConfigEntity *)calloc(1, sizeof(ConfigEntity));
-		newEntity->name = String_Create("%s", "RECORD");
-		config_entity_set_value(newEntity, "name", playerName);
-		config_entity_set_value(newEntity, "gems", String_Create("%d", gemsFoundTotal));
-		config_entity_set_value(newEntity, "level", String_Create("%d", currentLevelNumber));
-
-		time_t rawTime;
-		time(&rawTime);
-		struct tm *today = localtime(&rawTime);
-		config_entity_set_value(newEntity, "date", String_Create("%d/%d/%d", today->tm_mon + 1, today->tm_mday, today->tm_year + 1900));
+		ConfigEntity *newEntity = hof_entity_new();
 
 		// Insert an element containing new entity before the element 
 		// with the entity we're comparing to
@@ -1811,7 +3795,7 @@ game_over() {
 	if (list_size(hofConfig->entities) > 10) {
 		ListElement *le = list_item_at(hofConfig->entities, 10);
 		if (le != NULL) {
-			list_remove(hofConfig->entities, le);
+			config_entity_destroy(hofConfig, list_remove(hofConfig->entities, le));
 		}
 	}
 
@@ -44,7 +44,7 @@ e.g. for malloc, send a pointer to free. For data that shouldn't be cleaned
 up, send NULL.
 */
 List * list_new(void (*destroy)(void* data)) {
-	List *list = calloc(1, sizeof(List));
+	List *list = mem_calloc(MEM_LISTS, 1, sizeof(List));
 
 	if (list != NULL) {
 		list->size = 0;
@@ -65,7 +65,7 @@ Returns true on success, false on failure.
 bool list_insert_after(List *list, ListElement *element, void *data) {
 	ListElement *newElement;
 
-	if ((newElement = (ListElement *)calloc(1, sizeof(ListElement))) == NULL) {
+	if ((newElement = (ListElement *)mem_calloc(MEM_LISTS, 1, sizeof(ListElement))) == NULL) {
 		return false;
 	}
 
@@ -86,6 +86,8 @@ bool list_insert_after(List *list, ListElement *element, void *data) {
 	} else {
 		if (element->next == NULL) {
 			list->tail = newElement;
+		} else {
+			element->next->prev = newElement;
 		}
 
 		newElement->next = element->next;
@@ -157,7 +159,7 @@ void * list_remove(List *list, ListElement *element) {
 		}
 	}
 
-	free(elementToRemove);
+	mem_free(elementToRemove);
 
 	list->size -= 1;
 
@@ -221,7 +223,7 @@ void list_destroy(List *list) {
 	}
 
 	// Free the list structure itself
-	free(list);
+	mem_free(list);
 }
 
 
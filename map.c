@@ -4,14 +4,76 @@
 * Functions and Types for map generation.
 */
 
-#define MAP_WIDTH	80
-#define MAP_HEIGHT	40
+// Map size used when a level doesn't specify one in levels.cfg
+#define MAP_DEFAULT_WIDTH	80
+#define MAP_DEFAULT_HEIGHT	40
+
+// Smallest map we can generate
+#define MAP_MIN_WIDTH		24
+#define MAP_MIN_HEIGHT		24
+
+// Largest map - small enough that a map's cell count (even times a 
+// percentage) fits in an i32
+#define MAP_MAX_WIDTH		4096
+#define MAP_MAX_HEIGHT		4096
+
+// Room placement defaults, used when a level doesn't specify them in levels.cfg
+#define ROOM_DEFAULT_FILL		45		// Percent of the map to cover with rooms
+#define ROOM_DEFAULT_MIN_SIZE	5
+#define ROOM_DEFAULT_MAX_SIZE	21
+#define ROOM_SMALLEST_SIZE		3
+#define ROOM_MAX_FILL			90
+
+// Cave generation - starting rock density is (a & b) | (c & d) of random 
+// bits, which is 7/16
+#define CAVE_ITERATIONS			5
+
+// Once a map is generated, open areas smaller than this are filled in rather 
+// than joined up to the rest of the map
+#define MAP_MIN_REGION_CELLS	12
+
+// Maps are stored row by row in a single block of cells
+#define CELL_IDX(x, y, width)	(((y) * (width)) + (x))
+
+// Huge levels are generated a square chunk at a time
+#define CHUNK_SIZE		32
 
 
 typedef struct {
 	i32 x, y;
 } Point;
 
+typedef enum {
+	MAP_GEN_ROOMS,
+	MAP_GEN_CAVES,
+	MAP_GEN_BSP,
+	MAP_GEN_COUNT
+} MapGenType;
+
+typedef struct {
+	MapGenType generator;
+	i32 fillPercent;			// Rooms generator - how much of the map to cover
+	i32 minSize;				// Rooms and BSP generators - room size range
+	i32 maxSize;
+} MapParams;
+
+typedef struct {
+	i32 *labels;				// Region of each cell (-1 for rock)
+	i32 count;
+	i32 *first;					// First cell of each region
+	i32 *size;					// Cells in each region
+	i32 largest;
+} MapRegions;
+
+typedef struct {
+	i32 *cells;					// Open cells that nothing's been put in yet
+	i32 count;
+	i32 width;
+} OpenCells;
+
+// Generators carve open (false) cells into a map that starts out all rock
+typedef void (*MapGenerator)(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params);
+
 typedef struct {
 	Point start;
 	Point mid;
@@ -21,113 +83,603 @@ typedef struct {
 	bool hasWaypoint;
 } Segment;
 
+typedef struct {
+	Segment *segments;
+	i32 count;
+	i32 capacity;
+} SegmentArena;
+
 
 /* Function Declarations */
-void map_carve_hallway_horz(Point from, Point to, bool (*mapCells)[MAP_HEIGHT]);
-void map_carve_hallway_vert(Point from, Point to, bool (*mapCells)[MAP_HEIGHT]);
-bool map_carve_room(u32 x, u32 y, u32 w, u32 h, bool (*mapCells)[MAP_HEIGHT]);
-void map_carve_segments(List *hallways, bool (*mapCells)[MAP_HEIGHT]);
-void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 roomCount);
-Point rect_random_point(UIRect rect);
-i32 room_containing_point(Point pt, UIRect *rooms, i32 roomCount);
+void map_carve_hallway_horz(Point from, Point to, bool *mapCells, i32 width);
+void map_carve_hallway_vert(Point from, Point to, bool *mapCells, i32 width);
+bool map_carve_room(u32 x, u32 y, u32 w, u32 h, bool *mapCells, i32 *roomIds, i32 roomId, i32 width);
+void map_carve_segments(SegmentArena *hallways, bool *mapCells, i32 width);
+bool map_find_room_spot(RNG *rng, i32 *sat, i32 width, i32 height, i32 w, i32 h, Point *spot);
+void map_free_space_build(i32 *sat, bool *mapCells, i32 width, i32 height);
+Point map_nearest_open_cell(Point from, bool *mapCells, i32 width, i32 height);
+void map_get_segments(RNG *rng, SegmentArena *arena, Point from, Point to, i32 *roomIds, i32 width);
+Point rect_random_point(RNG *rng, UIRect rect);
+bool room_set_join(i32 *roomSets, i32 room1, i32 room2);
+void map_connect_regions(bool *mapCells, i32 width, i32 height);
+MapRegions map_regions_find(bool *mapCells, i32 width, i32 height);
+void map_regions_free(MapRegions *regions);
+void open_cells_exclude(OpenCells *open, bool *taken);
+void open_cells_free(OpenCells *open);
+OpenCells open_cells_new(bool *mapCells, i32 width, i32 height);
+bool open_cells_take(RNG *rng, OpenCells *open, Point *pt);
+void map_generate_bsp(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params);
+void map_generate_caves(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params);
+void map_generate_rooms(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params);
+
+
+// Generators, and the names levels.cfg uses for them
+global_variable MapGenerator mapGenerators[MAP_GEN_COUNT] = {
+	map_generate_rooms,
+	map_generate_caves,
+	map_generate_bsp
+};
+global_variable char *mapGeneratorNames[MAP_GEN_COUNT] = {
+	"rooms",
+	"caves",
+	"bsp"
+};
 
 
 /* Map Management */
 
-void map_generate(bool (*mapCells)[MAP_HEIGHT]) {
-	// Mark all the map cells as "filled"
-	for (u32 x = 0; x < MAP_WIDTH; x++) {
-		for (u32 y = 0; y < MAP_HEIGHT; y++) {
-			mapCells[x][y] = true;
+bool map_generator_needs_whole_map(i32 generator) {
+	// Caves come out as one cavern only if the automaton runs over the whole 
+	// map, so lazily generated cave levels are sliced up from a whole map 
+	// rather than made a chunk at a time
+	return generator == MAP_GEN_CAVES;
+}
+
+i32 map_generator_from_name(const char *name) {
+	// -1 if there's no generator with that name
+	if (name == NULL) { return -1; }
+	for (i32 i = 0; i < MAP_GEN_COUNT; i++) {
+		if (strcmp(name, mapGeneratorNames[i]) == 0) {
+			return i;
 		}
 	}
+	return -1;
+}
+
+void map_generate(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params) {
+	// Mark all the map cells as "filled"
+	for (i32 i = 0; i < width * height; i++) {
+		mapCells[i] = true;
+	}
+
+	mapGenerators[params.generator](rng, mapCells, width, height, params);
+
+	// Whatever the generator made, make sure the whole map can be walked
+	map_connect_regions(mapCells, width, height);
+}
+
+void map_generate_rooms(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params) {
+	// Rooms need a wall all the way round them, so they can't be bigger than 
+	// the map less its border
+	i32 maxW = params.maxSize;
+	i32 maxH = params.maxSize;
+	if (maxW > width - 2) { maxW = width - 2; }
+	if (maxH > height - 2) { maxH = height - 2; }
+	i32 minSize = params.minSize;
+	if (minSize > maxW) { minSize = maxW; }
+	if (minSize > maxH) { minSize = maxH; }
 
 	// Carve out non-overlapping rooms that are randomly placed, and of 
-	// random size. 
-	bool roomsDone = false;
-	UIRect rooms[100];
-	u32 cellsUsed = 0;
+	// random size. Every room (plus the wall that separates it from its 
+	// neighbours) covers at least (minSize+1)^2 cells, which bounds how many rooms fit.
+	i32 *sat = mem_calloc(MEM_MAPGEN, (width + 1) * (height + 1), sizeof(i32));
+	i32 *roomIds = mem_calloc(MEM_MAPGEN, width * height, sizeof(i32));		// Which room each cell is in (or -1)
+	for (i32 i = 0; i < width * height; i++) {
+		roomIds[i] = -1;
+	}
+	UIRect *rooms = mem_calloc(MEM_MAPGEN, ((width * height) / ((minSize + 1) * (minSize + 1))) + 1, sizeof(UIRect));
+	i32 targetCells = (width * height * params.fillPercent) / 100;
+	i32 cellsUsed = 0;
 	u32 roomCount = 0;
-	while (!roomsDone) {
+	bool roomsDone = false;
+	while (!roomsDone && (cellsUsed <= targetCells)) {
 		// Generate a random width/height for a room
-		u32 w = (rand() % 17) + 5;
-		u32 h = (rand() % 17) + 5;
-		u32 x = rand() % (MAP_WIDTH - w - 1);
-		u32 y = rand() % (MAP_HEIGHT - h - 1);
-		if (x == 0) x = 1;
-		if (y == 0) y = 1;
-
-		bool success = map_carve_room(x, y, w, h, mapCells);
-		if (success) {
-			UIRect r = {x, y, w, h};
+		i32 w = rng_range(rng, maxW - minSize + 1) + minSize;
+		i32 h = rng_range(rng, maxH - minSize + 1) + minSize;
+
+		// Every placement is picked from the spots where the room fits, so 
+		// each room takes a bounded amount of work. If the room fits nowhere, 
+		// shrink it, and once the smallest room fits nowhere the map is full.
+		map_free_space_build(sat, mapCells, width, height);
+		Point spot;
+		while (!map_find_room_spot(rng, sat, width, height, w, h, &spot)) {
+			if ((w == minSize) && (h == minSize)) {
+				roomsDone = true;
+				break;
+			}
+			if (w > h) { w -= 1; } else { h -= 1; }
+		}
+
+		if (!roomsDone) {
+			map_carve_room(spot.x, spot.y, w, h, mapCells, roomIds, roomCount, width);
+			UIRect r = {spot.x, spot.y, w, h};
 			rooms[roomCount] = r;
 			roomCount += 1;
 			cellsUsed += (w * h);
 		}
+	}
+	mem_free(sat);
+
+	// Join all rooms with corridors, so that all rooms are reachable. Rooms 
+	// are tracked as sets of connected rooms, and a segment is only carved if 
+	// it joins rooms that aren't already connected.
+	SegmentArena arena = {0};
+	i32 *roomSets = mem_calloc(MEM_MAPGEN, roomCount + 1, sizeof(i32));
+	for (u32 r = 0; r < roomCount; r++) {
+		roomSets[r] = r;
+	}
+
+	i32 hallwayCount = 0;
+	for (u32 r = 1; r < roomCount; r++) {
+		// Join two rooms via random points in those rooms
+		Point fromPt = rect_random_point(rng, rooms[r-1]);
+		Point toPt = rect_random_point(rng, rooms[r]);
+
+		// Break the proposed hallway into segments joining rooms. They go in 
+		// the arena after the hallways we're keeping.
+		arena.count = hallwayCount;
+		map_get_segments(rng, &arena, fromPt, toPt, roomIds, width);
+
+		// Keep the segments that join rooms that aren't already joined
+		for (i32 i = hallwayCount; i < arena.count; i++) {
+			Segment seg = arena.segments[i];
+			if (room_set_join(roomSets, seg.roomFrom, seg.roomTo)) {
+				arena.segments[hallwayCount] = seg;
+				hallwayCount += 1;
+			}
+		}
+	}
+	arena.count = hallwayCount;
+
+	// Carve out unique hallways
+	map_carve_segments(&arena, mapCells, width);
+
+	// Clean up
+	mem_free(arena.segments);
+	mem_free(roomSets);
+	mem_free(roomIds);
+	mem_free(rooms);
+}
+
+void map_generate_chunk(RNG *rng, bool *mapCells, Point *doors, i32 doorCount, MapParams params) {
+	// Generate one CHUNK_SIZE square piece of a larger map. Doors are cells on 
+	// the edge of the chunk that line up with doors in the neighbouring chunks, 
+	// and each one gets a hallway to the nearest open cell so the chunks join up.
+	map_generate(rng, mapCells, CHUNK_SIZE, CHUNK_SIZE, params);
 
-		// Exit condition - more that desired % of cells in use
-		if (((float)cellsUsed / (float)(MAP_HEIGHT * MAP_WIDTH)) > 0.45) {
-			roomsDone = true;
+	Point targets[4];
+	for (i32 i = 0; i < doorCount; i++) {
+		targets[i] = map_nearest_open_cell(doors[i], mapCells, CHUNK_SIZE, CHUNK_SIZE);
+	}
+
+	for (i32 i = 0; i < doorCount; i++) {
+		Point door = doors[i];
+		Point target = targets[i];
+		if ((door.x == 0) || (door.x == CHUNK_SIZE - 1)) {
+			// Side door - head in across the chunk first, then turn
+			Point turn = {target.x, door.y};
+			map_carve_hallway_horz(door, turn, mapCells, CHUNK_SIZE);
+			map_carve_hallway_vert(turn, target, mapCells, CHUNK_SIZE);
+		} else {
+			Point turn = {door.x, target.y};
+			map_carve_hallway_vert(door, turn, mapCells, CHUNK_SIZE);
+			map_carve_hallway_horz(turn, target, mapCells, CHUNK_SIZE);
 		}
 	}
+}
+
+internal inline void 
+cave_add_bits(u64 a, u64 b, u64 c, u64 *sum, u64 *carry) {
+	// Full adder, for 64 cells at once
+	u64 ab = a ^ b;
+	*sum = ab ^ c;
+	*carry = (a & b) | (c & ab);
+}
 
-	// Join all rooms with corridors, so that all rooms are reachable
-	List *hallways = list_new(free);
+void map_generate_caves(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params) {
+	// Cellular automaton caves. Each row is packed 64 cells to a word (set bits 
+	// are rock), and each step makes a cell rock if 5 or more of the 9 cells 
+	// around and including it are rock. The neighbour counts are added up 
+	// bitwise, so a whole word of cells is done with a handful of operations.
+	// Everything off the edge of the map counts as rock.
+	(void)params;		// Caves don't use the room settings
+	i32 rowWords = (width + 63) / 64;
+	u64 *cells = mem_calloc(MEM_MAPGEN, rowWords * height, sizeof(u64));
+	u64 *nextCells = mem_calloc(MEM_MAPGEN, rowWords * height, sizeof(u64));
+	u64 *rockRow = mem_calloc(MEM_MAPGEN, rowWords, sizeof(u64));
+	u64 padding = (width % 64 == 0) ? 0 : ~((1ULL << (width % 64)) - 1);	// Bits past the edge in the last word
+	for (i32 w = 0; w < rowWords; w++) {
+		rockRow[w] = ~0ULL;
+	}
 
-	for (u32 r = 1; r < roomCount; r++) {
-		// Join two rooms via random points in those rooms
-		Point fromPt = rect_random_point(rooms[r-1]);
-		Point toPt = rect_random_point(rooms[r]);
+	for (i32 y = 0; y < height; y++) {
+		for (i32 w = 0; w < rowWords; w++) {
+			u64 a = rng_next(rng);
+			u64 b = rng_next(rng);
+			u64 c = rng_next(rng);
+			u64 d = rng_next(rng);
+			cells[(y * rowWords) + w] = (a & b) | (c & d);
+		}
+		cells[(y * rowWords) + rowWords - 1] |= padding;
+	}
+
+	for (i32 step = 0; step < CAVE_ITERATIONS; step++) {
+		for (i32 y = 0; y < height; y++) {
+			u64 *rows[3];
+			rows[0] = (y > 0) ? &cells[(y - 1) * rowWords] : rockRow;
+			rows[1] = &cells[y * rowWords];
+			rows[2] = (y < height - 1) ? &cells[(y + 1) * rowWords] : rockRow;
+
+			for (i32 w = 0; w < rowWords; w++) {
+				// Each cell's neighbours to the left and right, shifted into line with it
+				u64 in[9];
+				for (i32 r = 0; r < 3; r++) {
+					u64 prev = (w > 0) ? rows[r][w - 1] : ~0ULL;
+					u64 next = (w < rowWords - 1) ? rows[r][w + 1] : ~0ULL;
+					in[r * 3] = (rows[r][w] << 1) | (prev >> 63);
+					in[(r * 3) + 1] = rows[r][w];
+					in[(r * 3) + 2] = (rows[r][w] >> 1) | (next << 63);
+				}
+
+				// Add up the nine inputs into a count of ones, twos, fours and eights
+				u64 s0, s1, s2, c0, c1, c2, c3, c4, c5, ones, twos, t;
+				cave_add_bits(in[0], in[1], in[2], &s0, &c0);
+				cave_add_bits(in[3], in[4], in[5], &s1, &c1);
+				cave_add_bits(in[6], in[7], in[8], &s2, &c2);
+				cave_add_bits(s0, s1, s2, &ones, &c3);
+				cave_add_bits(c0, c1, c2, &t, &c4);
+				twos = t ^ c3;
+				c5 = t & c3;
+				u64 fours = c4 ^ c5;
+				u64 eights = c4 & c5;
+
+				nextCells[(y * rowWords) + w] = eights | (fours & (twos | ones));
+			}
+			nextCells[(y * rowWords) + rowWords - 1] |= padding;
+		}
+
+		u64 *swap = cells;
+		cells = nextCells;
+		nextCells = swap;
+	}
 
-		List *segments = list_new(free);
+	// Unpack into the map, keeping a solid border
+	for (i32 y = 0; y < height; y++) {
+		for (i32 x = 0; x < width; x++) {
+			bool rock = (cells[(y * rowWords) + (x / 64)] >> (x % 64)) & 1;
+			if ((x == 0) || (y == 0) || (x == width - 1) || (y == height - 1)) {
+				rock = true;
+			}
+			mapCells[CELL_IDX(x, y, width)] = rock;
+		}
+	}
 
-		// Break the proposed hallway into segments joining rooms
-		map_get_segments(segments, fromPt, toPt, rooms, roomCount);
+	mem_free(cells);
+	mem_free(nextCells);
+	mem_free(rockRow);
+}
 
-		// Walk the segment list and skip adding any segments
-		// that join rooms that are already joined 
-		for (ListElement *e = list_head(segments); e != NULL; e = e->next) { 
-			i32 rm1 = ((Segment *)(e->data))->roomFrom;
-			i32 rm2 = ((Segment *)(e->data))->roomTo;
+internal void 
+map_carve_path(RNG *rng, Point from, Point to, bool *mapCells, i32 width) {
+	// L-shaped hallway between two points, turning one way or the other at random
+	Point turn = from;
+	if (rng_range(rng, 2) == 0) {
+		turn.x = to.x;
+	} else {
+		turn.y = to.y;
+	}
+	if (from.y == turn.y) {
+		map_carve_hallway_horz(from, turn, mapCells, width);
+		map_carve_hallway_vert(turn, to, mapCells, width);
+	} else {
+		map_carve_hallway_vert(from, turn, mapCells, width);
+		map_carve_hallway_horz(turn, to, mapCells, width);
+	}
+}
 
-			Segment *uSeg = NULL;
-			if (hallways->size == 0) {
-				uSeg = (Segment *)e->data;
-				
+internal Point 
+map_bsp_split(RNG *rng, bool *mapCells, i32 width, UIRect area, i32 minSize, i32 maxSize) {
+	// Split the area in two (if it's big enough) and recurse, or put a room in 
+	// it. The two halves get joined by a hallway, and a point in one of them 
+	// is returned so the caller can join this area to its sibling.
+	i32 minArea = minSize + 2;		// Room plus its walls
+	bool splitAcross = (area.w >= minArea * 2);
+	bool splitDown = (area.h >= minArea * 2);
+	bool mustSplit = (area.w > maxSize + 2) || (area.h > maxSize + 2);
+
+	if ((splitAcross || splitDown) && (mustSplit || (rng_range(rng, 2) == 0))) {
+		if (splitAcross && splitDown) {
+			// Split the longer side, so areas don't get too thin
+			if (area.w > area.h) { 
+				splitDown = false; 
+			} else if (area.h > area.w) { 
+				splitAcross = false; 
+			} else if (rng_range(rng, 2) == 0) {
+				splitDown = false;
 			} else {
-				bool unique = true;
-				for (ListElement *h = list_head(hallways); h != NULL; h = h->next) {
-					Segment *seg = (Segment *)(h->data);
-					if (((seg->roomFrom == rm1) && (seg->roomTo == rm2)) || 
-						((seg->roomTo == rm1) && (seg->roomFrom == rm2))) {
-						unique = false;
-						break;
-					}
-				}
-				if (unique) {
-					uSeg = (Segment *)e->data;
+				splitAcross = false;
+			}
+		}
+
+		UIRect first = area;
+		UIRect second = area;
+		if (splitAcross) {
+			i32 at = minArea + rng_range(rng, area.w - (minArea * 2) + 1);
+			first.w = at;
+			second.x = area.x + at;
+			second.w = area.w - at;
+		} else {
+			i32 at = minArea + rng_range(rng, area.h - (minArea * 2) + 1);
+			first.h = at;
+			second.y = area.y + at;
+			second.h = area.h - at;
+		}
+
+		Point firstPt = map_bsp_split(rng, mapCells, width, first, minSize, maxSize);
+		Point secondPt = map_bsp_split(rng, mapCells, width, second, minSize, maxSize);
+		map_carve_path(rng, firstPt, secondPt, mapCells, width);
+		return (rng_range(rng, 2) == 0) ? firstPt : secondPt;
+	}
+
+	// Leaf - a room somewhere inside the area's walls
+	i32 roomMaxW = (area.w - 2 < maxSize) ? area.w - 2 : maxSize;
+	i32 roomMaxH = (area.h - 2 < maxSize) ? area.h - 2 : maxSize;
+	i32 roomMinW = (minSize < roomMaxW) ? minSize : roomMaxW;
+	i32 roomMinH = (minSize < roomMaxH) ? minSize : roomMaxH;
+	UIRect room;
+	room.w = roomMinW + rng_range(rng, roomMaxW - roomMinW + 1);
+	room.h = roomMinH + rng_range(rng, roomMaxH - roomMinH + 1);
+	room.x = area.x + 1 + rng_range(rng, area.w - 2 - room.w + 1);
+	room.y = area.y + 1 + rng_range(rng, area.h - 2 - room.h + 1);
+	for (i32 y = room.y; y < room.y + room.h; y++) {
+		for (i32 x = room.x; x < room.x + room.w; x++) {
+			mapCells[CELL_IDX(x, y, width)] = false;
+		}
+	}
+	return rect_random_point(rng, room);
+}
+
+void map_generate_bsp(RNG *rng, bool *mapCells, i32 width, i32 height, MapParams params) {
+	// Binary space partition - the map is split up until the pieces are room 
+	// sized, and each piece gets one room
+	i32 minSize = params.minSize;
+	i32 maxSize = params.maxSize;
+	if (maxSize > width - 2) { maxSize = width - 2; }
+	if (maxSize > height - 2) { maxSize = height - 2; }
+	if (minSize > maxSize) { minSize = maxSize; }
+
+	UIRect area = {0, 0, width, height};
+	map_bsp_split(rng, mapCells, width, area, minSize, maxSize);
+}
+
+MapRegions map_regions_find(bool *mapCells, i32 width, i32 height) {
+	// Flood fill the open cells into connected regions, numbered in the order 
+	// they're found scanning the map
+	i32 cellCount = width * height;
+	MapRegions regions = {0};
+	regions.labels = mem_calloc(MEM_MAPGEN, cellCount, sizeof(i32));
+	regions.largest = -1;
+	for (i32 i = 0; i < cellCount; i++) {
+		regions.labels[i] = -1;
+	}
+
+	i32 capacity = 0;
+	i32 *queue = mem_calloc(MEM_MAPGEN, cellCount, sizeof(i32));
+	for (i32 start = 0; start < cellCount; start++) {
+		if (mapCells[start] || (regions.labels[start] != -1)) {
+			continue;
+		}
+
+		i32 head = 0;
+		i32 tail = 0;
+		queue[tail++] = start;
+		regions.labels[start] = regions.count;
+		while (head < tail) {
+			i32 cell = queue[head++];
+			i32 x = cell % width;
+			i32 y = cell / width;
+			i32 neighbours[4] = {
+				(x > 0) ? cell - 1 : -1,
+				(x < width - 1) ? cell + 1 : -1,
+				(y > 0) ? cell - width : -1,
+				(y < height - 1) ? cell + width : -1
+			};
+			for (i32 n = 0; n < 4; n++) {
+				i32 next = neighbours[n];
+				if ((next != -1) && !mapCells[next] && (regions.labels[next] == -1)) {
+					regions.labels[next] = regions.count;
+					queue[tail++] = next;
 				}
 			}
+		}
+
+		if (regions.count == capacity) {
+			capacity = (capacity == 0) ? 32 : capacity * 2;
+			regions.first = mem_realloc(MEM_MAPGEN, regions.first, capacity * sizeof(i32));
+			regions.size = mem_realloc(MEM_MAPGEN, regions.size, capacity * sizeof(i32));
+		}
+		regions.first[regions.count] = start;
+		regions.size[regions.count] = tail;
+		if ((regions.largest == -1) || (tail > regions.size[regions.largest])) {
+			regions.largest = regions.count;
+		}
+		regions.count += 1;
+	}
+
+	mem_free(queue);
+	return regions;
+}
+
+void map_regions_free(MapRegions *regions) {
+	mem_free(regions->labels);
+	mem_free(regions->first);
+	mem_free(regions->size);
+}
+
+void map_connect_regions(bool *mapCells, i32 width, i32 height) {
+	// Tiny regions are filled in, and the rest are joined to the region 
+	// before them (in the order they were found) with a hallway between 
+	// their first cells
+	MapRegions regions = map_regions_find(mapCells, width, height);
+
+	for (i32 cell = 0; cell < width * height; cell++) {
+		i32 region = regions.labels[cell];
+		if ((region != -1) && (region != regions.largest) && (regions.size[region] < MAP_MIN_REGION_CELLS)) {
+			mapCells[cell] = true;
+		}
+	}
+
+	bool haveLast = false;
+	Point lastPoint = {0, 0};
+	for (i32 r = 0; r < regions.count; r++) {
+		if ((r != regions.largest) && (regions.size[r] < MAP_MIN_REGION_CELLS)) {
+			continue;
+		}
+		Point pt = {regions.first[r] % width, regions.first[r] / width};
+		if (haveLast) {
+			Point turn = {pt.x, lastPoint.y};
+			map_carve_hallway_horz(lastPoint, turn, mapCells, width);
+			map_carve_hallway_vert(turn, pt, mapCells, width);
+		}
+		lastPoint = pt;
+		haveLast = true;
+	}
+
+	map_regions_free(&regions);
+}
 
-			if (uSeg != NULL) {
-				Segment *segCopy = calloc(1, sizeof(Segment));
-				memcpy(segCopy, uSeg, sizeof(Segment));
-				list_insert_after(hallways, NULL, segCopy);
+OpenCells open_cells_new(bool *mapCells, i32 width, i32 height) {
+	// List the cells in the map's largest region - once a map has been 
+	// generated that's all of them, but only ever placing things here means 
+	// anything placed can be reached from anything else
+	MapRegions regions = map_regions_find(mapCells, width, height);
+	OpenCells open = {0};
+	open.width = width;
+	if (regions.count > 0) {
+		open.cells = mem_calloc(MEM_MAPGEN, regions.size[regions.largest], sizeof(i32));
+		for (i32 cell = regions.first[regions.largest]; cell < width * height; cell++) {
+			if (regions.labels[cell] == regions.largest) {
+				open.cells[open.count++] = cell;
 			}
 		}
+	}
+	map_regions_free(&regions);
+	return open;
+}
 
-		// Clean up
-		list_destroy(segments);
+void open_cells_exclude(OpenCells *open, bool *taken) {
+	// Drop the cells something's already been put in
+	i32 kept = 0;
+	for (i32 i = 0; i < open->count; i++) {
+		if (!taken[open->cells[i]]) {
+			open->cells[kept++] = open->cells[i];
+		}
 	}
+	open->count = kept;
+}
 
-	// Carve out unique hallways
-	map_carve_segments(hallways, mapCells);
+bool open_cells_take(RNG *rng, OpenCells *open, Point *pt) {
+	// Pick a random open cell, and take it off the list so nothing else goes 
+	// there. Returns false once the cells have all been used.
+	if (open->count == 0) {
+		return false;
+	}
+	i32 i = rng_range(rng, open->count);
+	i32 cell = open->cells[i];
+	open->count -= 1;
+	open->cells[i] = open->cells[open->count];
+	*pt = (Point) {cell % open->width, cell / open->width};
+	return true;
+}
 
-	// Clean up
-	list_destroy(hallways);
+void open_cells_free(OpenCells *open) {
+	mem_free(open->cells);
+	open->cells = NULL;
+	open->count = 0;
+}
+
+Point map_nearest_open_cell(Point from, bool *mapCells, i32 width, i32 height) {
+	Point nearest = from;
+	i32 bestDistance = width + height;
+	for (i32 y = 0; y < height; y++) {
+		for (i32 x = 0; x < width; x++) {
+			i32 distance = abs(x - from.x) + abs(y - from.y);
+			if (!mapCells[CELL_IDX(x, y, width)] && (distance < bestDistance)) {
+				nearest = (Point) {x, y};
+				bestDistance = distance;
+			}
+		}
+	}
+	return nearest;
+}
+
+void map_free_space_build(i32 *sat, bool *mapCells, i32 width, i32 height) {
+	// Summed-area table of carved cells - the entry at (x+1, y+1) counts the 
+	// open cells above and to the left of (x, y), so any rectangle can be 
+	// checked for open cells with four lookups
+	i32 stride = width + 1;
+	for (i32 x = 0; x <= width; x++) {
+		sat[x] = 0;
+	}
+	for (i32 y = 0; y < height; y++) {
+		i32 rowCount = 0;
+		sat[(y + 1) * stride] = 0;
+		for (i32 x = 0; x < width; x++) {
+			if (!mapCells[CELL_IDX(x, y, width)]) { rowCount += 1; }
+			sat[((y + 1) * stride) + x + 1] = sat[(y * stride) + x + 1] + rowCount;
+		}
+	}
+}
+
+internal i32 
+map_open_cells_in(i32 *sat, i32 width, i32 left, i32 top, i32 right, i32 bottom) {
+	// Open cells in the rectangle from left, top up to (but not including) right, bottom
+	i32 stride = width + 1;
+	return sat[(bottom * stride) + right] - sat[(top * stride) + right] - 
+		   sat[(bottom * stride) + left] + sat[(top * stride) + left];
+}
+
+bool map_find_room_spot(RNG *rng, i32 *sat, i32 width, i32 height, i32 w, i32 h, Point *spot) {
+	// Pick a random spot where a w x h room, and the wall around it, is all 
+	// still solid rock. Counts the spots first, then walks to the chosen one.
+	i32 spots = 0;
+	for (i32 y = 1; y + h < height; y++) {
+		for (i32 x = 1; x + w < width; x++) {
+			if (map_open_cells_in(sat, width, x - 1, y - 1, x + w + 1, y + h + 1) == 0) {
+				spots += 1;
+			}
+		}
+	}
+	if (spots == 0) {
+		return false;
+	}
+
+	i32 chosen = rng_range(rng, spots);
+	for (i32 y = 1; y + h < height; y++) {
+		for (i32 x = 1; x + w < width; x++) {
+			if (map_open_cells_in(sat, width, x - 1, y - 1, x + w + 1, y + h + 1) == 0) {
+				if (chosen == 0) {
+					*spot = (Point) {x, y};
+					return true;
+				}
+				chosen -= 1;
+			}
+		}
+	}
+	return false;
 }
 
-void map_carve_hallway_horz(Point from, Point to, bool (*mapCells)[MAP_HEIGHT]) {
+void map_carve_hallway_horz(Point from, Point to, bool *mapCells, i32 width) {
 	u32 first, last;
 	if (from.x < to.x) {
 		first = from.x;
@@ -138,11 +690,11 @@ void map_carve_hallway_horz(Point from, Point to, bool (*mapCells)[MAP_HEIGHT])
 	}
 
 	for (u32 x = first; x <= last; x++) {
-		mapCells[x][from.y] = false;
+		mapCells[CELL_IDX(x, from.y, width)] = false;
 	}
 }
 
-void map_carve_hallway_vert(Point from, Point to, bool (*mapCells)[MAP_HEIGHT]) {
+void map_carve_hallway_vert(Point from, Point to, bool *mapCells, i32 width) {
 	u32 first, last;
 	if (from.y < to.y) {
 		first = from.y;
@@ -153,34 +705,35 @@ void map_carve_hallway_vert(Point from, Point to, bool (*mapCells)[MAP_HEIGHT])
 	}
 
 	for (u32 y = first; y <= last; y++) {
-		mapCells[from.x][y] = false;
+		mapCells[CELL_IDX(from.x, y, width)] = false;
 	}
 }
 
-bool map_carve_room(u32 x, u32 y, u32 w, u32 h, bool (*mapCells)[MAP_HEIGHT]) {
+bool map_carve_room(u32 x, u32 y, u32 w, u32 h, bool *mapCells, i32 *roomIds, i32 roomId, i32 width) {
 	// Determine if all the cells within the given rectangle are filled
-	for (u8 i = x-1; i < x + (w + 1); i++) {
-		for (u8 j = y-1; j < y + (h + 1); j++) {
-			if (mapCells[i][j] == false) {
+	for (u32 i = x-1; i < x + (w + 1); i++) {
+		for (u32 j = y-1; j < y + (h + 1); j++) {
+			if (mapCells[CELL_IDX(i, j, width)] == false) {
 				return false;
 			}
 		}
 	}
 
-	// Carve out the room
-	for (u8 i = x; i < x + w; i++) {
-		for (u8 j = y; j < y + h; j++) {
-			mapCells[i][j] = false;
+	// Carve out the room, noting which room the cells belong to
+	for (u32 i = x; i < x + w; i++) {
+		for (u32 j = y; j < y + h; j++) {
+			mapCells[CELL_IDX(i, j, width)] = false;
+			roomIds[CELL_IDX(i, j, width)] = roomId;
 		}
 	}
 
 	return true;
 }
 
-void map_carve_segments(List *hallways, bool (*mapCells)[MAP_HEIGHT]) {
+void map_carve_segments(SegmentArena *hallways, bool *mapCells, i32 width) {
 
-	for (ListElement *e = list_head(hallways); e != NULL; e = e->next) {
-		Segment *seg = (Segment *)e->data;
+	for (i32 i = 0; i < hallways->count; i++) {
+		Segment *seg = &hallways->segments[i];
 
 		if (seg->hasWaypoint) {
 			// This segment turns midway, so draw both parts of the segment
@@ -188,18 +741,18 @@ void map_carve_segments(List *hallways, bool (*mapCells)[MAP_HEIGHT]) {
 			Point p2 = seg->mid;
 
 			if (p1.x == p2.x) {
-				map_carve_hallway_vert(p1, p2, mapCells);			
+				map_carve_hallway_vert(p1, p2, mapCells, width);			
 			} else {
-				map_carve_hallway_horz(p1, p2, mapCells);
+				map_carve_hallway_horz(p1, p2, mapCells, width);
 			}
 
 			p1 = seg->mid;
 			p2 = seg->end;
 
 			if (p1.x == p2.x) {
-				map_carve_hallway_vert(p1, p2, mapCells);			
+				map_carve_hallway_vert(p1, p2, mapCells, width);			
 			} else {
-				map_carve_hallway_horz(p1, p2, mapCells);
+				map_carve_hallway_horz(p1, p2, mapCells, width);
 			}
 
 		} else {
@@ -207,16 +760,40 @@ void map_carve_segments(List *hallways, bool (*mapCells)[MAP_HEIGHT]) {
 			Point p2 = seg->end;
 
 			if (p1.x == p2.x) {
-				map_carve_hallway_vert(p1, p2, mapCells);			
+				map_carve_hallway_vert(p1, p2, mapCells, width);			
 			} else {
-				map_carve_hallway_horz(p1, p2, mapCells);
+				map_carve_hallway_horz(p1, p2, mapCells, width);
 			}
 		}
 	}
 
 }
 
-void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 roomCount) {
+internal Segment * 
+segment_new(SegmentArena *arena) {
+	// Segments are handed out of one growing block, and freed all together 
+	// once the map is done. The pointer is only good until the next one is made.
+	if (arena->count == arena->capacity) {
+		arena->capacity = (arena->capacity == 0) ? 64 : arena->capacity * 2;
+		arena->segments = mem_realloc(MEM_MAPGEN, arena->segments, arena->capacity * sizeof(Segment));
+	}
+	Segment *seg = &arena->segments[arena->count];
+	arena->count += 1;
+	memset(seg, 0, sizeof(Segment));
+	return seg;
+}
+
+internal void 
+segment_add(SegmentArena *arena, Point start, Point end, i32 roomFrom, i32 roomTo) {
+	Segment *s = segment_new(arena);
+	s->start = start;
+	s->end = end;
+	s->roomFrom = roomFrom;
+	s->roomTo = roomTo;
+	s->hasWaypoint = false;
+}
+
+void map_get_segments(RNG *rng, SegmentArena *arena, Point from, Point to, i32 *roomIds, i32 width) {
 	// Walk between our two points and find all the spans between rooms
 	bool usingWaypoint = false;
 	Point wayPoint = to;
@@ -224,7 +801,7 @@ void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 r
 		// Need to use a two-part segment to get between points
 		// Determine a waypoint where we'll turn
 		usingWaypoint = true;
-		if (rand() % 2 == 0) {
+		if (rng_range(rng, 2) == 0) {
 			// Move horizontal, then vertical
 			wayPoint.x = to.x;
 			wayPoint.y = from.y;
@@ -245,26 +822,21 @@ void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 r
 		if (from.y > wayPoint.y) { step = -1; }
 	}
 
-	i8 currRoom = room_containing_point(curr, rooms, roomCount);
+	i32 currRoom = roomIds[CELL_IDX(curr.x, curr.y, width)];
 	Point lastPoint = from;
 	bool done = false;
-	Segment *turnSegment = NULL;
+	bool turning = false;
+	Segment turnSegment = {0};
 	while (!done) {
-		i32 rm = room_containing_point(curr, rooms, roomCount);
+		i32 rm = roomIds[CELL_IDX(curr.x, curr.y, width)];
 		if (usingWaypoint && curr.x == wayPoint.x && curr.y == wayPoint.y) {
 			// Check to see if we're in a room
 			if (rm != -1) {
 				if (rm != currRoom) {
 					// We have a new segment between currRoom and rm
-					Segment *s = calloc(1, sizeof(Segment));
-					s->start = lastPoint;
-					s->end = curr;
-					s->roomFrom = currRoom;
-					s->roomTo = rm;
-					s->hasWaypoint = false;
-					list_insert_after(segments, NULL, s);
-
+					segment_add(arena, lastPoint, curr, currRoom, rm);
 					currRoom = rm;
+					lastPoint = curr;
 				} else {
 					// We haven't left our starting room yet, so change our lastPoint
 					// to be our waypoint, so we're just drawing a single part segment.
@@ -273,11 +845,11 @@ void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 r
 
 			} else {
 				// We hit our midpoint and we're outside a room - record a partial segment
-				turnSegment = calloc(1, sizeof(Segment));
-				turnSegment->start = lastPoint;
-				turnSegment->mid = curr;
-				turnSegment->hasWaypoint = true;
-				turnSegment->roomFrom = currRoom;
+				turning = true;
+				turnSegment.start = lastPoint;
+				turnSegment.mid = curr;
+				turnSegment.hasWaypoint = true;
+				turnSegment.roomFrom = currRoom;
 			}
 
 			// Set a new "from" and change our step to reflect our new direction
@@ -301,44 +873,32 @@ void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 r
 		} else if (curr.x == to.x && curr.y == to.y) { 
 			// We hit our endpoint - check if we're in another room or still in the same room
 			if (rm != currRoom) {
-				if (turnSegment != NULL) {
+				if (turning) {
 					// We already have a partial segment, so complete it
-					turnSegment->end = curr;
-					turnSegment->roomTo = rm;
-					list_insert_after(segments, NULL, turnSegment);
-					turnSegment = NULL;
+					turnSegment.end = curr;
+					turnSegment.roomTo = rm;
+					*segment_new(arena) = turnSegment;
+					turning = false;
 
 				} else {
 					// We have a new segment between currRoom and rm
-					Segment *s = calloc(1, sizeof(Segment));
-					s->start = lastPoint;
-					s->end = curr;
-					s->roomFrom = currRoom;
-					s->roomTo = rm;
-					s->hasWaypoint = false;
-					list_insert_after(segments, NULL, s);
+					segment_add(arena, lastPoint, curr, currRoom, rm);
 				}
 			}
 			done = true; 
 
 		} else {
 			if (rm != -1 && rm != currRoom) {
-				if (turnSegment != NULL) {
+				if (turning) {
 					// Complete our partial segment
-					turnSegment->end = curr;
-					turnSegment->roomTo = rm;
-					list_insert_after(segments, NULL, turnSegment);
-					turnSegment = NULL;
+					turnSegment.end = curr;
+					turnSegment.roomTo = rm;
+					*segment_new(arena) = turnSegment;
+					turning = false;
 					
 				} else {
 					// We have a new segment between currRoom and rm
-					Segment *s = calloc(1, sizeof(Segment));
-					s->start = lastPoint;
-					s->end = curr;
-					s->roomFrom = currRoom;
-					s->roomTo = rm;
-					s->hasWaypoint = false;
-					list_insert_after(segments, NULL, s);
+					segment_add(arena, lastPoint, curr, currRoom, rm);
 				}
 
 				currRoom = rm;
@@ -355,19 +915,30 @@ void map_get_segments(List *segments, Point from, Point to, UIRect *rooms, u32 r
 	}
 }
 
-Point rect_random_point(UIRect rect) {
-	u32 px = (rand() % (rect.w - 1)) + rect.x;
-	u32 py = (rand() % (rect.h - 1)) + rect.y;
+Point rect_random_point(RNG *rng, UIRect rect) {
+	u32 px = rng_range(rng, rect.w - 1) + rect.x;
+	u32 py = rng_range(rng, rect.h - 1) + rect.y;
 	Point ret = {px, py};
 	return ret;
 }
 
-i32 room_containing_point(Point pt, UIRect *rooms, i32 roomCount) {
-	for (i32 i = 0; i < roomCount; i++) {
-		if ((rooms[i].x <= pt.x) && ((rooms[i].x + rooms[i].w) > pt.x) &&
-			(rooms[i].y <= pt.y) && ((rooms[i].y + rooms[i].h) > pt.y)) {
-			return i;
-		}
+internal i32 
+room_set_find(i32 *roomSets, i32 room) {
+	// Find the room that stands for the set of rooms connected to this one
+	while (roomSets[room] != room) {
+		roomSets[room] = roomSets[roomSets[room]];
+		room = roomSets[room];
 	}
-	return -1;
+	return room;
+}
+
+bool room_set_join(i32 *roomSets, i32 room1, i32 room2) {
+	// Connect two rooms - returns false if they were already connected
+	i32 set1 = room_set_find(roomSets, room1);
+	i32 set2 = room_set_find(roomSets, room2);
+	if (set1 == set2) {
+		return false;
+	}
+	roomSets[set2] = set1;
+	return true;
 }
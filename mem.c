@@ -0,0 +1,315 @@
+/*
+* mem.c - Keeping track of memory
+*
+* Everything the game allocates goes through mem_malloc and friends, tagged
+* with the subsystem it's for. Each allocation has a small header in front
+* of it with its tag, size and where it was made, and the live ones are
+* kept in a list. So at any point we know how much each subsystem is holding
+* on to, the most it's held, and how many allocations it's making a frame -
+* and on the way out, exactly what was never freed, and where it came from.
+*
+* (Allocations can come from any thread, so the books are kept under a lock.)
+*
+* Things that only have to last the frame (strings being drawn, mostly) go 
+* in an arena instead, which is let go of all at once when the frame's done.
+*/
+
+#define MEM_CHECK				0x4d454d4f52594f4bULL	// In the header of every live allocation
+#define MEM_REPORT_SITES		20						// Places shown in the leak report
+#define MEM_ARENA_BLOCK_SIZE	(16 * 1024)				// Least an arena asks for at a time
+#define MEM_ARENA_HEADER		((sizeof(MemArenaBlock) + 15) & ~(size_t)15)
+
+typedef enum {
+	MEM_ECS,					// Game objects and components
+	MEM_UI,						// Screens, views, consoles, fonts, images and messages
+	MEM_CONFIG,					// Config files and the content built from them
+	MEM_MAPGEN,					// Levels, chunks, and building them
+	MEM_STRINGS,				// String_Create and friends
+	MEM_LISTS,					// List nodes, for whoever's list they're in
+	MEM_SAVE,					// Saves and recordings
+	MEM_OTHER,
+	MEM_TAG_COUNT
+} MemTag;
+
+typedef struct MemHeader {
+	struct MemHeader *prev;
+	struct MemHeader *next;
+	const char *file;
+	u64 size;
+	u32 line;
+	u32 tag;
+	u64 check;					// MEM_CHECK, to catch frees of things we didn't allocate
+} MemHeader;					// (Sized so what follows is as aligned as malloc would have it)
+
+typedef struct {
+	u64 liveBytes;
+	u64 peakBytes;
+	u32 liveCount;
+	u64 allocs;					// Ever made
+	u64 allocsAtFrameStart;
+	u64 allocsLastFrame;
+} MemStats;
+
+typedef struct MemArenaBlock {
+	struct MemArenaBlock *prev;
+	u64 size;
+	u64 used;
+} MemArenaBlock;
+
+typedef struct {
+	MemTag tag;
+	MemArenaBlock *block;		// Being allocated from (any earlier ones hang off it)
+	u64 used;					// Since the last reset, over all the blocks
+} MemArena;
+
+global_variable char *memTagNames[MEM_TAG_COUNT] = {
+	[MEM_ECS] = "ecs",
+	[MEM_UI] = "ui",
+	[MEM_CONFIG] = "config",
+	[MEM_MAPGEN] = "mapgen",
+	[MEM_STRINGS] = "strings",
+	[MEM_LISTS] = "lists",
+	[MEM_SAVE] = "save",
+	[MEM_OTHER] = "other"
+};
+
+global_variable SDL_SpinLock memLock = 0;
+global_variable MemHeader *memLive = NULL;			// Every live allocation, newest first
+global_variable MemStats memStats[MEM_TAG_COUNT];
+global_variable u64 memLiveBytes = 0;
+global_variable u64 memPeakBytes = 0;
+
+// Scratch memory for the frame being drawn (formatted strings, mostly), 
+// all of it let go at once when the frame's done. Main thread only.
+global_variable MemArena frameArena = {.tag = MEM_STRINGS};
+
+#define mem_malloc(tag, size)			mem_malloc_at(tag, size, __FILE__, __LINE__)
+#define mem_calloc(tag, count, size)	mem_calloc_at(tag, count, size, __FILE__, __LINE__)
+#define mem_realloc(tag, p, size)		mem_realloc_at(tag, p, size, __FILE__, __LINE__)
+#define mem_strdup(tag, s)				mem_strdup_at(tag, s, __FILE__, __LINE__)
+
+
+/* Bookkeeping */
+
+internal void
+mem_track(MemHeader *header, MemTag tag, u64 size, const char *file, u32 line) {
+	header->file = file;
+	header->line = line;
+	header->tag = tag;
+	header->size = size;
+	header->check = MEM_CHECK;
+	header->prev = NULL;
+
+	SDL_AtomicLock(&memLock);
+	header->next = memLive;
+	if (memLive != NULL) { memLive->prev = header; }
+	memLive = header;
+
+	MemStats *stats = &memStats[tag];
+	stats->liveBytes += size;
+	stats->liveCount += 1;
+	stats->allocs += 1;
+	if (stats->liveBytes > stats->peakBytes) { stats->peakBytes = stats->liveBytes; }
+	memLiveBytes += size;
+	if (memLiveBytes > memPeakBytes) { memPeakBytes = memLiveBytes; }
+	SDL_AtomicUnlock(&memLock);
+}
+
+internal void
+mem_untrack(MemHeader *header) {
+	assert(header->check == MEM_CHECK);
+	SDL_AtomicLock(&memLock);
+	if (header->prev != NULL) { header->prev->next = header->next; } else { memLive = header->next; }
+	if (header->next != NULL) { header->next->prev = header->prev; }
+
+	MemStats *stats = &memStats[header->tag];
+	stats->liveBytes -= header->size;
+	stats->liveCount -= 1;
+	memLiveBytes -= header->size;
+	SDL_AtomicUnlock(&memLock);
+	header->check = 0;
+}
+
+
+/* Allocating */
+
+void *mem_malloc_at(MemTag tag, size_t size, const char *file, u32 line) {
+	MemHeader *header = malloc(sizeof(MemHeader) + size);
+	if (header == NULL) {
+		return NULL;
+	}
+	mem_track(header, tag, size, file, line);
+	return header + 1;
+}
+
+void *mem_calloc_at(MemTag tag, size_t count, size_t size, const char *file, u32 line) {
+	MemHeader *header = calloc(1, sizeof(MemHeader) + (count * size));
+	if (header == NULL) {
+		return NULL;
+	}
+	mem_track(header, tag, count * size, file, line);
+	return header + 1;
+}
+
+void *mem_realloc_at(MemTag tag, void *p, size_t size, const char *file, u32 line) {
+	// The block may move, so it's taken off the books while it's resized
+	if (p == NULL) {
+		return mem_malloc_at(tag, size, file, line);
+	}
+	MemHeader *header = (MemHeader *)p - 1;
+	mem_untrack(header);
+	MemHeader *resized = realloc(header, sizeof(MemHeader) + size);
+	if (resized == NULL) {
+		mem_track(header, tag, header->size, header->file, header->line);
+		return NULL;
+	}
+	mem_track(resized, tag, size, file, line);
+	return resized + 1;
+}
+
+char *mem_strdup_at(MemTag tag, const char *s, const char *file, u32 line) {
+	size_t size = strlen(s) + 1;
+	char *copy = mem_malloc_at(tag, size, file, line);
+	if (copy != NULL) {
+		memcpy(copy, s, size);
+	}
+	return copy;
+}
+
+void mem_free(void *p) {
+	if (p == NULL) {
+		return;
+	}
+	MemHeader *header = (MemHeader *)p - 1;
+	mem_untrack(header);
+	free(header);
+}
+
+
+/* Arenas */
+
+void *mem_arena_alloc(MemArena *arena, size_t size) {
+	// Allocations just go one after another, so they're about free
+	size = (size + 15) & ~(size_t)15;
+	MemArenaBlock *block = arena->block;
+	if ((block == NULL) || (block->used + size > block->size)) {
+		u64 blockSize = (size > MEM_ARENA_BLOCK_SIZE) ? size : MEM_ARENA_BLOCK_SIZE;
+		MemArenaBlock *newBlock = mem_malloc(arena->tag, MEM_ARENA_HEADER + blockSize);
+		newBlock->prev = block;
+		newBlock->size = blockSize;
+		newBlock->used = 0;
+		arena->block = block = newBlock;
+	}
+	void *p = (u8 *)block + MEM_ARENA_HEADER + block->used;
+	block->used += size;
+	arena->used += size;
+	return p;
+}
+
+void mem_arena_free(MemArena *arena) {
+	MemArenaBlock *block = arena->block;
+	while (block != NULL) {
+		MemArenaBlock *prev = block->prev;
+		mem_free(block);
+		block = prev;
+	}
+	arena->block = NULL;
+	arena->used = 0;
+}
+
+void mem_arena_reset(MemArena *arena) {
+	// Let go of everything allocated from the arena. If it took more than 
+	// one block, they're swapped for a single one big enough to hold it all, 
+	// so from then on the arena doesn't go back to the heap.
+	MemArenaBlock *block = arena->block;
+	if ((block != NULL) && (block->prev != NULL)) {
+		u64 used = arena->used;
+		mem_arena_free(arena);
+		mem_arena_alloc(arena, used);
+		block = arena->block;
+	}
+	if (block != NULL) {
+		block->used = 0;
+	}
+	arena->used = 0;
+}
+
+
+/* Reporting */
+
+void mem_frame_end() {
+	// Note how many allocations each subsystem made over the frame
+	SDL_AtomicLock(&memLock);
+	for (i32 t = 0; t < MEM_TAG_COUNT; t++) {
+		memStats[t].allocsLastFrame = memStats[t].allocs - memStats[t].allocsAtFrameStart;
+		memStats[t].allocsAtFrameStart = memStats[t].allocs;
+	}
+	SDL_AtomicUnlock(&memLock);
+}
+
+void mem_stats_get(MemStats *stats) {
+	SDL_AtomicLock(&memLock);
+	memcpy(stats, memStats, sizeof(memStats));
+	SDL_AtomicUnlock(&memLock);
+}
+
+typedef struct {
+	const char *file;
+	u32 line;
+	u32 tag;
+	u32 count;
+	u64 bytes;
+} MemSite;
+
+internal int
+mem_site_compare(const void *a, const void *b) {
+	u64 bytesA = ((MemSite *)a)->bytes;
+	u64 bytesB = ((MemSite *)b)->bytes;
+	return (bytesA < bytesB) ? 1 : (bytesA > bytesB) ? -1 : 0;
+}
+
+void mem_leak_report() {
+	// What's still allocated, by subsystem, and the places that allocated the
+	// most of it. Called once everything has been torn down, so anything left
+	// was lost track of.
+	SDL_AtomicLock(&memLock);
+	fprintf(stderr, "Memory: peak %llu bytes, %llu bytes still allocated\n",
+			(unsigned long long)memPeakBytes, (unsigned long long)memLiveBytes);
+	if (memLive == NULL) {
+		SDL_AtomicUnlock(&memLock);
+		return;
+	}
+
+	for (i32 t = 0; t < MEM_TAG_COUNT; t++) {
+		if (memStats[t].liveCount == 0) { continue; }
+		fprintf(stderr, "  %-8s %8u allocations %10llu bytes (peak %llu)\n", memTagNames[t], memStats[t].liveCount,
+				(unsigned long long)memStats[t].liveBytes, (unsigned long long)memStats[t].peakBytes);
+	}
+
+	u32 siteCount = 0;
+	u32 siteCapacity = 64;
+	MemSite *sites = malloc(siteCapacity * sizeof(MemSite));
+	for (MemHeader *h = memLive; h != NULL; h = h->next) {
+		u32 s = 0;
+		while ((s < siteCount) && ((sites[s].line != h->line) || (strcmp(sites[s].file, h->file) != 0))) {
+			s += 1;
+		}
+		if (s == siteCount) {
+			if (siteCount == siteCapacity) {
+				siteCapacity *= 2;
+				sites = realloc(sites, siteCapacity * sizeof(MemSite));
+			}
+			sites[siteCount++] = (MemSite) {.file = h->file, .line = h->line, .tag = h->tag};
+		}
+		sites[s].count += 1;
+		sites[s].bytes += h->size;
+	}
+	SDL_AtomicUnlock(&memLock);
+
+	qsort(sites, siteCount, sizeof(MemSite), mem_site_compare);
+	for (u32 s = 0; (s < siteCount) && (s < MEM_REPORT_SITES); s++) {
+		fprintf(stderr, "  %s:%u (%s) %u allocations %llu bytes\n", sites[s].file, sites[s].line,
+				memTagNames[sites[s].tag], sites[s].count, (unsigned long long)sites[s].bytes);
+	}
+	free(sites);
+}
@@ -0,0 +1,334 @@
+/*
+* profile.c - Timing where frames and turns go
+*
+* Code that's worth keeping an eye on is wrapped in a scoped timer:
+*
+*	ProfileMark mark = profile_begin(PROFILE_FOV);
+*	...
+*	profile_end(mark);
+*
+* Each thread that's profiled has its own ring buffer of the scopes it's
+* timed, so timing never waits on a lock. The ring holds the last several
+* thousand scopes, and old ones are written over. Other threads read the
+* rings without stopping the owner, and throw away anything that could have
+* been written over while they were reading it.
+*
+* F3 shows an overlay with the min/avg/max of each scope over the last couple
+* of seconds (and what each subsystem has allocated - see mem.c), and F4 
+* writes the rings out as a Chrome trace (chrome://tracing or 
+* ui.perfetto.dev), as does -profile-trace <file> on the way out.
+*/
+
+#define PROFILE_RING_SIZE		16384		// Scopes kept for each thread (a power of 2)
+#define PROFILE_MAX_THREADS		8
+#define PROFILE_MAX_SCOPES		64
+#define PROFILE_WINDOW_MS		2000		// What the overlay's figures cover
+#define PROFILE_TRACE_FILE		"profile.json"
+#define PROFILE_VIEW_WIDTH		60
+#define PROFILE_VIEW_HEIGHT		36
+
+// The scopes that are always there - each view gets one too, when it's first drawn
+typedef enum {
+	PROFILE_FRAME,
+	PROFILE_RENDER_SCREEN,
+	PROFILE_GAME_UPDATE,
+	PROFILE_CHUNKS,
+	PROFILE_TARGET_MAP,
+	PROFILE_MOVEMENT,
+	PROFILE_ITEMS,
+	PROFILE_ENVIRONMENT,
+	PROFILE_HEALTH,
+	PROFILE_FOV,
+	PROFILE_ANIMATION,
+	PROFILE_LEVEL_INIT,
+	PROFILE_LEVEL_PREGEN,
+	PROFILE_SAVE_SNAPSHOT,
+	PROFILE_SAVE_WRITE,
+	PROFILE_WORLD_HASH,
+	PROFILE_SCOPE_COUNT
+} ProfileScope;
+
+typedef struct {
+	i32 scope;
+	u64 start;
+} ProfileMark;
+
+typedef struct {
+	i32 scope;
+	u64 start;
+	u64 end;
+} ProfileEvent;
+
+typedef struct {
+	char *threadName;
+	bool inUse;						// Whether a thread has it
+	SDL_atomic_t written;			// Count of events ever written to it
+	ProfileEvent events[PROFILE_RING_SIZE];
+} ProfileRing;
+
+global_variable char *profileScopeNames[PROFILE_MAX_SCOPES] = {
+	[PROFILE_FRAME] = "frame",
+	[PROFILE_RENDER_SCREEN] = "render_screen",
+	[PROFILE_GAME_UPDATE] = "game_update",
+	[PROFILE_CHUNKS] = "map_chunks_update",
+	[PROFILE_TARGET_MAP] = "generate_target_map",
+	[PROFILE_MOVEMENT] = "movement_update",
+	[PROFILE_ITEMS] = "item_lifetime_update",
+	[PROFILE_ENVIRONMENT] = "environment_update",
+	[PROFILE_HEALTH] = "health_removal_update",
+	[PROFILE_FOV] = "fov_calculate",
+	[PROFILE_ANIMATION] = "animation_update",
+	[PROFILE_LEVEL_INIT] = "level_init",
+	[PROFILE_LEVEL_PREGEN] = "level_plan_fill",
+	[PROFILE_SAVE_SNAPSHOT] = "save_snapshot",
+	[PROFILE_SAVE_WRITE] = "save_frame_write",
+	[PROFILE_WORLD_HASH] = "replay_stage"
+};
+global_variable i32 profileScopeCount = PROFILE_SCOPE_COUNT;
+
+global_variable SDL_SpinLock profileLock = 0;		// Guards the list of rings
+global_variable ProfileRing *profileRings[PROFILE_MAX_THREADS];
+global_variable i32 profileRingCount = 0;
+global_variable u64 profileEpoch = 0;				// When the first thread started profiling
+thread_variable ProfileRing *profileRing = NULL;	// This thread's
+
+global_variable bool profileOverlayShown = false;
+global_variable UIView *profileView = NULL;			// Built the first time it's shown
+
+
+/* Timing */
+
+void profile_thread_begin(char *threadName) {
+	// Start profiling the calling thread. A ring that a thread of the same
+	// name has finished with is picked up again, so threads that come and go
+	// don't use up more and more of them.
+	SDL_AtomicLock(&profileLock);
+	if (profileEpoch == 0) {
+		profileEpoch = SDL_GetPerformanceCounter();
+	}
+	ProfileRing *ring = NULL;
+	for (i32 i = 0; i < profileRingCount; i++) {
+		if (!profileRings[i]->inUse && (strcmp(profileRings[i]->threadName, threadName) == 0)) {
+			ring = profileRings[i];
+			break;
+		}
+	}
+	if ((ring == NULL) && (profileRingCount < PROFILE_MAX_THREADS)) {
+		ring = mem_calloc(MEM_OTHER, 1, sizeof(ProfileRing));
+		ring->threadName = threadName;
+		profileRings[profileRingCount++] = ring;
+	}
+	if (ring != NULL) {
+		ring->inUse = true;
+	}
+	SDL_AtomicUnlock(&profileLock);
+	profileRing = ring;
+}
+
+void profile_thread_end() {
+	if (profileRing == NULL) {
+		return;
+	}
+	SDL_AtomicLock(&profileLock);
+	profileRing->inUse = false;
+	SDL_AtomicUnlock(&profileLock);
+	profileRing = NULL;
+}
+
+i32 profile_scope_add(char *name) {
+	// Returns the scope with the given name, adding it if it's new (or -1 if
+	// there's no room). Only called on the main thread.
+	for (i32 i = 0; i < profileScopeCount; i++) {
+		if (strcmp(profileScopeNames[i], name) == 0) {
+			return i;
+		}
+	}
+	if (profileScopeCount == PROFILE_MAX_SCOPES) {
+		return -1;
+	}
+	profileScopeNames[profileScopeCount] = name;
+	return profileScopeCount++;
+}
+
+ProfileMark profile_begin(i32 scope) {
+	ProfileMark mark = {scope, SDL_GetPerformanceCounter()};
+	return mark;
+}
+
+void profile_end(ProfileMark mark) {
+	ProfileRing *ring = profileRing;
+	if ((ring == NULL) || (mark.scope < 0)) {
+		return;
+	}
+	// Only this thread writes to the ring, so the count can't change under
+	// us - bumping it afterwards is what makes the event visible to readers
+	u32 written = (u32)SDL_AtomicGet(&ring->written);
+	ProfileEvent *event = &ring->events[written & (PROFILE_RING_SIZE - 1)];
+	event->scope = mark.scope;
+	event->start = mark.start;
+	event->end = SDL_GetPerformanceCounter();
+	SDL_AtomicSet(&ring->written, (int)(written + 1));
+}
+
+
+/* Reading */
+
+internal u32
+profile_ring_copy(ProfileRing *ring, ProfileEvent *events) {
+	// Copy out what's in a ring, oldest first, and return how many events
+	// there are. The owner may be adding to it meanwhile, so anything that it
+	// could have written over (or be writing over now) is left out.
+	u32 written = (u32)SDL_AtomicGet(&ring->written);
+	u32 count = (written < PROFILE_RING_SIZE) ? written : PROFILE_RING_SIZE;
+	u32 first = written - count;
+	for (u32 i = 0; i < count; i++) {
+		events[i] = ring->events[(first + i) & (PROFILE_RING_SIZE - 1)];
+	}
+
+	u32 lost = (u32)SDL_AtomicGet(&ring->written) - written + 1;
+	if (count + lost > PROFILE_RING_SIZE) {
+		u32 skip = count + lost - PROFILE_RING_SIZE;
+		if (skip > count) { skip = count; }
+		memmove(events, events + skip, (count - skip) * sizeof(ProfileEvent));
+		count -= skip;
+	}
+	return count;
+}
+
+internal i32
+profile_rings_get(ProfileRing **rings) {
+	SDL_AtomicLock(&profileLock);
+	i32 count = profileRingCount;
+	memcpy(rings, profileRings, count * sizeof(ProfileRing *));
+	SDL_AtomicUnlock(&profileLock);
+	return count;
+}
+
+bool profile_trace_write(char *filename) {
+	// Write every thread's ring out as a Chrome trace, with times in
+	// microseconds since profiling started
+	FILE *file = fopen(filename, "w");
+	if (file == NULL) {
+		fprintf(stderr, "%s: couldn't write the profile\n", filename);
+		return false;
+	}
+
+	ProfileRing *rings[PROFILE_MAX_THREADS];
+	i32 ringCount = profile_rings_get(rings);
+	ProfileEvent *events = mem_malloc(MEM_OTHER, PROFILE_RING_SIZE * sizeof(ProfileEvent));
+	double usPerTick = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+	char *separator = "";
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (i32 t = 0; t < ringCount; t++) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				separator, t, rings[t]->threadName);
+		separator = ",\n";
+
+		u32 count = profile_ring_copy(rings[t], events);
+		for (u32 i = 0; i < count; i++) {
+			ProfileEvent *e = &events[i];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					profileScopeNames[e->scope], t,
+					(double)(e->start - profileEpoch) * usPerTick, (double)(e->end - e->start) * usPerTick);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	mem_free(events);
+
+	bool written = (fclose(file) == 0);
+	if (written) {
+		fprintf(stderr, "Wrote the profile to %s\n", filename);
+	}
+	return written;
+}
+
+void profile_shutdown() {
+	// Every thread that was being profiled has to have finished by now (and
+	// this has to come before the fonts are purged)
+	view_destroy(profileView);
+	profileView = NULL;
+	profile_thread_end();
+	for (i32 i = 0; i < profileRingCount; i++) {
+		mem_free(profileRings[i]);
+		profileRings[i] = NULL;
+	}
+	profileRingCount = 0;
+}
+
+
+/* Overlay */
+
+internal void
+render_profile_view(Console *console) {
+	// Min, average and max of each scope that's run recently, in milliseconds
+	local_persist ProfileEvent events[PROFILE_RING_SIZE];
+	u32 counts[PROFILE_MAX_SCOPES] = {0};
+	u64 totals[PROFILE_MAX_SCOPES] = {0};
+	u64 mins[PROFILE_MAX_SCOPES];
+	u64 maxes[PROFILE_MAX_SCOPES] = {0};
+
+	u64 frequency = SDL_GetPerformanceFrequency();
+	u64 now = SDL_GetPerformanceCounter();
+	u64 windowStart = now - ((frequency * PROFILE_WINDOW_MS) / 1000);
+
+	ProfileRing *rings[PROFILE_MAX_THREADS];
+	i32 ringCount = profile_rings_get(rings);
+	for (i32 t = 0; t < ringCount; t++) {
+		u32 count = profile_ring_copy(rings[t], events);
+		for (u32 i = 0; i < count; i++) {
+			ProfileEvent *e = &events[i];
+			if (e->end < windowStart) { continue; }
+			u64 ticks = e->end - e->start;
+			if ((counts[e->scope] == 0) || (ticks < mins[e->scope])) { mins[e->scope] = ticks; }
+			if (ticks > maxes[e->scope]) { maxes[e->scope] = ticks; }
+			totals[e->scope] += ticks;
+			counts[e->scope] += 1;
+		}
+	}
+
+	UIRect rect = {0, 0, console->colCount, console->rowCount};
+	view_draw_rect(console, &rect, 0x111111ee, 0, 0xFF990099);
+
+	char title[32];
+	char line[128];
+	snprintf(title, sizeof(title), "Last %ds (ms)", PROFILE_WINDOW_MS / 1000);
+	snprintf(line, sizeof(line), "%-24s %6s %8s %8s %8s", title, "count", "min", "avg", "max");
+	console_put_string_at(console, line, 1, 0, 0xFF9900ff, 0x00000000);
+
+	// (Leaving room for the memory use at the bottom)
+	double msPerTick = 1000.0 / (double)frequency;
+	i32 memoryRow = (i32)console->rowCount - (MEM_TAG_COUNT + 1);
+	i32 row = 1;
+	for (i32 s = 0; (s < profileScopeCount) && (row < memoryRow); s++) {
+		if (counts[s] == 0) { continue; }
+		snprintf(line, sizeof(line), "%-24.24s %6u %8.3f %8.3f %8.3f", profileScopeNames[s], counts[s],
+				 mins[s] * msPerTick, ((double)totals[s] / counts[s]) * msPerTick, maxes[s] * msPerTick);
+		console_put_string_at(console, line, 1, row, 0xccccccff, 0x00000000);
+		row += 1;
+	}
+
+	// What each subsystem has allocated, and how many allocations it made last frame
+	MemStats stats[MEM_TAG_COUNT];
+	mem_stats_get(stats);
+	snprintf(line, sizeof(line), "%-24s %6s %8s %8s %8s", "Memory (KB)", "allocs", "live", "peak", "frame");
+	console_put_string_at(console, line, 1, memoryRow, 0xFF9900ff, 0x00000000);
+	for (i32 t = 0; t < MEM_TAG_COUNT; t++) {
+		snprintf(line, sizeof(line), "%-24s %6u %8llu %8llu %8llu", memTagNames[t], stats[t].liveCount,
+				 (unsigned long long)(stats[t].liveBytes / 1024), (unsigned long long)(stats[t].peakBytes / 1024),
+				 (unsigned long long)stats[t].allocsLastFrame);
+		console_put_string_at(console, line, 1, memoryRow + 1 + t, 0xccccccff, 0x00000000);
+	}
+}
+
+internal UIView *
+profile_view() {
+	// The overlay sits over the top right of the screen
+	if (profileView == NULL) {
+		UIRect rect = {SCREEN_WIDTH - (16 * PROFILE_VIEW_WIDTH), 0, (16 * PROFILE_VIEW_WIDTH), (16 * PROFILE_VIEW_HEIGHT)};
+		profileView = view_new(rect, PROFILE_VIEW_WIDTH, PROFILE_VIEW_HEIGHT,
+							   "./terminal16x16.png", 0, 0x000000ff,
+							   true, render_profile_view, "profiler");
+	}
+	return profileView;
+}
@@ -0,0 +1,378 @@
+/*
+* replay.c - Recording and playing back sessions
+*
+* A recording is the seed of each run started, every key pressed (with the
+* frame it was pressed on), and hashes of the world state after each stage
+* of every turn.
+* Since everything random in a run comes from its seed, feeding the same
+* keys back through the same event handlers on the same frames gets the
+* same game. Playback runs headless, as fast as it can, and checks the hashes
+* as it goes, so a recording doubles as a determinism check and a benchmark.
+* If a turn goes differently, the first stage whose hash is different says
+* which system is to blame.
+*
+* The world's hash is made up of a hash for each part of it: each section of
+* a save, and the map, which is kept hashed as cells change. With -hash-log,
+* every part's hash at every stage is written out, so two logs (from old and
+* new versions of some code, say) can be diffed to see exactly what changed.
+*
+* The file is a header followed by entries, each a tag byte and its fields.
+* Numbers that are usually small (frame gaps, turns, keys) are varints.
+*/
+
+#define REPLAY_MAGIC		0x50524344		// "DCRP"
+#define REPLAY_VERSION		3
+#define REPLAY_HASH_MAP		SAVE_SECTION_CHUNKS			// The map's part comes after the save's sections
+#define REPLAY_HASH_PARTS	(SAVE_SECTION_CHUNKS + 1)
+
+typedef enum {
+	REPLAY_OFF,
+	REPLAY_RECORDING,
+	REPLAY_PLAYING
+} ReplayMode;
+
+typedef enum {
+	REPLAY_KEY = 1,			// frames since the last entry, key
+	REPLAY_RUN,				// seed of a new run
+	REPLAY_TURN,			// turn number, world hash after each stage
+	REPLAY_END				// frames since the last entry
+} ReplayEntry;
+
+global_variable ReplayMode replayMode = REPLAY_OFF;
+global_variable FILE *replayFile = NULL;		// Being recorded
+global_variable u8 *replayData = NULL;			// Being played back
+global_variable u32 replaySize = 0;
+global_variable u32 replayPos = 0;
+global_variable u32 replayFrame = 0;			// Frame of the last entry
+global_variable bool replayCutShort = false;	// Set if the recording ends part way through an entry
+
+global_variable u64 replayStageHashes[TURN_STAGE_COUNT];	// For the turn being taken
+global_variable FILE *replayHashLog = NULL;
+
+global_variable char *replayStageNames[TURN_STAGE_COUNT] = {
+	"player", "chunks", "movement", "items", "environment", "health", "fov"
+};
+global_variable char *replayHashPartNames[REPLAY_HASH_PARTS] = {
+	[SAVE_SECTION_RUN] = "run",
+	[SAVE_SECTION_OBJECTS] = "objects",
+	[SAVE_SECTION_COMPONENTS + COMP_POSITION] = "position",
+	[SAVE_SECTION_COMPONENTS + COMP_VISIBILITY] = "visibility",
+	[SAVE_SECTION_COMPONENTS + COMP_PHYSICAL] = "physical",
+	[SAVE_SECTION_COMPONENTS + COMP_HEALTH] = "health",
+	[SAVE_SECTION_COMPONENTS + COMP_MOVEMENT] = "movement",
+	[SAVE_SECTION_COMPONENTS + COMP_COMBAT] = "combat",
+	[SAVE_SECTION_COMPONENTS + COMP_EQUIPMENT] = "equipment",
+	[SAVE_SECTION_COMPONENTS + COMP_TREASURE] = "treasure",
+	[SAVE_SECTION_COMPONENTS + COMP_ANIMATION] = "animation",
+	[SAVE_SECTION_CELLS] = "cells",
+	[SAVE_SECTION_CARRIED] = "carried",
+	[REPLAY_HASH_MAP] = "map"
+};
+
+// Playback results
+global_variable i32 replayTurns = 0;
+global_variable i32 replayMismatchTurn = 0;		// First turn the world didn't match (0 if none)
+global_variable i32 replayMismatchStage = TURN_STAGE_COUNT;	// Where in that turn (if it got that far)
+global_variable u64 replayTurnTicks = 0;		// Spent on turns
+global_variable u64 replaySlowestTicks = 0;
+global_variable i32 replaySlowestTurn = 0;
+
+void save_section_hashes(u64 *hashes);
+
+
+bool replay_playing() {
+	return replayMode == REPLAY_PLAYING;
+}
+
+bool replay_active() {
+	return replayMode != REPLAY_OFF;
+}
+
+
+/* World Hashes */
+
+bool replay_hash_log_start(char *filename) {
+	replayHashLog = fopen(filename, "w");
+	if (replayHashLog == NULL) {
+		fprintf(stderr, "%s: can't write to it\n", filename);
+		return false;
+	}
+	return true;
+}
+
+internal u64
+replay_world_hash(u64 *parts) {
+	save_section_hashes(parts);
+	parts[SAVE_SECTION_OBJECTS] = gameObjectsHash;
+	parts[SAVE_SECTION_CELLS] = cellObjectsHash;
+	parts[REPLAY_HASH_MAP] = mapHash;
+	return save_hash(0xcbf29ce484222325ULL, parts, REPLAY_HASH_PARTS * sizeof(u64));
+}
+
+void replay_stage(TurnStage stage) {
+	// A stage of the turn is done - note the state of the world
+	if ((replayMode == REPLAY_OFF) && (replayHashLog == NULL)) {
+		return;
+	}
+	ProfileMark mark = profile_begin(PROFILE_WORLD_HASH);
+	u64 parts[REPLAY_HASH_PARTS];
+	replayStageHashes[stage] = replay_world_hash(parts);
+	profile_end(mark);
+
+	if (replayHashLog != NULL) {
+		fprintf(replayHashLog, "%d %s", turnsTaken, replayStageNames[stage]);
+		for (i32 i = 0; i < REPLAY_HASH_PARTS; i++) {
+			fprintf(replayHashLog, " %s=%016llx", replayHashPartNames[i], (unsigned long long)parts[i]);
+		}
+		fputc('\n', replayHashLog);
+	}
+}
+
+
+/* Recording */
+
+internal void
+replay_put_varint(u64 value) {
+	u8 bytes[10];
+	i32 count = 0;
+	do {
+		bytes[count] = value & 0x7f;
+		value >>= 7;
+		if (value != 0) { bytes[count] |= 0x80; }
+		count += 1;
+	} while (value != 0);
+	fwrite(bytes, 1, count, replayFile);
+}
+
+internal void
+replay_put_u64(u64 value) {
+	fwrite(&value, sizeof(value), 1, replayFile);
+}
+
+bool replay_record_start(char *filename) {
+	replayFile = fopen(filename, "wb");
+	if (replayFile == NULL) {
+		fprintf(stderr, "%s: can't record to it\n", filename);
+		return false;
+	}
+	u32 header[2] = {REPLAY_MAGIC, REPLAY_VERSION};
+	fwrite(header, sizeof(header), 1, replayFile);
+	replayMode = REPLAY_RECORDING;
+	replayFrame = 0;
+	return true;
+}
+
+void replay_record_key(u32 frame, SDL_Keycode key) {
+	if (replayMode != REPLAY_RECORDING) {
+		return;
+	}
+	fputc(REPLAY_KEY, replayFile);
+	replay_put_varint(frame - replayFrame);
+	replay_put_varint((u32)key);
+	replayFrame = frame;
+
+	// Keep the file up to date, in case we crash
+	fflush(replayFile);
+}
+
+
+/* Playback */
+
+internal u64
+replay_get_varint() {
+	u64 value = 0;
+	for (i32 shift = 0; (shift < 64) && (replayPos < replaySize); shift += 7) {
+		u8 byte = replayData[replayPos++];
+		value |= (u64)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return value;
+		}
+	}
+	replayPos = replaySize;
+	replayCutShort = true;
+	return 0;
+}
+
+internal u64
+replay_get_u64() {
+	u64 value = 0;
+	if (replaySize - replayPos < sizeof(value)) {
+		replayPos = replaySize;
+		replayCutShort = true;
+		return 0;
+	}
+	memcpy(&value, replayData + replayPos, sizeof(value));
+	replayPos += sizeof(value);
+	return value;
+}
+
+bool replay_play_start(char *filename) {
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "%s: can't open it\n", filename);
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	replayData = mem_malloc(MEM_SAVE, (size > 0) ? size : 1);
+	replaySize = (fread(replayData, 1, size, file) == (size_t)size) ? size : 0;
+	fclose(file);
+
+	u32 header[2] = {0, 0};
+	if (replaySize >= sizeof(header)) {
+		memcpy(header, replayData, sizeof(header));
+	}
+	if ((header[0] != REPLAY_MAGIC) || (header[1] != REPLAY_VERSION)) {
+		fprintf(stderr, "%s: not a recording (or from a different version of the game)\n", filename);
+		mem_free(replayData);
+		replayData = NULL;
+		return false;
+	}
+	replayPos = sizeof(header);
+	replayMode = REPLAY_PLAYING;
+	replayFrame = 0;
+	replayCutShort = false;
+	return true;
+}
+
+bool replay_next_event(u32 frame, SDL_Event *event) {
+	// Gets the next key pressed on this frame, if there is one. The end of the
+	// recording comes back as a quit.
+	if (replayMode != REPLAY_PLAYING) {
+		return false;
+	}
+	memset(event, 0, sizeof(SDL_Event));
+	event->type = SDL_QUIT;
+	if (replayPos >= replaySize) {
+		// Cut short (the game crashed while recording, say)
+		return true;
+	}
+	u8 tag = replayData[replayPos];
+	if ((tag != REPLAY_KEY) && (tag != REPLAY_END)) {
+		// A run or turn comes after the key press that caused it, on the same
+		// frame. If the game didn't get to it, it's gone a different way to
+		// the recording, so there's no point going on.
+		if (frame == replayFrame) {
+			return false;
+		}
+		if (replayMismatchTurn == 0) { replayMismatchTurn = replayTurns + 1; }
+		replayPos = replaySize;
+		return true;
+	}
+
+	u32 start = replayPos++;
+	u32 keyFrame = replayFrame + (u32)replay_get_varint();
+	if (keyFrame > frame) {
+		replayPos = start;
+		return false;
+	}
+	replayFrame = keyFrame;
+	if (tag == REPLAY_END) {
+		replayPos = replaySize;
+		return true;
+	}
+	SDL_Keycode key = (SDL_Keycode)replay_get_varint();
+	if (!replayCutShort) {
+		event->type = SDL_KEYDOWN;
+		event->key.keysym.sym = key;
+	}
+	return true;
+}
+
+
+/* Both */
+
+void replay_run_seed(u64 *seed) {
+	// A new run is starting - note its seed, or use the one it had before
+	if (replayMode == REPLAY_RECORDING) {
+		fputc(REPLAY_RUN, replayFile);
+		replay_put_u64(*seed);
+	} else if (replayMode == REPLAY_PLAYING) {
+		if ((replayPos < replaySize) && (replayData[replayPos] == REPLAY_RUN)) {
+			replayPos += 1;
+			*seed = replay_get_u64();
+		} else if (replayMismatchTurn == 0) {
+			replayMismatchTurn = replayTurns + 1;
+		}
+	}
+}
+
+void replay_turn(i32 turn, u64 ticks) {
+	// The player took a turn (which took ticks to run). Note the state of the
+	// world after each stage, or check it's the same as when it was recorded.
+	if (replayMode == REPLAY_RECORDING) {
+		fputc(REPLAY_TURN, replayFile);
+		replay_put_varint(turn);
+		for (i32 stage = 0; stage < TURN_STAGE_COUNT; stage++) {
+			replay_put_u64(replayStageHashes[stage]);
+		}
+		fflush(replayFile);
+	} else if (replayMode == REPLAY_PLAYING) {
+		replayTurns += 1;
+		replayTurnTicks += ticks;
+		if (ticks > replaySlowestTicks) {
+			replaySlowestTicks = ticks;
+			replaySlowestTurn = replayTurns;
+		}
+
+		if (replayPos >= replaySize) {
+			// The recording stops here
+			return;
+		}
+		bool matches = (replayData[replayPos] == REPLAY_TURN);
+		i32 stage = TURN_STAGE_COUNT;
+		if (matches) {
+			replayPos += 1;
+			matches = ((i32)replay_get_varint() == turn);
+			for (i32 s = 0; s < TURN_STAGE_COUNT; s++) {
+				if ((replay_get_u64() != replayStageHashes[s]) && (stage == TURN_STAGE_COUNT)) {
+					stage = s;
+				}
+			}
+			matches = replayCutShort || (matches && (stage == TURN_STAGE_COUNT));
+		}
+		if (!matches && (replayMismatchTurn == 0)) {
+			replayMismatchTurn = replayTurns;
+			replayMismatchStage = stage;
+		}
+	}
+	memset(replayStageHashes, 0, sizeof(replayStageHashes));
+}
+
+bool replay_finish(u32 frame, u64 ticks) {
+	// Finish the recording off, or report how the playback went (which took
+	// ticks in all). Returns false if the playback didn't match.
+	if (replayMode == REPLAY_RECORDING) {
+		fputc(REPLAY_END, replayFile);
+		replay_put_varint(frame - replayFrame);
+		fclose(replayFile);
+		replayFile = NULL;
+
+	} else if (replayMode == REPLAY_PLAYING) {
+		double freq = (double)SDL_GetPerformanceFrequency();
+		printf("Replayed %d turns over %u frames in %.1fms (%.1fms on turns, %.0f turns/s)\n",
+			replayTurns, frame, ticks * 1000.0 / freq, replayTurnTicks * 1000.0 / freq,
+			(replayTurnTicks > 0) ? replayTurns * freq / replayTurnTicks : 0.0);
+		if (replayTurns > 0) {
+			printf("Slowest turn: %d (%.3fms)\n", replaySlowestTurn, replaySlowestTicks * 1000.0 / freq);
+			printf("Last run: %d kills, hit %d of %d attacks, %d damage dealt, %d taken, %d items picked up (%d crumbled)\n",
+				runStats.kills, runStats.hits, runStats.attacks, runStats.damageDealt, runStats.damageTaken,
+				runStats.itemsPickedUp, runStats.itemsCrumbled);
+		}
+		if (replayMismatchStage < TURN_STAGE_COUNT) {
+			printf("Turn %d didn't match the recording, from the %s stage on\n", replayMismatchTurn, replayStageNames[replayMismatchStage]);
+		} else if (replayMismatchTurn != 0) {
+			printf("Turn %d didn't match the recording\n", replayMismatchTurn);
+		}
+		mem_free(replayData);
+		replayData = NULL;
+	}
+	if (replayHashLog != NULL) {
+		fclose(replayHashLog);
+		replayHashLog = NULL;
+	}
+	bool matched = (replayMismatchTurn == 0);
+	replayMode = REPLAY_OFF;
+	return matched;
+}
@@ -0,0 +1,157 @@
+/*
+* rng.c - Seedable random number streams
+*
+* Each stream has its own state, so different parts of the game can draw
+* random numbers without disturbing each other. The generator is xoshiro256**.
+*/
+
+typedef struct {
+	u64 s[4];
+} RNG;
+
+
+internal u64
+rng_splitmix(u64 *x) {
+	// Used to spread a single seed value out over the generator state
+	u64 z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+internal u64
+rng_rotl(u64 x, i32 k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+u64 rng_derive_seed(u64 seed, u64 streamId) {
+	// Make a seed for a sub-stream (a level, a chunk, a subsystem) from a
+	// parent seed, so everything can be traced back to one seed for the run
+	u64 x = seed ^ (streamId * 0xd1b54a32d192ed03ULL);
+	return rng_splitmix(&x);
+}
+
+void rng_seed(RNG *rng, u64 seed) {
+	u64 x = seed;
+	for (i32 i = 0; i < 4; i++) {
+		rng->s[i] = rng_splitmix(&x);
+	}
+}
+
+u64 rng_next(RNG *rng) {
+	u64 *s = rng->s;
+	u64 result = rng_rotl(s[1] * 5, 7) * 9;
+	u64 t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rng_rotl(s[3], 45);
+
+	return result;
+}
+
+u32 rng_range(RNG *rng, u32 n) {
+	// Random number from 0 to n-1
+	return (u32)(((rng_next(rng) >> 32) * n) >> 32);
+}
+
+
+/* Alias Tables */
+
+// Walker's alias method - after building the table once, picking from a 
+// weighted set of choices takes one random number, however many choices there are
+
+typedef struct {
+	i32 count;
+	u64 *threshold;		// Out of 2^32 - keep the column if the coin flip is under this
+	i32 *alias;			// Otherwise, take this choice instead
+} AliasTable;
+
+
+void alias_table_build(AliasTable *table, i32 *weights, i32 count) {
+	// Weights don't need to add up to anything in particular. Choices with 
+	// no weight are never picked, and if nothing has weight the table is empty.
+	table->count = 0;
+	table->threshold = NULL;
+	table->alias = NULL;
+
+	u64 total = 0;
+	for (i32 i = 0; i < count; i++) {
+		if (weights[i] > 0) { total += weights[i]; }
+	}
+	if (total == 0) {
+		return;
+	}
+
+	// Each column holds total/count worth of weight, so scale the weights 
+	// by count to keep the sums in whole numbers
+	table->count = count;
+	table->threshold = mem_calloc(MEM_CONFIG, count, sizeof(u64));
+	table->alias = mem_calloc(MEM_CONFIG, count, sizeof(i32));
+	u64 *scaled = mem_calloc(MEM_CONFIG, count, sizeof(u64));
+	i32 *small = mem_calloc(MEM_CONFIG, count, sizeof(i32));
+	i32 *large = mem_calloc(MEM_CONFIG, count, sizeof(i32));
+	i32 smallCount = 0;
+	i32 largeCount = 0;
+	for (i32 i = 0; i < count; i++) {
+		scaled[i] = (weights[i] > 0) ? (u64)weights[i] * count : 0;
+		if (scaled[i] < total) {
+			small[smallCount++] = i;
+		} else {
+			large[largeCount++] = i;
+		}
+	}
+
+	// Top up each under-full column from an over-full one
+	while ((smallCount > 0) && (largeCount > 0)) {
+		i32 s = small[--smallCount];
+		i32 l = large[--largeCount];
+		table->threshold[s] = (scaled[s] << 32) / total;
+		table->alias[s] = l;
+		scaled[l] = (scaled[l] + scaled[s]) - total;
+		if (scaled[l] < total) {
+			small[smallCount++] = l;
+		} else {
+			large[largeCount++] = l;
+		}
+	}
+
+	// Whatever's left is (give or take rounding) exactly full
+	while (largeCount > 0) {
+		i32 l = large[--largeCount];
+		table->threshold[l] = 1ULL << 32;
+		table->alias[l] = l;
+	}
+	while (smallCount > 0) {
+		i32 s = small[--smallCount];
+		table->threshold[s] = 1ULL << 32;
+		table->alias[s] = s;
+	}
+
+	mem_free(scaled);
+	mem_free(small);
+	mem_free(large);
+}
+
+i32 alias_table_pick(AliasTable *table, RNG *rng) {
+	// Returns the index of the chosen weight, or -1 if the table is empty. The 
+	// top half of the random number picks the column, the bottom half flips the coin.
+	if (table->count == 0) {
+		return -1;
+	}
+	u64 r = rng_next(rng);
+	i32 column = (i32)(((r >> 32) * (u64)table->count) >> 32);
+	u64 coin = r & 0xffffffffULL;
+	return (coin < table->threshold[column]) ? column : table->alias[column];
+}
+
+void alias_table_free(AliasTable *table) {
+	mem_free(table->threshold);
+	mem_free(table->alias);
+	table->threshold = NULL;
+	table->alias = NULL;
+	table->count = 0;
+}
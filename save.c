@@ -0,0 +1,1210 @@
+/*
+* save.c - Saving and loading the game
+*
+* A save is a snapshot of the whole world state: the run's seeds and random
+* number streams, the current level's map, every game object and component,
+* what the player is carrying, and the message log. The snapshot is split
+* into sections (each component list, each chunk of the map, and so on),
+* with each string stored only once per frame.
+*
+* The game is checkpointed after every turn. A checkpoint is serialized into
+* memory on the main thread, keeping only the sections that have changed
+* since the last one, and a background thread appends it to the save file
+* as a frame. Every so often the file is rewritten with a full frame, so it
+* doesn't keep growing. Loading plays the frames back in order, and stops at
+* the first one that's damaged (from a crash part way through writing it).
+*/
+
+#define SAVE_FILE				"dark.sav"
+#define SAVE_MAGIC				0x56534344		// "DCSV"
+#define SAVE_VERSION			3
+#define SAVE_COMPACT_FRAMES		50				// Frames of changes before the save is rewritten in full
+#define SAVE_NO_STRING			0xffffffff
+#define SAVE_MESSAGES			100				// Newest messages saved (not the whole scrollback)
+
+typedef enum {
+	SAVE_SECTION_RUN,
+	SAVE_SECTION_OBJECTS,
+	SAVE_SECTION_COMPONENTS,					// One for each type of component
+	SAVE_SECTION_CELLS = SAVE_SECTION_COMPONENTS + COMPONENT_COUNT,
+	SAVE_SECTION_CARRIED,
+	SAVE_SECTION_CHUNKS							// One for each generated chunk of the map
+} SaveSection;
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 full;					// Whether the frame has every section, or just the changed ones
+	u32 checksum;				// Of everything after the header
+	u32 stringCount;
+	u32 stringBytes;
+	u32 bodyBytes;				// Sections, each an id and size followed by its data
+} SaveFrameHeader;
+
+typedef struct {
+	u8 *data;
+	u32 size;
+	u32 capacity;
+} SaveBuffer;
+
+typedef struct {
+	SaveBuffer body;
+	SaveBuffer strings;			// Each distinct string, NUL-terminated
+	u32 stringCount;
+	u32 *stringOffsets;			// Where each string starts in the strings buffer
+	u32 *stringTable;			// Hash table of string index + 1 (0 if empty)
+	u32 stringTableCapacity;
+	bool full;
+	u64 *hashes;				// If set, each section is just hashed into here, rather than kept
+	u32 sectionStart;			// Where the section being written starts in the body
+	u64 sectionHash;			// Of what's been written to the section (with strings, not their indexes)
+} SaveWriter;
+
+typedef struct {
+	u8 *data;
+	u32 size;
+	u32 pos;
+	char **strings;
+	u32 stringCount;
+	bool failed;				// Set if anything read is out of range
+} SaveReader;
+
+typedef struct SaveJob {
+	char *filename;
+	u8 *frame;
+	u32 frameSize;
+	struct SaveJob *next;
+} SaveJob;
+
+// Animations are saved as an index into this table
+global_variable void (*saveAnimations[])(u32) = {animateGem};
+#define SAVE_ANIMATION_COUNT	(i32)(sizeof(saveAnimations) / sizeof(saveAnimations[0]))
+
+// The list each type of component is kept in
+global_variable List **saveComponentLists[COMPONENT_COUNT] = {
+	[COMP_POSITION] = &positionComps,
+	[COMP_VISIBILITY] = &visibilityComps,
+	[COMP_PHYSICAL] = &physicalComps,
+	[COMP_HEALTH] = &healthComps,
+	[COMP_MOVEMENT] = &movementComps,
+	[COMP_COMBAT] = &combatComps,
+	[COMP_EQUIPMENT] = &equipmentComps,
+	[COMP_TREASURE] = &treasureComps,
+	[COMP_ANIMATION] = &animationComps
+};
+
+// What each section held when it was last saved (0 if it needs saving),
+// and what the save file was for
+global_variable u64 *savedSectionHashes = NULL;
+global_variable u32 savedSectionCount = 0;
+global_variable i32 savedFrames = 0;
+global_variable i32 savedLevel = 0;
+global_variable u64 savedMapSeed = 0;
+global_variable char *savedFilename = NULL;
+
+// Frames waiting to be written by the background thread
+global_variable SDL_Thread *saveThread = NULL;
+global_variable SDL_mutex *saveLock = NULL;
+global_variable SDL_cond *saveWake = NULL;		// Signalled when there's a frame to write (or it's time to stop)
+global_variable SDL_cond *saveIdle = NULL;		// Signalled when a frame has been written
+global_variable SaveJob *saveJobsHead = NULL;
+global_variable SaveJob *saveJobsTail = NULL;
+global_variable bool saveWriting = false;
+global_variable bool saveStopping = false;
+global_variable SDL_atomic_t saveFailed;		// Set if a frame couldn't be written
+
+
+/* Writing */
+
+internal void
+save_put(SaveBuffer *buffer, void *data, u32 size) {
+	if (buffer->size + size > buffer->capacity) {
+		u32 capacity = (buffer->capacity > 0) ? buffer->capacity : 4096;
+		while (buffer->size + size > capacity) {
+			capacity *= 2;
+		}
+		buffer->data = mem_realloc(MEM_SAVE, buffer->data, capacity);
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+internal u64
+save_hash(u64 hash, void *data, u32 size) {
+	// FNV-1a
+	u8 *bytes = (u8 *)data;
+	for (u32 i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+internal void
+save_put_data(SaveWriter *w, void *data, u32 size) {
+	w->sectionHash = save_hash(w->sectionHash, data, size);
+	save_put(&w->body, data, size);
+}
+
+internal void save_put_u8(SaveWriter *w, u8 value) { save_put_data(w, &value, sizeof(value)); }
+internal void save_put_i32(SaveWriter *w, i32 value) { save_put_data(w, &value, sizeof(value)); }
+internal void save_put_u32(SaveWriter *w, u32 value) { save_put_data(w, &value, sizeof(value)); }
+internal void save_put_u64(SaveWriter *w, u64 value) { save_put_data(w, &value, sizeof(value)); }
+
+internal u32
+save_string_hash(char *s) {
+	// FNV-1a
+	u32 hash = 2166136261u;
+	while (*s != '\0') {
+		hash = (hash ^ (u8)*s++) * 16777619u;
+	}
+	return hash;
+}
+
+internal void
+save_strings_grow(SaveWriter *w) {
+	// Keep the hash table no more than half full
+	u32 capacity = (w->stringTableCapacity > 0) ? w->stringTableCapacity * 2 : 256;
+	u32 *table = mem_calloc(MEM_SAVE, capacity, sizeof(u32));
+	for (u32 i = 0; i < w->stringCount; i++) {
+		u32 slot = save_string_hash((char *)w->strings.data + w->stringOffsets[i]) & (capacity - 1);
+		while (table[slot] != 0) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		table[slot] = i + 1;
+	}
+	mem_free(w->stringTable);
+	w->stringTable = table;
+	w->stringTableCapacity = capacity;
+	w->stringOffsets = mem_realloc(MEM_SAVE, w->stringOffsets, (capacity / 2) * sizeof(u32));
+}
+
+internal void
+save_put_string(SaveWriter *w, char *s) {
+	// Strings are written as an index into the frame's string table. The
+	// section's hash has the string itself, since indexes differ between frames.
+	if (s == NULL) {
+		save_put_u32(w, SAVE_NO_STRING);
+		return;
+	}
+	w->sectionHash = save_hash(w->sectionHash, s, strlen(s) + 1);
+	if (w->hashes != NULL) {
+		return;
+	}
+
+	if ((w->stringCount + 1) * 2 > w->stringTableCapacity) {
+		save_strings_grow(w);
+	}
+	u32 slot = save_string_hash(s) & (w->stringTableCapacity - 1);
+	while (w->stringTable[slot] != 0) {
+		u32 index = w->stringTable[slot] - 1;
+		if (strcmp((char *)w->strings.data + w->stringOffsets[index], s) == 0) {
+			save_put(&w->body, &index, sizeof(index));
+			return;
+		}
+		slot = (slot + 1) & (w->stringTableCapacity - 1);
+	}
+
+	u32 index = w->stringCount++;
+	w->stringOffsets[index] = w->strings.size;
+	save_put(&w->strings, s, strlen(s) + 1);
+	w->stringTable[slot] = index + 1;
+	save_put(&w->body, &index, sizeof(index));
+}
+
+internal void
+save_put_rng(SaveWriter *w, RNG *rng) {
+	for (i32 i = 0; i < 4; i++) {
+		save_put_u64(w, rng->s[i]);
+	}
+}
+
+internal void
+save_section_begin(SaveWriter *w, u32 section) {
+	// Sections start with their id and size (filled in at the end)
+	w->sectionStart = w->body.size;
+	w->sectionHash = 0xcbf29ce484222325ULL;
+	u32 header[2] = {section, 0};
+	save_put(&w->body, header, sizeof(header));
+}
+
+internal void
+save_section_end(SaveWriter *w) {
+	// Keep the section if it's changed since it was last saved (or this is a
+	// full save), otherwise drop it again
+	u32 header[2];
+	memcpy(header, w->body.data + w->sectionStart, sizeof(header));
+	u32 section = header[0];
+	u64 hash = w->sectionHash | 1;		// (Never 0, which means unsaved)
+	if (w->hashes != NULL) {
+		w->hashes[section] = hash;
+		w->body.size = w->sectionStart;
+		return;
+	}
+	if (!w->full && (savedSectionHashes[section] == hash)) {
+		w->body.size = w->sectionStart;
+		return;
+	}
+	header[1] = w->body.size - w->sectionStart - sizeof(header);
+	memcpy(w->body.data + w->sectionStart, header, sizeof(header));
+	savedSectionHashes[section] = hash;
+}
+
+internal void
+save_write_components(SaveWriter *w, i32 comp) {
+	// Each component list is written in order, so things happen in the same
+	// order after loading (which monster moves first, say)
+	List *comps = *saveComponentLists[comp];
+	save_put_u32(w, list_size(comps));
+	for (ListElement *e = list_head(comps); e != NULL; e = list_next(e)) {
+		switch (comp) {
+			case COMP_POSITION: {
+				Position *p = (Position *)list_data(e);
+				save_put_i32(w, p->objectId);
+				save_put_i32(w, p->x);
+				save_put_i32(w, p->y);
+				save_put_u8(w, p->layer);
+			}
+			break;
+
+			case COMP_VISIBILITY: {
+				Visibility *v = (Visibility *)list_data(e);
+				save_put_i32(w, v->objectId);
+				save_put_u8(w, v->glyph);
+				save_put_u32(w, v->fgColor);
+				save_put_u32(w, v->bgColor);
+				save_put_u8(w, v->hasBeenSeen);
+				save_put_u8(w, v->visibleOutsideFOV);
+				save_put_string(w, v->name);
+			}
+			break;
+
+			case COMP_PHYSICAL: {
+				Physical *p = (Physical *)list_data(e);
+				save_put_i32(w, p->objectId);
+				save_put_u8(w, p->blocksMovement);
+				save_put_u8(w, p->blocksSight);
+			}
+			break;
+
+			case COMP_MOVEMENT: {
+				Movement *m = (Movement *)list_data(e);
+				save_put_i32(w, m->objectId);
+				save_put_i32(w, m->speed);
+				save_put_i32(w, m->frequency);
+				save_put_i32(w, m->ticksUntilNextMove);
+				save_put_i32(w, m->destination.x);
+				save_put_i32(w, m->destination.y);
+				save_put_u8(w, m->hasDestination);
+				save_put_u8(w, m->chasingPlayer);
+				save_put_i32(w, m->turnsSincePlayerSeen);
+			}
+			break;
+
+			case COMP_HEALTH: {
+				Health *h = (Health *)list_data(e);
+				save_put_i32(w, h->objectId);
+				save_put_i32(w, h->currentHP);
+				save_put_i32(w, h->maxHP);
+				save_put_i32(w, h->recoveryRate);
+				save_put_i32(w, h->ticksUntilRemoval);
+			}
+			break;
+
+			case COMP_COMBAT: {
+				Combat *c = (Combat *)list_data(e);
+				save_put_i32(w, c->objectId);
+				save_put_i32(w, c->toHit);
+				save_put_i32(w, c->toHitModifier);
+				save_put_i32(w, c->attack);
+				save_put_i32(w, c->attackModifier);
+				save_put_i32(w, c->defense);
+				save_put_i32(w, c->defenseModifier);
+			}
+			break;
+
+			case COMP_EQUIPMENT: {
+				Equipment *eq = (Equipment *)list_data(e);
+				save_put_i32(w, eq->objectId);
+				save_put_i32(w, eq->quantity);
+				save_put_i32(w, eq->weight);
+				save_put_i32(w, eq->lifetime);
+				save_put_string(w, eq->slot);
+				save_put_u8(w, eq->isEquipped);
+			}
+			break;
+
+			case COMP_TREASURE: {
+				Treasure *t = (Treasure *)list_data(e);
+				save_put_i32(w, t->objectId);
+				save_put_i32(w, t->value);
+			}
+			break;
+
+			case COMP_ANIMATION: {
+				Animation *a = (Animation *)list_data(e);
+				i32 animation = 0;
+				for (i32 i = 0; i < SAVE_ANIMATION_COUNT; i++) {
+					if (saveAnimations[i] == a->keyframeAnimation) { animation = i; }
+				}
+				save_put_i32(w, a->objectId);
+				save_put_i32(w, a->keyFrameInterval);
+				save_put_i32(w, a->ticksUntilKeyframe);
+				save_put_u8(w, a->finished);
+				save_put_i32(w, animation);
+				save_put_u32(w, a->value1);
+			}
+			break;
+		}
+	}
+}
+
+internal bool
+save_frame_write(SaveJob *job) {
+	// A full frame replaces the save (through a temporary file, so a crash part
+	// way through leaves the old one as it was). Anything else is added on the end.
+	SaveFrameHeader *header = (SaveFrameHeader *)job->frame;
+	header->checksum = content_checksum(job->frame + sizeof(SaveFrameHeader), job->frameSize - sizeof(SaveFrameHeader));
+
+	char *tempFilename = NULL;
+	FILE *file = NULL;
+	if (header->full) {
+		tempFilename = String_Create("%s.tmp", job->filename);
+		file = fopen(tempFilename, "wb");
+	} else {
+		// (If the save has gone, the next frame will be a full one)
+		file = fopen(job->filename, "r+b");
+		if (file != NULL) { fseek(file, 0, SEEK_END); }
+	}
+
+	bool written = false;
+	if (file != NULL) {
+		written = (fwrite(job->frame, job->frameSize, 1, file) == 1) && (fflush(file) == 0);
+#ifdef _WIN32
+		written = written && (_commit(_fileno(file)) == 0);
+#else
+		written = written && (fsync(fileno(file)) == 0);
+#endif
+		written = (fclose(file) == 0) && written;
+	}
+
+	if (tempFilename != NULL) {
+		if (written && (rename(tempFilename, job->filename) != 0)) {
+			// (Windows won't rename over an existing file)
+			remove(job->filename);
+			written = (rename(tempFilename, job->filename) == 0);
+		}
+		if (!written) { remove(tempFilename); }
+		String_Destroy(tempFilename);
+	}
+	return written;
+}
+
+internal int
+save_writer_run(void *data) {
+	(void)data;
+	profile_thread_begin("SaveWriter");
+	SDL_LockMutex(saveLock);
+	while (true) {
+		while ((saveJobsHead == NULL) && !saveStopping) {
+			SDL_CondWait(saveWake, saveLock);
+		}
+		if (saveJobsHead == NULL) {
+			break;
+		}
+
+		SaveJob *job = saveJobsHead;
+		saveJobsHead = job->next;
+		if (saveJobsHead == NULL) { saveJobsTail = NULL; }
+		saveWriting = true;
+		SDL_UnlockMutex(saveLock);
+
+		ProfileMark mark = profile_begin(PROFILE_SAVE_WRITE);
+		if (!save_frame_write(job)) {
+			SDL_AtomicSet(&saveFailed, 1);
+		}
+		profile_end(mark);
+		mem_free(job->filename);
+		mem_free(job->frame);
+		mem_free(job);
+
+		SDL_LockMutex(saveLock);
+		saveWriting = false;
+		SDL_CondBroadcast(saveIdle);
+	}
+	SDL_UnlockMutex(saveLock);
+	profile_thread_end();
+	return 0;
+}
+
+internal void
+save_frame_queue(char *filename, u8 *frame, u32 frameSize) {
+	SaveJob *job = mem_calloc(MEM_SAVE, 1, sizeof(SaveJob));
+	job->filename = String_Create("%s", filename);
+	job->frame = frame;
+	job->frameSize = frameSize;
+
+	if (saveLock == NULL) {
+		saveLock = SDL_CreateMutex();
+		saveWake = SDL_CreateCond();
+		saveIdle = SDL_CreateCond();
+		saveStopping = false;
+		saveThread = SDL_CreateThread(save_writer_run, "SaveWriter", NULL);
+	}
+	if (saveThread == NULL) {
+		// No thread, so just write it now
+		if (!save_frame_write(job)) {
+			SDL_AtomicSet(&saveFailed, 1);
+		}
+		mem_free(job->filename);
+		mem_free(job->frame);
+		mem_free(job);
+		return;
+	}
+
+	SDL_LockMutex(saveLock);
+	if (saveJobsTail != NULL) {
+		saveJobsTail->next = job;
+	} else {
+		saveJobsHead = job;
+	}
+	saveJobsTail = job;
+	SDL_CondSignal(saveWake);
+	SDL_UnlockMutex(saveLock);
+}
+
+void save_flush() {
+	// Wait for everything that's been saved to be written out
+	if (saveThread == NULL) {
+		return;
+	}
+	SDL_LockMutex(saveLock);
+	while ((saveJobsHead != NULL) || saveWriting) {
+		SDL_CondWait(saveIdle, saveLock);
+	}
+	SDL_UnlockMutex(saveLock);
+}
+
+void save_shutdown() {
+	if (saveThread != NULL) {
+		SDL_LockMutex(saveLock);
+		saveStopping = true;
+		SDL_CondSignal(saveWake);
+		SDL_UnlockMutex(saveLock);
+		SDL_WaitThread(saveThread, NULL);
+		saveThread = NULL;
+	}
+	if (saveLock != NULL) {
+		SDL_DestroyCond(saveWake);
+		SDL_DestroyCond(saveIdle);
+		SDL_DestroyMutex(saveLock);
+		saveLock = NULL;
+	}
+	mem_free(savedSectionHashes);
+	savedSectionHashes = NULL;
+	mem_free(savedFilename);
+	savedFilename = NULL;
+}
+
+internal void
+save_world_write(SaveWriter *w) {
+	// Write each section of the world state
+
+	// The run, and the level - chunks that haven't been generated yet will be
+	// generated from the level's seeds as usual
+	save_section_begin(w, SAVE_SECTION_RUN);
+	save_put_u64(w, runSeed);
+	save_put_rng(w, &aiRng);
+	save_put_rng(w, &combatRng);
+	save_put_i32(w, currentLevelNumber);
+	save_put_i32(w, gemsFoundThisLevel);
+	save_put_i32(w, gemsFoundTotal);
+	save_put_i32(w, maxWeightAllowed);
+	save_put_i32(w, turnsTaken);
+	save_put_string(w, playerName);
+	save_put_i32(w, player->id);
+
+	DungeonLevel *level = currentLevel;
+	save_put_i32(w, level->level);
+	save_put_i32(w, level->width);
+	save_put_i32(w, level->height);
+	save_put_u8(w, level->generateLazily);
+	save_put_u64(w, level->mapSeed);
+	save_put_u64(w, level->spawnSeed);
+	save_put_i32(w, level->stairsChunk);
+	for (i32 i = 0; i < GEMS_PER_LEVEL; i++) {
+		save_put_i32(w, level->gemChunks[i]);
+	}
+	save_put_i32(w, level->map.generator);
+	save_put_i32(w, level->map.fillPercent);
+	save_put_i32(w, level->map.minSize);
+	save_put_i32(w, level->map.maxSize);
+	save_section_end(w);
+
+	// The map, a chunk at a time (there's no need when hashing, since the
+	// map's hash is kept up to date as it changes). Between full saves, only 
+	// the chunks that have changed since they were last saved are looked at.
+	local_persist u8 packed[CHUNK_CELLS * 2];
+	for (i32 i = 0; (i < chunksWide * chunksHigh) && (w->hashes == NULL); i++) {
+		Chunk *chunk = chunks[i];
+		if ((chunk == NULL) || (!w->full && !chunk->dirty)) { continue; }
+		chunk->dirty = false;
+		save_section_begin(w, SAVE_SECTION_CHUNKS + i);
+		if (chunk->state == CHUNK_COLD) {
+			save_put_u32(w, chunk->packedSize);
+			save_put_data(w, chunk->packed, chunk->packedSize);
+		} else {
+			// What's visible is worked out again after loading
+			u32 size = chunk_cells_pack(chunk->cells, FOV_VISIBLE, packed);
+			save_put_u32(w, size);
+			save_put_data(w, packed, size);
+		}
+		save_section_end(w);
+	}
+
+	// Game objects, and each type of component (when hashing, the objects in
+	// use and the objects in each cell are kept track of as they change instead)
+	if (w->hashes == NULL) {
+		save_section_begin(w, SAVE_SECTION_OBJECTS);
+		u32 objectCount = 0;
+		for (i32 i = 0; i < MAX_GO; i++) {
+			if (gameObjects[i].id != UNUSED) { objectCount += 1; }
+		}
+		save_put_u32(w, objectCount);
+		for (i32 i = 0; i < MAX_GO; i++) {
+			if (gameObjects[i].id != UNUSED) { save_put_i32(w, i); }
+		}
+		save_section_end(w);
+	}
+
+	for (i32 comp = 0; comp < COMPONENT_COUNT; comp++) {
+		save_section_begin(w, SAVE_SECTION_COMPONENTS + comp);
+		save_write_components(w, comp);
+		save_section_end(w);
+	}
+
+	// The objects in each cell, in order, since the most recent arrival on a
+	// layer is the one that's drawn
+	if (w->hashes == NULL) {
+		save_section_begin(w, SAVE_SECTION_CELLS);
+		u32 cellCount = 0;
+		for (i32 i = 0; i < CELL_OBJECTS_CAPACITY; i++) {
+			if (cellObjects[i].cell != UNUSED) { cellCount += 1; }
+		}
+		save_put_u32(w, cellCount);
+		for (i32 i = 0; i < CELL_OBJECTS_CAPACITY; i++) {
+			if (cellObjects[i].cell == UNUSED) { continue; }
+			save_put_i32(w, cellObjects[i].cell);
+			save_put_u32(w, list_size(cellObjects[i].objects));
+			for (ListElement *e = list_head(cellObjects[i].objects); e != NULL; e = list_next(e)) {
+				save_put_i32(w, ((GameObject *)list_data(e))->id);
+			}
+		}
+		save_section_end(w);
+	}
+
+	// What the player's carrying, and the message log
+	save_section_begin(w, SAVE_SECTION_CARRIED);
+	save_put_u32(w, list_size(carriedItems));
+	for (ListElement *e = list_head(carriedItems); e != NULL; e = list_next(e)) {
+		save_put_i32(w, ((GameObject *)list_data(e))->id);
+	}
+	// (The log's left out of the world's hash - runs played back headless
+	// don't bother putting what happened into words)
+	u32 messageCount = (w->hashes == NULL) ? message_log_size() : 0;
+	if (messageCount > SAVE_MESSAGES) { messageCount = SAVE_MESSAGES; }
+	save_put_u32(w, messageCount);
+	for (i32 age = messageCount - 1; age >= 0; age--) {
+		Message *m = message_log_get(age);
+		save_put_string(w, message_text(m));
+		save_put_u32(w, m->fgColor);
+		save_put_u32(w, m->repeats);
+	}
+	save_section_end(w);
+}
+
+internal void
+save_forget() {
+	// The next save will be a full one
+	mem_free(savedSectionHashes);
+	savedSectionHashes = NULL;
+	savedSectionCount = 0;
+}
+
+void save_snapshot(char *filename) {
+	// Serialize whatever's changed since the last save, and hand it over to
+	// be written out in the background
+	if ((currentLevel == NULL) || (player == NULL)) {
+		return;
+	}
+
+	// Start over with a full save every so often (or when the last one went
+	// wrong, or there's a new level to save)
+	bool lastFailed = SDL_AtomicSet(&saveFailed, 0);
+	bool full = (savedSectionHashes == NULL) || (savedFrames >= SAVE_COMPACT_FRAMES) || lastFailed ||
+				(savedLevel != currentLevel->level) || (savedMapSeed != currentLevel->mapSeed) ||
+				(savedFilename == NULL) || (strcmp(savedFilename, filename) != 0);
+	if (full) {
+		save_forget();
+		savedSectionCount = SAVE_SECTION_CHUNKS + (chunksWide * chunksHigh);
+		savedSectionHashes = mem_calloc(MEM_SAVE, savedSectionCount, sizeof(u64));
+		savedFrames = 0;
+		savedLevel = currentLevel->level;
+		savedMapSeed = currentLevel->mapSeed;
+		mem_free(savedFilename);
+		savedFilename = String_Create("%s", filename);
+	} else {
+		savedFrames += 1;
+	}
+
+	SaveWriter w = {.full = full};
+	save_world_write(&w);
+
+	// Put the frame together - header, strings, then sections
+	u32 bodyBytes = w.body.size;
+	if (!full && (bodyBytes == 0)) {
+		// Nothing's changed
+		savedFrames -= 1;
+	} else {
+		SaveFrameHeader header = {
+			.magic = SAVE_MAGIC,
+			.version = SAVE_VERSION,
+			.full = full,
+			.stringCount = w.stringCount,
+			.stringBytes = w.strings.size,
+			.bodyBytes = bodyBytes
+		};
+		u32 frameSize = sizeof(SaveFrameHeader) + w.strings.size + bodyBytes;
+		u8 *frame = mem_malloc(MEM_SAVE, frameSize);
+		memcpy(frame, &header, sizeof(header));
+		if (w.strings.size > 0) {
+			memcpy(frame + sizeof(header), w.strings.data, w.strings.size);
+		}
+		memcpy(frame + sizeof(header) + w.strings.size, w.body.data, bodyBytes);
+		save_frame_queue(filename, frame, frameSize);
+	}
+
+	mem_free(w.body.data);
+	mem_free(w.strings.data);
+	mem_free(w.stringOffsets);
+	mem_free(w.stringTable);
+}
+
+void save_section_hashes(u64 *hashes) {
+	// Hash each section of the world state (bar the chunks, objects and
+	// cells, which are hashed as they change), to check that two runs are in
+	// the same state
+	SaveWriter w = {.hashes = hashes};
+	save_world_write(&w);
+	mem_free(w.body.data);
+}
+
+bool save_game(char *filename) {
+	// Save, and wait for it to be written
+	save_snapshot(filename);
+	save_flush();
+	return (savedFilename != NULL) && (SDL_AtomicGet(&saveFailed) == 0);
+}
+
+void save_checkpoint() {
+	// Called after each turn
+	ProfileMark mark = profile_begin(PROFILE_SAVE_SNAPSHOT);
+	save_snapshot(SAVE_FILE);
+	profile_end(mark);
+}
+
+bool save_exists() {
+	FILE *file = fopen(SAVE_FILE, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	fclose(file);
+	return true;
+}
+
+void save_delete() {
+	save_flush();
+	save_forget();
+	remove(SAVE_FILE);
+}
+
+
+/* Reading */
+
+internal void
+save_get(SaveReader *r, void *data, u32 size) {
+	if (r->failed || (size > r->size - r->pos)) {
+		r->failed = true;
+		memset(data, 0, size);
+		return;
+	}
+	memcpy(data, r->data + r->pos, size);
+	r->pos += size;
+}
+
+internal u8 save_get_u8(SaveReader *r) { u8 value; save_get(r, &value, sizeof(value)); return value; }
+internal i32 save_get_i32(SaveReader *r) { i32 value; save_get(r, &value, sizeof(value)); return value; }
+internal u32 save_get_u32(SaveReader *r) { u32 value; save_get(r, &value, sizeof(value)); return value; }
+internal u64 save_get_u64(SaveReader *r) { u64 value; save_get(r, &value, sizeof(value)); return value; }
+
+internal char *
+save_get_string(SaveReader *r) {
+	// Returns a copy of the string, for the caller to keep
+	u32 index = save_get_u32(r);
+	if (index == SAVE_NO_STRING) { return NULL; }
+	if (index >= r->stringCount) {
+		r->failed = true;
+		return NULL;
+	}
+	char *s = mem_calloc(MEM_STRINGS, strlen(r->strings[index]) + 1, sizeof(char));
+	strcpy(s, r->strings[index]);
+	return s;
+}
+
+internal void
+save_get_rng(SaveReader *r, RNG *rng) {
+	for (i32 i = 0; i < 4; i++) {
+		rng->s[i] = save_get_u64(r);
+	}
+}
+
+internal GameObject *
+save_get_object(SaveReader *r) {
+	// Reads an object id, which has to be for an object in the save
+	i32 id = save_get_i32(r);
+	if ((id < 0) || (id >= MAX_GO) || (gameObjects[id].id == UNUSED)) {
+		r->failed = true;
+		return NULL;
+	}
+	return &gameObjects[id];
+}
+
+
+internal void
+save_read_components(SaveReader *r, i32 comp) {
+	// Components go straight into their list, in the saved order
+	List *comps = *saveComponentLists[comp];
+	u32 count = save_get_u32(r);
+	for (u32 i = 0; (i < count) && !r->failed; i++) {
+		GameObject *obj = save_get_object(r);
+		if ((obj == NULL) || (obj->components[comp] != NULL)) {
+			r->failed = true;
+			break;
+		}
+
+		void *data = NULL;
+		switch (comp) {
+			case COMP_POSITION: {
+				Position *p = mem_calloc(MEM_ECS, 1, sizeof(Position));
+				p->x = save_get_i32(r);
+				p->y = save_get_i32(r);
+				p->layer = save_get_u8(r);
+				if (!map_in_bounds(p->x, p->y)) { r->failed = true; }
+				data = p;
+			}
+			break;
+
+			case COMP_VISIBILITY: {
+				Visibility *v = mem_calloc(MEM_ECS, 1, sizeof(Visibility));
+				v->glyph = save_get_u8(r);
+				v->fgColor = save_get_u32(r);
+				v->bgColor = save_get_u32(r);
+				v->hasBeenSeen = save_get_u8(r);
+				v->visibleOutsideFOV = save_get_u8(r);
+				v->name = save_get_string(r);
+				data = v;
+			}
+			break;
+
+			case COMP_PHYSICAL: {
+				Physical *p = mem_calloc(MEM_ECS, 1, sizeof(Physical));
+				p->blocksMovement = save_get_u8(r);
+				p->blocksSight = save_get_u8(r);
+				data = p;
+			}
+			break;
+
+			case COMP_MOVEMENT: {
+				Movement *m = mem_calloc(MEM_ECS, 1, sizeof(Movement));
+				m->speed = save_get_i32(r);
+				m->frequency = save_get_i32(r);
+				m->ticksUntilNextMove = save_get_i32(r);
+				m->destination.x = save_get_i32(r);
+				m->destination.y = save_get_i32(r);
+				m->hasDestination = save_get_u8(r);
+				m->chasingPlayer = save_get_u8(r);
+				m->turnsSincePlayerSeen = save_get_i32(r);
+				data = m;
+			}
+			break;
+
+			case COMP_HEALTH: {
+				Health *h = mem_calloc(MEM_ECS, 1, sizeof(Health));
+				h->currentHP = save_get_i32(r);
+				h->maxHP = save_get_i32(r);
+				h->recoveryRate = save_get_i32(r);
+				h->ticksUntilRemoval = save_get_i32(r);
+				data = h;
+			}
+			break;
+
+			case COMP_COMBAT: {
+				Combat *c = mem_calloc(MEM_ECS, 1, sizeof(Combat));
+				c->toHit = save_get_i32(r);
+				c->toHitModifier = save_get_i32(r);
+				c->attack = save_get_i32(r);
+				c->attackModifier = save_get_i32(r);
+				c->defense = save_get_i32(r);
+				c->defenseModifier = save_get_i32(r);
+				data = c;
+			}
+			break;
+
+			case COMP_EQUIPMENT: {
+				Equipment *eq = mem_calloc(MEM_ECS, 1, sizeof(Equipment));
+				eq->quantity = save_get_i32(r);
+				eq->weight = save_get_i32(r);
+				eq->lifetime = save_get_i32(r);
+				eq->slot = save_get_string(r);
+				eq->isEquipped = save_get_u8(r);
+				data = eq;
+			}
+			break;
+
+			case COMP_TREASURE: {
+				Treasure *t = mem_calloc(MEM_ECS, 1, sizeof(Treasure));
+				t->value = save_get_i32(r);
+				data = t;
+			}
+			break;
+
+			case COMP_ANIMATION: {
+				Animation *a = mem_calloc(MEM_ECS, 1, sizeof(Animation));
+				a->keyFrameInterval = save_get_i32(r);
+				a->ticksUntilKeyframe = save_get_i32(r);
+				a->finished = save_get_u8(r);
+				i32 animation = save_get_i32(r);
+				if ((animation < 0) || (animation >= SAVE_ANIMATION_COUNT)) {
+					r->failed = true;
+					animation = 0;
+				}
+				a->keyframeAnimation = saveAnimations[animation];
+				a->value1 = save_get_u32(r);
+				data = a;
+			}
+			break;
+		}
+
+		// Every component starts with the id of its object
+		*(i32 *)data = obj->id;
+		list_insert_after(comps, list_tail(comps), data);
+		obj->components[comp] = data;
+	}
+}
+
+internal bool
+save_section_open(SaveReader *sections, u32 sectionCount, u32 section, SaveReader *r) {
+	// Start reading the latest copy of a section. Returns false if there isn't one.
+	if ((section >= sectionCount) || (sections[section].data == NULL)) {
+		return false;
+	}
+	*r = sections[section];
+	return true;
+}
+
+internal bool
+save_section_close(SaveReader *r) {
+	// A section has to be read exactly to the end
+	return !r->failed && (r->pos == r->size);
+}
+
+internal bool
+save_read(SaveReader *sections, u32 sectionCount) {
+	// Rebuild the world state from the latest copy of each section. Returns
+	// false if the save doesn't make sense, in which case the world state is
+	// left half built.
+	world_state_init();
+
+	// The run, and the level
+	SaveReader r;
+	if (!save_section_open(sections, sectionCount, SAVE_SECTION_RUN, &r)) {
+		return false;
+	}
+	runSeed = save_get_u64(&r);
+	save_get_rng(&r, &aiRng);
+	save_get_rng(&r, &combatRng);
+	currentLevelNumber = save_get_i32(&r);
+	gemsFoundThisLevel = save_get_i32(&r);
+	gemsFoundTotal = save_get_i32(&r);
+	maxWeightAllowed = save_get_i32(&r);
+	turnsTaken = save_get_i32(&r);
+	mem_free(playerName);
+	playerName = save_get_string(&r);
+	i32 playerId = save_get_i32(&r);
+
+	DungeonLevel *level = mem_calloc(MEM_MAPGEN, 1, sizeof(DungeonLevel));
+	level->level = save_get_i32(&r);
+	level->width = save_get_i32(&r);
+	level->height = save_get_i32(&r);
+	level->generateLazily = save_get_u8(&r);
+	level->mapSeed = save_get_u64(&r);
+	level->spawnSeed = save_get_u64(&r);
+	level->stairsChunk = save_get_i32(&r);
+	for (i32 i = 0; i < GEMS_PER_LEVEL; i++) {
+		level->gemChunks[i] = save_get_i32(&r);
+	}
+	level->map.generator = save_get_i32(&r);
+	level->map.fillPercent = save_get_i32(&r);
+	level->map.minSize = save_get_i32(&r);
+	level->map.maxSize = save_get_i32(&r);
+	if (!save_section_close(&r) || (level->level != currentLevelNumber) || (level->level < 1) || (level->level > MAX_DUNGEON_LEVEL) ||
+		(level->width < MAP_MIN_WIDTH) || (level->height < MAP_MIN_HEIGHT) ||
+		(level->width > MAP_MAX_WIDTH) || (level->height > MAP_MAX_HEIGHT) ||
+		(level->map.generator < 0) || (level->map.generator >= MAP_GEN_COUNT)) {
+		level_free(level);
+		return false;
+	}
+	map_storage_init(level->width, level->height);
+	level_free(currentLevel);
+	currentLevel = level;
+
+	// The map - chunks start out packed, and the ones near the player are unpacked after
+	for (i32 i = 0; i < chunksWide * chunksHigh; i++) {
+		if (!save_section_open(sections, sectionCount, SAVE_SECTION_CHUNKS + i, &r)) { continue; }
+		u32 packedSize = save_get_u32(&r);
+		if (packedSize > CHUNK_CELLS * 2) {
+			return false;
+		}
+		Chunk *chunk = mem_calloc(MEM_MAPGEN, 1, sizeof(Chunk));
+		chunk->state = CHUNK_COLD;
+		chunk->packed = mem_malloc(MEM_MAPGEN, packedSize + 1);
+		chunk->packedSize = packedSize;
+		save_get(&r, chunk->packed, packedSize);
+		chunks[i] = chunk;
+		if (!save_section_close(&r) || !chunk_packed_valid(chunk->packed, packedSize)) {
+			return false;
+		}
+		map_hash_add_packed(i, chunk->packed, packedSize);
+	}
+
+	// Game objects, and each type of component
+	if (!save_section_open(sections, sectionCount, SAVE_SECTION_OBJECTS, &r)) {
+		return false;
+	}
+	u32 objectCount = save_get_u32(&r);
+	for (u32 i = 0; (i < objectCount) && !r.failed; i++) {
+		i32 id = save_get_i32(&r);
+		if ((id < 0) || (id >= MAX_GO) || (gameObjects[id].id != UNUSED)) {
+			return false;
+		}
+		gameObjects[id].id = id;
+		gameObjectsHash += rng_derive_seed(id, 0);
+		for (i32 comp = 0; comp < COMPONENT_COUNT; comp++) {
+			gameObjects[id].components[comp] = NULL;
+		}
+	}
+	if (!save_section_close(&r)) {
+		return false;
+	}
+
+	for (i32 comp = 0; comp < COMPONENT_COUNT; comp++) {
+		if (!save_section_open(sections, sectionCount, SAVE_SECTION_COMPONENTS + comp, &r)) {
+			return false;
+		}
+		save_read_components(&r, comp);
+		if (!save_section_close(&r)) {
+			return false;
+		}
+	}
+
+	// The objects in each cell
+	if (!save_section_open(sections, sectionCount, SAVE_SECTION_CELLS, &r)) {
+		return false;
+	}
+	u32 cellCount = save_get_u32(&r);
+	for (u32 i = 0; (i < cellCount) && !r.failed; i++) {
+		i32 cell = save_get_i32(&r);
+		if ((cell < 0) || (cell >= mapWidth * mapHeight)) {
+			return false;
+		}
+		List *objects = cell_objects_find(cell % mapWidth, cell / mapWidth, true);
+		u32 count = save_get_u32(&r);
+		for (u32 o = 0; (o < count) && !r.failed; o++) {
+			GameObject *obj = save_get_object(&r);
+			if (obj != NULL) {
+				list_insert_after(objects, list_tail(objects), obj);
+			}
+		}
+		if (list_size(objects) > 0) { cellObjectsHash += cell_objects_hash(cell, objects); }
+	}
+	if (!save_section_close(&r)) {
+		return false;
+	}
+
+	// What the player's carrying, and the message log
+	if (!save_section_open(sections, sectionCount, SAVE_SECTION_CARRIED, &r)) {
+		return false;
+	}
+	u32 carriedCount = save_get_u32(&r);
+	for (u32 i = 0; (i < carriedCount) && !r.failed; i++) {
+		GameObject *obj = save_get_object(&r);
+		if (obj != NULL) {
+			list_insert_after(carriedItems, list_tail(carriedItems), obj);
+		}
+	}
+	u32 messageCount = save_get_u32(&r);
+	for (u32 i = 0; (i < messageCount) && !r.failed; i++) {
+		char *msg = save_get_string(&r);
+		u32 color = save_get_u32(&r);
+		u32 repeats = save_get_u32(&r);
+		message_log_put(msg, color, repeats);
+		mem_free(msg);
+	}
+	if (!save_section_close(&r)) {
+		return false;
+	}
+
+	if ((playerId < 0) || (playerId >= MAX_GO) || (gameObjects[playerId].id == UNUSED) ||
+		(gameObjects[playerId].components[COMP_POSITION] == NULL)) {
+		return false;
+	}
+	player = &gameObjects[playerId];
+	return true;
+}
+
+internal char *
+save_frame_check(u8 *frame, u32 size) {
+	// Returns what's wrong with the frame at the start of the data, if anything
+	// (frames aren't aligned, so the header is copied out)
+	SaveFrameHeader header;
+	if (size < sizeof(SaveFrameHeader)) {
+		return "cut short";
+	}
+	memcpy(&header, frame, sizeof(SaveFrameHeader));
+	if (header.magic != SAVE_MAGIC) {
+		return "not a save";
+	} else if (header.version != SAVE_VERSION) {
+		return "saved by a different version of the game";
+	} else if ((u64)header.stringBytes + header.bodyBytes > size - sizeof(SaveFrameHeader)) {
+		return "cut short";
+	} else if (content_checksum(frame + sizeof(SaveFrameHeader), header.stringBytes + header.bodyBytes) != header.checksum) {
+		return "checksum doesn't match";
+	} else if ((header.stringBytes > 0) && (frame[sizeof(SaveFrameHeader) + header.stringBytes - 1] != '\0')) {
+		return "string table isn't terminated";
+	}
+	return NULL;
+}
+
+bool load_game(char *filename) {
+	// Pick up a saved run where it left off. Returns false if there's no save,
+	// or it can't be used.
+	save_flush();
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	u8 *data = mem_malloc(MEM_SAVE, (size > 0) ? size : 1);
+	if (fread(data, 1, size, file) != (size_t)size) {
+		size = 0;
+	}
+	fclose(file);
+
+	// Play the frames back, keeping the latest copy of each section. A frame
+	// that's damaged (or cut short) ends the save, unless it's the first.
+	char *problem = save_frame_check(data, size);
+	SaveReader *sections = NULL;
+	u32 sectionCount = 0;
+	List *frameStrings = list_new(mem_free);
+	u32 pos = 0;
+	while ((problem == NULL) && (pos < size)) {
+		u8 *frame = data + pos;
+		char *frameProblem = save_frame_check(frame, size - pos);
+		if (frameProblem != NULL) {
+			fprintf(stderr, "%s: ignoring the end of the save (%s)\n", filename, frameProblem);
+			break;
+		}
+		SaveFrameHeader header;
+		memcpy(&header, frame, sizeof(SaveFrameHeader));
+		if ((pos > 0) && header.full) {
+			problem = "full frame part way through";
+			break;
+		}
+
+		// Find where each of the frame's strings starts
+		u8 *strings = frame + sizeof(SaveFrameHeader);
+		char **stringStarts = mem_calloc(MEM_SAVE, header.stringCount + 1, sizeof(char *));
+		list_insert_after(frameStrings, NULL, stringStarts);
+		u32 offset = 0;
+		for (u32 i = 0; (i < header.stringCount) && (problem == NULL); i++) {
+			if (offset >= header.stringBytes) {
+				problem = "missing strings";
+			} else {
+				stringStarts[i] = (char *)strings + offset;
+				offset += strlen(stringStarts[i]) + 1;
+			}
+		}
+
+		// Each section replaces any earlier copy of it
+		u8 *body = strings + header.stringBytes;
+		u32 bodyPos = 0;
+		while ((problem == NULL) && (bodyPos < header.bodyBytes)) {
+			u32 sectionHeader[2];
+			if (header.bodyBytes - bodyPos < sizeof(sectionHeader)) {
+				problem = "damaged section";
+				break;
+			}
+			memcpy(sectionHeader, body + bodyPos, sizeof(sectionHeader));
+			bodyPos += sizeof(sectionHeader);
+			// (There can't be more sections than there are bytes in the save)
+			if ((sectionHeader[1] > header.bodyBytes - bodyPos) || (sectionHeader[0] >= (u32)(SAVE_SECTION_CHUNKS + size))) {
+				problem = "damaged section";
+				break;
+			}
+			if (sectionHeader[0] >= sectionCount) {
+				u32 newCount = sectionHeader[0] + 1;
+				sections = mem_realloc(MEM_SAVE, sections, newCount * sizeof(SaveReader));
+				memset(sections + sectionCount, 0, (newCount - sectionCount) * sizeof(SaveReader));
+				sectionCount = newCount;
+			}
+			sections[sectionHeader[0]] = (SaveReader) {
+				.data = body + bodyPos,
+				.size = sectionHeader[1],
+				.strings = stringStarts,
+				.stringCount = header.stringCount
+			};
+			bodyPos += sectionHeader[1];
+		}
+		pos += sizeof(SaveFrameHeader) + header.stringBytes + header.bodyBytes;
+	}
+
+	if (problem == NULL) {
+		level_pregen_cancel();
+		if (!save_read(sections, sectionCount)) {
+			problem = "damaged";
+			world_state_init();
+		}
+	}
+	mem_free(sections);
+	list_destroy(frameStrings);
+	mem_free(data);
+	if (problem != NULL) {
+		fprintf(stderr, "%s: %s\n", filename, problem);
+		return false;
+	}
+
+	// The next save starts the file over
+	save_forget();
+
+	// Work out everything that isn't saved, and carry on generating the next level
+	Position *playerPos = (Position *)game_object_get_component(player, COMP_POSITION);
+	map_chunks_update(playerPos->x, playerPos->y);
+	fov_calculate(playerPos->x, playerPos->y);
+	generate_target_map(playerPos->x, playerPos->y);
+	if (currentLevelNumber < MAX_DUNGEON_LEVEL) {
+		level_pregen_start(currentLevelNumber + 1);
+	}
+	return true;
+}
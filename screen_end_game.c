@@ -14,6 +14,9 @@
 #define INFO_HEIGHT	35
 
 
+global_variable UIScreen *endGameScreen = NULL;
+
+
 internal void render_endgame_bg_view(Console *console);
 internal void render_info_view(Console *console);
 internal void handle_event_endgame(UIScreen *activeScreen, SDL_Event event);
@@ -24,30 +27,30 @@ internal void handle_event_endgame(UIScreen *activeScreen, SDL_Event event);
 internal UIScreen * 
 screen_show_endgame() 
 {
-	List *subViews = list_new(NULL);
-
-	UIRect infoRect = {(16 * INFO_LEFT), (16 * INFO_TOP), (16 * INFO_WIDTH), (16 * INFO_HEIGHT)};
-	UIView *infoView = view_new(infoRect, INFO_WIDTH, INFO_HEIGHT,
-								 "./terminal16x16.png", 0, 0x000000ff, 
-								 true, render_info_view);
-	list_insert_after(subViews, NULL, infoView);
-
-	UIRect bgRect = {0, 0, (16 * BG_WIDTH), (16 * BG_HEIGHT)};
-	UIView *bgView = view_new(bgRect, BG_WIDTH, BG_HEIGHT, 
-							   "./terminal16x16.png", 0, 0x000000ff,
-							   true, render_endgame_bg_view);
-	list_insert_after(subViews, NULL, bgView);
-
-	UIScreen *endScreen = calloc(1, sizeof(UIScreen));
-	endScreen->views = subViews;
-	endScreen->activeView = infoView;
-	endScreen->handle_event = handle_event_endgame;
+	// Build the screen the first time it's shown, and reuse it after that
+	if (endGameScreen == NULL) {
+		List *subViews = list_new(NULL);
+
+		UIRect infoRect = {(16 * INFO_LEFT), (16 * INFO_TOP), (16 * INFO_WIDTH), (16 * INFO_HEIGHT)};
+		UIView *infoView = view_new(infoRect, INFO_WIDTH, INFO_HEIGHT,
+									 "./terminal16x16.png", 0, 0x000000ff, 
+									 true, render_info_view, "end_game_info");
+		list_insert_after(subViews, NULL, infoView);
+
+		UIRect bgRect = {0, 0, (16 * BG_WIDTH), (16 * BG_HEIGHT)};
+		UIView *bgView = view_new(bgRect, BG_WIDTH, BG_HEIGHT, 
+								   "./terminal16x16.png", 0, 0x000000ff,
+								   true, render_endgame_bg_view, "end_game_bg");
+		list_insert_after(subViews, NULL, bgView);
+
+		endGameScreen = screen_new(subViews, infoView, handle_event_endgame);
+	}
 
 	if (hofConfig == NULL) {
 		hofConfig = config_file_parse("hof.cfg");
 	}
 
-	return endScreen;
+	return endGameScreen;
 }
 
 
@@ -56,18 +59,12 @@ screen_show_endgame()
 internal void 
 render_endgame_bg_view(Console *console)  
 {
-	// We should load and process the bg image only once, not on each render
-	local_persist BitmapImage *bgImage = NULL;
-	local_persist AsciiImage *aiImage = NULL;
-	if (bgImage == NULL) {
-		bgImage = image_load_from_file("./gameover.png");
-		aiImage = asciify_bitmap(console, bgImage);	
-	}
-
+	// The bg image is loaded and processed only once, not on each render
+	CachedImage *bgImage = image_acquire(console, "./gameover.png");
 	if (asciiMode) {
-		view_draw_ascii_image_at(console, aiImage, 0, 0);
+		view_draw_ascii_image_at(console, bgImage->ascii, 0, 0);
 	} else {
-		view_draw_image_at(console, bgImage, 0, 0);	
+		view_draw_image_at(console, bgImage->bitmap, 0, 0);	
 	}
 }
 
@@ -79,13 +76,11 @@ render_info_view(Console *console)
 
 	console_put_string_at(console, playerName, 18, 2, 0xffffffff, 0x00000000);
 
-	char *level = String_Create("Level:%d", currentLevelNumber);
+	char *level = String_Frame("Level:%d", currentLevelNumber);
 	console_put_string_at(console, level, 18, 4, 0xffd700ff, 0x00000000);
-	String_Destroy(level);
 
-	char *gems = String_Create("Gems:%d", gemsFoundTotal);
+	char *gems = String_Frame("Gems:%d", gemsFoundTotal);
 	console_put_string_at(console, gems, 28, 4, 0x753aabff, 0x00000000);
-	String_Destroy(gems);
 
 	// Leaderboard
 	console_put_string_at(console, "-== HERO HALL OF FAME ==-", 14, 7, 0xaa0000ff, 0x00000000);
@@ -100,9 +95,9 @@ render_info_view(Console *console)
 		char *gems = config_entity_value(entity, "gems");
 		char *date = config_entity_value(entity, "date");
 
-		char *nameString = String_Create("%20s", name);
+		char *nameString = String_Frame("%20s", name);
 		console_put_string_at(console, nameString, 3, y, 0xe2f442ff, 0x00000000);
-		char *recordString = String_Create("%10s Level:%s Gems:%s", date, level, gems);
+		char *recordString = String_Frame("%10s Level:%s Gems:%s", date, level, gems);
 		console_put_string_at(console, recordString, 23, y, 0xeeeeeeff, 0x00000000);
 
 		y += 2;
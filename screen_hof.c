@@ -9,6 +9,9 @@
 #define BG_HEIGHT	45
 
 
+global_variable UIScreen *hofScreen = NULL;
+
+
 internal void render_hof_bg_view(Console *console);
 internal void render_hof_view(Console *console);
 internal void handle_event_hof(UIScreen *activeScreen, SDL_Event event);
@@ -19,18 +22,18 @@ internal void handle_event_hof(UIScreen *activeScreen, SDL_Event event);
 internal UIScreen * 
 screen_show_hof() 
 {
-	List *views = list_new(NULL);
+	// Build the screen the first time it's shown, and reuse it after that
+	if (hofScreen == NULL) {
+		List *views = list_new(NULL);
 
-	UIRect bgRect = {0, 0, (16 * BG_WIDTH), (16 * BG_HEIGHT)};
-	UIView *bgView = view_new(bgRect, BG_WIDTH, BG_HEIGHT, 
-							   "./terminal16x16.png", 0, 0x000000ff, 
-							   true, render_hof_bg_view);
-	list_insert_after(views, NULL, bgView);
+		UIRect bgRect = {0, 0, (16 * BG_WIDTH), (16 * BG_HEIGHT)};
+		UIView *bgView = view_new(bgRect, BG_WIDTH, BG_HEIGHT, 
+								   "./terminal16x16.png", 0, 0x000000ff, 
+								   true, render_hof_bg_view, "hof_bg");
+		list_insert_after(views, NULL, bgView);
 
-	UIScreen *hofScreen = calloc(1, sizeof(UIScreen));
-	hofScreen->views = views;
-	hofScreen->activeView = bgView;
-	hofScreen->handle_event = handle_event_hof;
+		hofScreen = screen_new(views, bgView, handle_event_hof);
+	}
 
 	if (hofConfig == NULL) {
 		hofConfig = config_file_parse("hof.cfg");
@@ -56,13 +59,13 @@ render_hof_entries(Console *console) {
 		char *gems = config_entity_value(entity, "gems");
 		char *date = config_entity_value(entity, "date");
 
-		char *nameString = String_Create("%20s", name);
+		char *nameString = String_Frame("%20s", name);
 		console_put_string_at(console, nameString, 16, y, 0xe2f442ff, 0x00000000);
-		char *dateString = String_Create("%10s", date);
+		char *dateString = String_Frame("%10s", date);
 		console_put_string_at(console, dateString, 36, y, 0xeeeeeeff, 0x00000000);
-		char *levelString = String_Create("Level:%2s", level);
+		char *levelString = String_Frame("Level:%2s", level);
 		console_put_string_at(console, levelString, 47, y, 0xffd700ff, 0x00000000);
-		char *gemString = String_Create("Gems:%s", gems);
+		char *gemString = String_Frame("Gems:%s", gems);
 		console_put_string_at(console, gemString, 56, y, 0xdb99fcff, 0x00000000);
 
 		y += 2;
@@ -73,18 +76,12 @@ render_hof_entries(Console *console) {
 internal void 
 render_hof_bg_view(Console *console)  
 {
-	// We should load and process the bg image only once, not on each render
-	local_persist BitmapImage *bgImage = NULL;
-	local_persist AsciiImage *aiImage = NULL;
-	if (bgImage == NULL) {
-		bgImage = image_load_from_file("./launch.png");
-		aiImage = asciify_bitmap(console, bgImage);	
-	}
-
+	// The bg image is loaded and processed only once, not on each render
+	CachedImage *bgImage = image_acquire(console, "./launch.png");
 	if (asciiMode) {
-		view_draw_ascii_image_at(console, aiImage, 0, 0);
+		view_draw_ascii_image_at(console, bgImage->ascii, 0, 0);
 	} else {
-		view_draw_image_at(console, bgImage, 0, 0);	
+		view_draw_image_at(console, bgImage->bitmap, 0, 0);	
 	}
 
 	UIRect rect = {10, 5, 60, 34};
@@ -5,6 +5,10 @@
     Started: 1/30/2017
 */
 
+// How much of the map is on screen at once
+#define VIEWPORT_WIDTH		80
+#define VIEWPORT_HEIGHT		40
+
 #define STATS_WIDTH		20
 #define STATS_HEIGHT 	5
 
@@ -17,14 +21,20 @@
 #define INVENTORY_HEIGHT	30
 
 
+global_variable UIScreen *inGameScreen = NULL;
+global_variable UIView *mapView = NULL;
 global_variable UIView *inventoryView = NULL;
 global_variable i32 highlightedIdx = 0;
+global_variable i32 messageLogScroll = 0;		// How far back through the log we're looking
 
 
 internal void render_game_map_view(Console *console);
+internal i32 camera_offset(i32 target, i32 viewSize, i32 mapSize);
 internal void render_message_log_view(Console *console);
 internal void render_stats_view(Console *console);
+internal void render_inventory_view(Console *console);
 internal void handle_event_in_game(UIScreen *activeScreen, SDL_Event event);
+internal void hide_inventory_overlay();
 
 
 // Init / Show screen --
@@ -32,9 +42,7 @@ internal void handle_event_in_game(UIScreen *activeScreen, SDL_Event event);
 internal UIScreen * 
 screen_show_in_game() 
 {
-	List *igViews = list_new(NULL);
-
-	UIRect mapRect = {0, 0, (16 * MAP_WIDTH), (16 * MAP_HEIGHT)};
+	// Pick the map tileset based on the current display mode
 	char *tileset;
 	bool colorize = true;
 	u32 bgColor;
@@ -47,27 +55,48 @@ screen_show_in_game()
 		colorize = false;
 		bgColor = 0x00000000;
 	}
-	UIView *mapView = view_new(mapRect, MAP_WIDTH, MAP_HEIGHT, 
-							   tileset, 0, bgColor,
-							   colorize, render_game_map_view);
+
+	// If we've already built the screen, just switch the map over to the 
+	// right tileset (fonts are cached, so this never touches the disk).
+	if (inGameScreen != NULL) {
+		Console *con = mapView->console;
+		console_set_bitmap_font(con, tileset, 0, con->cellWidth, con->cellHeight);
+		con->colorize = colorize;
+		con->bgColor = bgColor;
+
+		hide_inventory_overlay();
+		return inGameScreen;
+	}
+
+	List *igViews = list_new(NULL);
+
+	UIRect mapRect = {0, 0, (16 * VIEWPORT_WIDTH), (16 * VIEWPORT_HEIGHT)};
+	mapView = view_new(mapRect, VIEWPORT_WIDTH, VIEWPORT_HEIGHT, 
+					   tileset, 0, bgColor,
+					   colorize, render_game_map_view, "map");
 	list_insert_after(igViews, NULL, mapView);
 
-	UIRect statsRect = {0, (16 * MAP_HEIGHT), (16 * STATS_WIDTH), (16 * STATS_HEIGHT)};
+	UIRect statsRect = {0, (16 * VIEWPORT_HEIGHT), (16 * STATS_WIDTH), (16 * STATS_HEIGHT)};
 	UIView *statsView = view_new(statsRect, STATS_WIDTH, STATS_HEIGHT,
 								 "./terminal16x16.png", 0, 0x000000ff,
-								 true, render_stats_view);
+								 true, render_stats_view, "stats");
 	list_insert_after(igViews, NULL, statsView);
 
-	UIRect logRect = {(16 * 20), (16 * MAP_HEIGHT), (16 * LOG_WIDTH), (16 * LOG_HEIGHT)};
+	UIRect logRect = {(16 * 20), (16 * VIEWPORT_HEIGHT), (16 * LOG_WIDTH), (16 * LOG_HEIGHT)};
 	UIView *logView = view_new(logRect, LOG_WIDTH, LOG_HEIGHT,
 							   "./terminal16x16.png", 0, 0x000000ff,
-							   true, render_message_log_view);
+							   true, render_message_log_view, "message_log");
 	list_insert_after(igViews, NULL, logView);
 
-	UIScreen *inGameScreen = calloc(1, sizeof(UIScreen));
-	inGameScreen->views = igViews;
-	inGameScreen->activeView = mapView;
-	inGameScreen->handle_event = handle_event_in_game;
+	// The inventory overlay is built up front too, and starts out hidden
+	UIRect overlayRect = {(16 * INVENTORY_LEFT), (16 * INVENTORY_TOP), (16 * INVENTORY_WIDTH), (16 * INVENTORY_HEIGHT)};
+	inventoryView = view_new(overlayRect, INVENTORY_WIDTH, INVENTORY_HEIGHT, 
+							 "./terminal16x16.png", 0, 0x000000ff,
+							 true, render_inventory_view, "inventory");
+	inventoryView->hidden = true;
+	list_insert_after(igViews, list_tail(igViews), inventoryView);
+
+	inGameScreen = screen_new(igViews, mapView, handle_event_in_game);
 
 	return inGameScreen;
 }
@@ -78,56 +107,93 @@ screen_show_in_game()
 internal void 
 render_game_map_view(Console *console) 
 {
-	// Setup layer render history  
-	u8 layerRendered[MAP_WIDTH][MAP_HEIGHT];
-	for (u32 x = 0; x < MAP_WIDTH; x++) {
-		for (u32 y = 0; y < MAP_HEIGHT; y++) {
-			layerRendered[x][y] = LAYER_UNSET;
-		}
+	// The map can be much bigger than the screen, so the view is a window onto 
+	// it that follows the player around (stopping at the edges of the map).
+	Position *playerPos = (Position *)game_object_get_component(player, COMP_POSITION);
+	i32 cameraLeft = 0;
+	i32 cameraTop = 0;
+	if (playerPos != NULL) {
+		cameraLeft = camera_offset(playerPos->x, VIEWPORT_WIDTH, mapWidth);
+		cameraTop = camera_offset(playerPos->y, VIEWPORT_HEIGHT, mapHeight);
 	}
 
-	// Walk the visible element list for each layer, from ground to top
-	for (int layer = LAYER_GROUND; layer <= LAYER_TOP; layer++) {
-		ListElement *e = list_head(visibilityComps);
-		while (e != NULL) {
-			Visibility *vis = (Visibility *)list_data(e);
-			Position *p = (Position *)game_object_get_component(&gameObjects[vis->objectId], COMP_POSITION);
-			if (p != NULL && p->layer == layer) {
-				if (fovMap[p->x][p->y] > 0) {
-					vis->hasBeenSeen = true;
-					console_put_char_at(console, vis->glyph, p->x, p->y, vis->fgColor, vis->bgColor);
-					layerRendered[p->x][p->y] = p->layer;
-
-				} else if (vis->visibleOutsideFOV && vis->hasBeenSeen) {
-					u32 fullColor = vis->fgColor;
-					u32 fadedColor = COLOR_FROM_RGBA(RED(fullColor), GREEN(fullColor), BLUE(fullColor), 0x77);
-					console_put_char_at(console, vis->glyph, p->x, p->y, fadedColor, 0x000000FF);
-					layerRendered[p->x][p->y] = p->layer;
+	// Each cell is drawn once, using the topmost visible object in that cell.
+	// Render cells are kept up to date as objects move, so this is a single
+	// pass over the visible part of the map rather than a walk of every object 
+	// for every layer.
+	for (i32 vx = 0; vx < VIEWPORT_WIDTH; vx++) {
+		for (i32 vy = 0; vy < VIEWPORT_HEIGHT; vy++) {
+			i32 x = cameraLeft + vx;
+			i32 y = cameraTop + vy;
+			if (!map_in_bounds(x, y)) { continue; }
+
+			// Cells the player has never seen stay blank
+			u8 flags = map_cell_flags(x, y);
+			if (!(flags & (FOV_VISIBLE | FOV_SEEN))) { continue; }
+
+			RenderCell *cell = render_cell_resolve(x, y);
+
+			// Anything lying on the ground covers up the terrain
+			Visibility *ground = render_cell_layer(cell, LAYER_GROUND);
+			if (ground == NULL) {
+				ground = (flags & CELL_WALL) ? &wallTerrain : &floorTerrain;
+			}
+
+			if (flags & FOV_VISIBLE) {
+				// In view - the top layer is drawn (fov_mark_seen() has marked it all as seen)
+				Visibility *top = NULL;
+				for (i32 layer = LAYER_TOP; (layer > LAYER_GROUND) && (top == NULL); layer--) {
+					top = render_cell_layer(cell, layer);
+				}
+				if (top == NULL) { top = ground; }
+
+				// Graphical tiles don't cover the whole cell, so keep the ground tile underneath
+				if (!console->colorize && ground != top) {
+					console_put_char_at(console, ground->glyph, vx, vy, ground->fgColor, ground->bgColor);
+				}
+				console_put_char_at(console, top->glyph, vx, vy, top->fgColor, top->bgColor);
+
+			} else {
+				// Out of view - draw the topmost thing we remember seeing, faded
+				Visibility *remembered = (flags & CELL_WALL) ? &wallTerrain : &floorTerrain;
+				for (i32 layer = LAYER_TOP; layer >= LAYER_GROUND; layer--) {
+					Visibility *vis = render_cell_layer(cell, layer);
+					if (vis != NULL && vis->visibleOutsideFOV && vis->hasBeenSeen) {
+						remembered = vis;
+						break;
+					}
 				}
+				u32 fullColor = remembered->fgColor;
+				u32 fadedColor = COLOR_FROM_RGBA(RED(fullColor), GREEN(fullColor), BLUE(fullColor), 0x77);
+				console_put_char_at(console, remembered->glyph, vx, vy, fadedColor, 0x000000FF);
 			}
-			e = list_next(e);
 		}
 	}
 }
 
+internal i32
+camera_offset(i32 target, i32 viewSize, i32 mapSize)
+{
+	// Left (or top) edge of a view of the given size centered on the target, kept within the map
+	if (mapSize <= viewSize) { return 0; }
+	i32 offset = target - (viewSize / 2);
+	if (offset < 0) { offset = 0; }
+	if (offset > mapSize - viewSize) { offset = mapSize - viewSize; }
+	return offset;
+}
+
 internal void 
 render_inventory_view(Console *console) 
 {
 	UIRect rect = {0, 0, INVENTORY_WIDTH, INVENTORY_HEIGHT};
 	view_draw_rect(console, &rect, 0x222222FF, 0, 0xFF990099);
 
-	// We should load and process the bg image only once, not on each render
-	local_persist BitmapImage *bgImage = NULL;
-	local_persist AsciiImage *aiImage = NULL;
-	if (bgImage == NULL) {
-		bgImage = image_load_from_file("./scrollBackground.png");
-		aiImage = asciify_bitmap(console, bgImage);	
-	}
-
+	// The bg image is loaded and processed only once, not on each render
+	CachedImage *bgImage = image_acquire(console, "./scrollBackground.png");
 	if (asciiMode) {
-		view_draw_ascii_image_at(console, aiImage, 0, 0);
+		view_draw_ascii_image_at(console, bgImage->ascii, 0, 0);
 	} else {
-		view_draw_image_at(console, bgImage, 0, 0);	
+		view_draw_image_at(console, bgImage->bitmap, 0, 0);	
 	}
 
 
@@ -142,8 +208,8 @@ render_inventory_view(Console *console)
 		Equipment *eq = game_object_get_component(go, COMP_EQUIPMENT);
 		if (v != NULL && eq != NULL) {
 			char *equipped = (eq->isEquipped) ? "*" : ".";
-			char *slotStr = String_Create("[%s]", eq->slot);
-			char *itemText = String_Create("%s %-10s %-8s wt: %d", equipped, v->name, slotStr, eq->weight);
+			char *slotStr = String_Frame("[%s]", eq->slot);
+			char *itemText = String_Frame("%s %-10s %-8s wt: %d", equipped, v->name, slotStr, eq->weight);
 			if (currIdx == highlightedIdx) {
 				if (eq->isEquipped) {
 					console_put_string_at(console, itemText, 6, yIdx, 0x98FB98ff, 0x80000099);
@@ -164,13 +230,11 @@ render_inventory_view(Console *console)
 	}
 
 	// Render additional information at bottom of view
-	char *weightInfo = String_Create("Carrying: %d  Max: %d", item_get_weight_carried(), maxWeightAllowed);
+	char *weightInfo = String_Frame("Carrying: %d  Max: %d", item_get_weight_carried(), maxWeightAllowed);
 	console_put_string_at(console, weightInfo, 10, 23, 0x000044ff, 0x00000000);
 
-	char *instructions = String_Create("[Up/Down] to select item");
-	char *i2 = String_Create("[Spc] to (un)equip, [D] to drop");
-	console_put_string_at(console, instructions, 5, 25, 0x333333ff, 0x00000000);
-	console_put_string_at(console, i2, 5, 26, 0x333333ff, 0x00000000);
+	console_put_string_at(console, "[Up/Down] to select item", 5, 25, 0x333333ff, 0x00000000);
+	console_put_string_at(console, "[Spc] to (un)equip, [D] to drop", 5, 26, 0x333333ff, 0x00000000);
 }
 
 internal void 
@@ -180,28 +244,23 @@ render_message_log_view(Console *console)
 	UIRect rect = {0, 0, LOG_WIDTH, LOG_HEIGHT};
 	view_draw_rect(console, &rect, 0x191919FF, 0, 0xFF990099);
 
-	if (messageLog == NULL) { return; }
-
-	// Get the last 5 messages from the log
-	ListElement *e = list_tail(messageLog);
-	i32 msgCount = list_size(messageLog);
-	u32 row = 4;
+	// Get the last 5 messages from the log (or 5 further back, if it's been scrolled)
+	i32 maxScroll = (i32)message_log_size() - LOG_HEIGHT;
+	if (messageLogScroll > maxScroll) { messageLogScroll = (maxScroll > 0) ? maxScroll : 0; }
+	i32 msgCount = (i32)message_log_size() - messageLogScroll;
+	i32 row = ((msgCount < LOG_HEIGHT) ? msgCount : LOG_HEIGHT) - 1;
 	u32 col = 1;
 
-	if (msgCount < 5) {
-		row -= (5 - msgCount);
-	} else {
-		msgCount = 5;
-	}
-
-	for (i32 i = 0; i < msgCount; i++) {
-		if (e != NULL) {
-			Message *m = (Message *)list_data(e);
-			UIRect rect = {.x = col, .y = row, .w = LOG_WIDTH, .h = 1};
-			console_put_string_in_rect(console, m->msg, rect, false, m->fgColor, 0x00000000);
-			e = list_prev(e);			
-			row -= 1;
+	for (i32 age = messageLogScroll; (age < messageLogScroll + LOG_HEIGHT) && (row >= 0); age++) {
+		Message *m = message_log_get(age);
+		if (m == NULL) { break; }
+		char *text = message_text(m);
+		if (m->repeats > 1) {
+			text = String_Frame("%s x%u", text, m->repeats);
 		}
+		UIRect rect = {.x = col, .y = row, .w = LOG_WIDTH, .h = 1};
+		console_put_string_in_rect(console, text, rect, false, m->fgColor, 0x00000000);
+		row -= 1;
 	}
 }
 
@@ -235,21 +294,17 @@ render_stats_view(Console *console)
 	}
 
 	Combat *playerCombat = game_object_get_component(player, COMP_COMBAT);
-	char *att = String_Create("ATT:%d (%d)", playerCombat->attack, playerCombat->attackModifier);
+	char *att = String_Frame("ATT:%d (%d)", playerCombat->attack, playerCombat->attackModifier);
 	console_put_string_at(console, att, 0, 2, 0xe6e600FF, 0x00000000);
-	String_Destroy(att);
 
-	char *def = String_Create("DEF:%d (%d)", playerCombat->defense, playerCombat->defenseModifier);
+	char *def = String_Frame("DEF:%d (%d)", playerCombat->defense, playerCombat->defenseModifier);
 	console_put_string_at(console, def, 0, 3, 0xe6e600FF, 0x00000000);
-	String_Destroy(def);
 
-	char *level = String_Create("Level:%d", currentLevelNumber);
+	char *level = String_Frame("Level:%d", currentLevelNumber);
 	console_put_string_at(console, level, 0, 4, 0xffd700ff, 0x00000000);
-	String_Destroy(level);
 
-	char *gems = String_Create("Gems:%d", gemsFoundTotal);
+	char *gems = String_Frame("Gems:%d", gemsFoundTotal);
 	console_put_string_at(console, gems, 10, 4, 0x753aabff, 0x00000000);
-	String_Destroy(gems);
 
 }
 
@@ -257,25 +312,16 @@ render_stats_view(Console *console)
 // Screen Functions
 
 internal void 
-hide_inventory_overlay(UIScreen *screen) 
+hide_inventory_overlay() 
 {
-	if (inventoryView != NULL) {
-		list_remove_element_with_data(screen->views, inventoryView);
-		view_destroy(inventoryView);
-		inventoryView = NULL;
-	}
+	inventoryView->hidden = true;
+	highlightedIdx = 0;
 }
 
 internal void 
-show_inventory_overlay(UIScreen *screen) 
+show_inventory_overlay() 
 {
-	if (inventoryView == NULL) {
-		UIRect overlayRect = {(16 * INVENTORY_LEFT), (16 * INVENTORY_TOP), (16 * INVENTORY_WIDTH), (16 * INVENTORY_HEIGHT)};
-		inventoryView = view_new(overlayRect, INVENTORY_WIDTH, INVENTORY_HEIGHT, 
-								   "./terminal16x16.png", 0, 0x000000ff,
-								   true, render_inventory_view);
-		list_insert_after(screen->views, list_tail(screen->views), inventoryView);
-	}
+	inventoryView->hidden = false;
 }
 
 
@@ -284,12 +330,18 @@ show_inventory_overlay(UIScreen *screen)
 internal void
 handle_event_in_game(UIScreen *activeScreen, SDL_Event event) 
 {
+	(void)activeScreen;
 
 	if (event.type == SDL_KEYDOWN) {
 		SDL_Keycode key = event.key.keysym.sym;
 
 		Position *playerPos = (Position *)game_object_get_component(player, COMP_POSITION);
 
+		// Anything but scrolling the message log takes it back to the newest messages
+		if ((key != SDLK_PAGEUP) && (key != SDLK_PAGEDOWN)) {
+			messageLogScroll = 0;
+		}
+
 		switch (key) {
 			// DEBUG
 			// case SDLK_m: {
@@ -309,7 +361,7 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 			// END DEBUG
 
 			case SDLK_UP: {
-				if (inventoryView != NULL) {
+				if (!inventoryView->hidden) {
 					// Handle for inventory view
 					highlightedIdx -= 1;
 					if (highlightedIdx < 0) { highlightedIdx = 0; }
@@ -346,7 +398,7 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 			break;
 
 			case SDLK_DOWN: {
-				if (inventoryView != NULL) {
+				if (!inventoryView->hidden) {
 					// Handle for inventory view
 					highlightedIdx += 1;
 					if (highlightedIdx > list_size(carriedItems)-1) { highlightedIdx = list_size(carriedItems) - 1; }
@@ -439,7 +491,7 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 			break;
 
 			case SDLK_d: {
-				if (inventoryView != NULL) {
+				if (!inventoryView->hidden) {
 					ListElement *le = list_item_at(carriedItems, highlightedIdx);
 					if (le != NULL) {
 						item_drop(le->data);
@@ -452,7 +504,7 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 			break;
 
 			case SDLK_e: {
-				if (inventoryView != NULL) {
+				if (!inventoryView->hidden) {
 					ListElement *le = list_item_at(carriedItems, highlightedIdx);
 					if (le != NULL) {
 						item_toggle_equip(le->data);
@@ -470,10 +522,10 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 			break;
 
 			case SDLK_i: {
-				if (inventoryView == NULL) {
-					show_inventory_overlay(activeScreen);				
+				if (inventoryView->hidden) {
+					show_inventory_overlay();				
 				} else {
-					hide_inventory_overlay(activeScreen);
+					hide_inventory_overlay();
 				}
 			}
 			break;
@@ -487,7 +539,7 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 
 			case SDLK_SPACE: {
 				// Same as equip
-				if (inventoryView != NULL) {
+				if (!inventoryView->hidden) {
 					ListElement *le = list_item_at(carriedItems, highlightedIdx);
 					if (le != NULL) {
 						item_toggle_equip(le->data);
@@ -496,9 +548,21 @@ handle_event_in_game(UIScreen *activeScreen, SDL_Event event)
 			}
 			break;
 
+			case SDLK_PAGEUP: {
+				// Scroll back through the message log (it's clamped when drawn)
+				messageLogScroll += LOG_HEIGHT;
+			}
+			break;
+
+			case SDLK_PAGEDOWN: {
+				messageLogScroll -= LOG_HEIGHT;
+				if (messageLogScroll < 0) { messageLogScroll = 0; }
+			}
+			break;
+
 			case SDLK_ESCAPE: {
-				if (inventoryView != NULL) {
-					hide_inventory_overlay(activeScreen);
+				if (!inventoryView->hidden) {
+					hide_inventory_overlay();
 				} else {
 					quit_game();
 				}
@@ -15,6 +15,10 @@
 
 
 
+global_variable UIScreen *launchScreen = NULL;
+global_variable bool launchCanContinue = false;
+
+
 internal void render_bg_view(Console *console);
 internal void render_menu_view(Console *console);
 internal void handle_event_launch(UIScreen *activeScreen, SDL_Event event);
@@ -28,24 +32,30 @@ internal UIScreen * screen_show_hof();
 internal UIScreen * 
 screen_show_launch() 
 {
+	// Only offer to continue if there's a run to continue (and not while
+	// recording, since a recording has to start from a new run)
+	launchCanContinue = save_exists() && !replay_active();
+
+	// The launch screen is built once, and reused every time it is shown
+	if (launchScreen != NULL) {
+		return launchScreen;
+	}
+
 	List *launchViews = list_new(NULL);
 
 	UIRect menuRect = {(16 * MENU_LEFT), (16 * MENU_TOP), (16 * MENU_WIDTH), (16 * MENU_HEIGHT)};
 	UIView *menuView = view_new(menuRect, MENU_WIDTH, MENU_HEIGHT,
 								 "./terminal16x16.png", 0, 0x000000ff,
-								 true, render_menu_view);
+								 true, render_menu_view, "launch_menu");
 	list_insert_after(launchViews, NULL, menuView);
 
 	UIRect bgRect = {0, 0, (16 * BG_WIDTH), (16 * BG_HEIGHT)};
 	UIView *bgView = view_new(bgRect, BG_WIDTH, BG_HEIGHT, 
 							   "./terminal16x16.png", 0, 0x000000ff,
-							   true, render_bg_view);
+							   true, render_bg_view, "launch_bg");
 	list_insert_after(launchViews, NULL, bgView);
 
-	UIScreen *launchScreen = calloc(1, sizeof(UIScreen));
-	launchScreen->views = launchViews;
-	launchScreen->activeView = menuView;
-	launchScreen->handle_event = handle_event_launch;
+	launchScreen = screen_new(launchViews, menuView, handle_event_launch);
 
 	return launchScreen;
 }
@@ -56,18 +66,12 @@ screen_show_launch()
 internal void 
 render_bg_view(Console *console)  
 {
-	// We should load and process the bg image only once, not on each render
-	local_persist BitmapImage *bgImage = NULL;
-	local_persist AsciiImage *aiImage = NULL;
-	if (bgImage == NULL) {
-		bgImage = image_load_from_file("./launch.png");
-		aiImage = asciify_bitmap(console, bgImage);	
-	}
-
+	// The bg image is loaded and processed only once, not on each render
+	CachedImage *bgImage = image_acquire(console, "./launch.png");
 	if (asciiMode) {
-		view_draw_ascii_image_at(console, aiImage, 0, 0);
+		view_draw_ascii_image_at(console, bgImage->ascii, 0, 0);
 	} else {
-		view_draw_image_at(console, bgImage, 0, 0);	
+		view_draw_image_at(console, bgImage->bitmap, 0, 0);	
 	}
 
 	console_put_string_at(console, "Dark Caverns", 52, 18, 0x556d76FF, 0x00000000);
@@ -79,8 +83,14 @@ render_menu_view(Console *console)
 	UIRect rect = {0, 0, MENU_WIDTH, MENU_HEIGHT};
 	view_draw_rect(console, &rect, 0x363247FF, 0, 0xFFFFFFFF);
 
-	console_put_string_at(console, "Start a (N)ew game", 2, 3, 0xbca285FF, 0x00000000);
-	console_put_string_at(console, "View (H)all of Fame", 2, 6, 0xbca285FF, 0x00000000);
+	if (launchCanContinue) {
+		console_put_string_at(console, "(C)ontinue your game", 2, 2, 0xbca285FF, 0x00000000);
+		console_put_string_at(console, "Start a (N)ew game", 2, 4, 0xbca285FF, 0x00000000);
+		console_put_string_at(console, "View (H)all of Fame", 2, 6, 0xbca285FF, 0x00000000);
+	} else {
+		console_put_string_at(console, "Start a (N)ew game", 2, 3, 0xbca285FF, 0x00000000);
+		console_put_string_at(console, "View (H)all of Fame", 2, 6, 0xbca285FF, 0x00000000);
+	}
 }
 
 
@@ -102,6 +112,15 @@ handle_event_launch(UIScreen *activeScreen, SDL_Event event)
 			}
 			break;
 
+			case SDLK_c: {
+				// Pick up the saved game where it left off
+				if (launchCanContinue && load_game(SAVE_FILE)) {
+					ui_set_active_screen(screen_show_in_game());
+					currentlyInGame = true;
+				}
+			}
+			break;
+
 			case SDLK_h: {
 				// Show hall of fame / credits screen
 				ui_set_active_screen(screen_show_hof());
@@ -14,6 +14,9 @@
 #define WIN_INFO_HEIGHT 20
 
 
+global_variable UIScreen *winGameScreen = NULL;
+
+
 internal void render_win_bg_view(Console *console);
 internal void render_win_info_view(Console *console);  
 internal void handle_event_win(UIScreen *activeScreen, SDL_Event event);
@@ -24,26 +27,28 @@ internal void handle_event_win(UIScreen *activeScreen, SDL_Event event);
 internal UIScreen * 
 screen_show_win_game() 
 {
+	// The win screen is built once, and reused every time it is shown
+	if (winGameScreen != NULL) {
+		return winGameScreen;
+	}
+
 	List *views = list_new(NULL);
 
 	UIRect infoRect = {(16 * WIN_INFO_LEFT), (16 * WIN_INFO_TOP), (16 * WIN_INFO_WIDTH), (16 * WIN_INFO_HEIGHT)};
 	UIView *infoView = view_new(infoRect, WIN_INFO_WIDTH, WIN_INFO_HEIGHT,
 								 "./terminal16x16.png", 0, 0x00000000, 
-                                 true, render_win_info_view);
+                                 true, render_win_info_view, "win_info");
 	list_insert_after(views, NULL, infoView);
 
 	UIRect bgRect = {0, 0, (16 * BG_WIDTH), (16 * BG_HEIGHT)};
 	UIView *bgView = view_new(bgRect, BG_WIDTH, BG_HEIGHT, 
 							   "./terminal16x16.png", 0, 0x000000ff,
-                               true, render_win_bg_view);
+                               true, render_win_bg_view, "win_bg");
 	list_insert_after(views, NULL, bgView);
 
-	UIScreen *winScreen = calloc(1, sizeof(UIScreen));
-	winScreen->views = views;
-	winScreen->activeView = bgView;
-	winScreen->handle_event = handle_event_win;
+	winGameScreen = screen_new(views, bgView, handle_event_win);
 
-	return winScreen;
+	return winGameScreen;
 }
 
 
@@ -52,18 +57,12 @@ screen_show_win_game()
 internal void 
 render_win_bg_view(Console *console)  
 {
-	// We should load and process the bg image only once, not on each render
-	local_persist BitmapImage *bgImage = NULL;
-	local_persist AsciiImage *aiImage = NULL;
-	if (bgImage == NULL) {
-		bgImage = image_load_from_file("./you_won.png");
-		aiImage = asciify_bitmap(console, bgImage);	
-	}
-
+	// The bg image is loaded and processed only once, not on each render
+	CachedImage *bgImage = image_acquire(console, "./you_won.png");
 	if (asciiMode) {
-		view_draw_ascii_image_at(console, aiImage, 0, 0);
+		view_draw_ascii_image_at(console, bgImage->ascii, 0, 0);
 	} else {
-		view_draw_image_at(console, bgImage, 0, 0);	
+		view_draw_image_at(console, bgImage->bitmap, 0, 0);	
 	}
 
     console_put_string_at(console, "Your hero is teleported back to the surface safely!", 3, 10, 0x0000bbff, 0x00000000);
@@ -78,13 +77,11 @@ render_win_info_view(Console *console)
 
 	console_put_string_at(console, playerName, 18, 2, 0xffffffff, 0x00000000);
 
-	char *level = String_Create("Level:%d", 20);
+	char *level = String_Frame("Level:%d", 20);
 	console_put_string_at(console, level, 18, 4, 0xffd700ff, 0x00000000);
-	String_Destroy(level);
 
-	char *gems = String_Create("Gems:%d", gemsFoundTotal);
+	char *gems = String_Frame("Gems:%d", gemsFoundTotal);
 	console_put_string_at(console, gems, 28, 4, 0x753aabff, 0x00000000);
-	String_Destroy(gems);
 
 	// Instructions for active commands
 	console_put_string_at(console, "View the (H)all of Fame", 16, 9, 0xbca285FF, 0x00000000);
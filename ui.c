@@ -42,6 +42,11 @@ typedef struct {
     u32 charHeight;
     asciiChar firstCharInAtlas;
 
+    // Fonts are shared between consoles through the font cache, so we track
+    // the file they came from and how many consoles are currently using them.
+    char *filename;
+    u32 refCount;
+
     // TODO: Consider chopping the atlas into BitmapImages for each cell
     // TODO: This will optimize the ASCIIfy routine, and may even help with rendering?
 
@@ -75,6 +80,12 @@ typedef struct {
     u32 cols;
 } AsciiImage;
 
+typedef struct {
+    char *filename;
+    BitmapImage *bitmap;
+    AsciiImage *ascii;          // The bitmap, asciified for the console it's drawn in
+} CachedImage;
+
 
 /* UI Types */
 struct UIScreen;
@@ -87,6 +98,9 @@ typedef struct {
     Console *console;
     UIRect *pixelRect;
     UIRenderFunction render;
+    bool hidden;
+    char *name;
+    i32 profileScope;           // Looked up the first time the view is drawn
 } UIView;
 
 struct UIScreen {
@@ -100,6 +114,15 @@ struct UIScreen {
 global_variable UIScreen *activeScreen = NULL;
 global_variable bool asciiMode = true;
 
+/* Font Cache - every font atlas loaded from disk, keyed by (filename, char size) */
+global_variable List *fontCache = NULL;
+
+/* Image Cache - every background image loaded from disk, keyed by filename */
+global_variable List *imageCache = NULL;
+
+/* Screen Registry - every screen that has been built, so they can be reused and torn down */
+global_variable List *screenRegistry = NULL;
+
 
 /* 
  *************************************************************************
@@ -115,6 +138,15 @@ ui_get_active_screen();
 internal void 
 ui_set_active_screen(UIScreen *screen);
 
+internal UIScreen *
+screen_new(List *views, UIView *activeView, UIEventHandler handler);
+
+internal void
+screen_destroy(UIScreen *screen);
+
+internal void
+ui_screens_destroy();
+
 
 internal void 
 view_destroy(UIView *view);
@@ -122,7 +154,7 @@ view_destroy(UIView *view);
 internal UIView * 
 view_new(UIRect pixelRect, u32 cellCountX, u32 cellCountY, 
          char *fontFile, asciiChar firstCharInAtlas, u32 bgColor,
-         bool colorize, UIRenderFunction renderFn);
+         bool colorize, UIRenderFunction renderFn, char *name);
 
 internal void 
 view_draw_rect(Console *console, UIRect *rect, u32 color, 
@@ -167,6 +199,19 @@ console_set_bitmap_font(Console *con, char *filename,
                         i32 charWidth, i32 charHeight);
 
 
+/* Font Functions */
+
+internal ConsoleFont *
+font_acquire(char *filename, asciiChar firstCharInAtlas, 
+             i32 charWidth, i32 charHeight);
+
+internal void
+font_release(ConsoleFont *font);
+
+internal void
+font_cache_purge();
+
+
 /* Image Functions */
 
 internal AsciiImage*
@@ -178,6 +223,12 @@ image_load_from_file(char *filename);
 internal BitmapImage *
 image_slice(BitmapImage *img, i32 rows, i32 cols);
 
+internal CachedImage *
+image_acquire(Console *console, char *filename);
+
+internal void
+image_cache_purge();
+
 internal void 
 image_analyze_colors(BitmapImage *image, u32 *primaryColor, u32 *secondaryColor);
 
@@ -221,10 +272,60 @@ ui_get_active_screen() {
 
 internal void 
 ui_set_active_screen(UIScreen *screen) {
-    if (activeScreen != NULL) { free(activeScreen); }
+    // Screens are owned by the screen registry and reused, so the 
+    // previously active screen is left intact.
     activeScreen = screen;
 }
 
+internal UIScreen *
+screen_new(List *views, UIView *activeView, UIEventHandler handler) {
+    UIScreen *screen = mem_calloc(MEM_UI, 1, sizeof(UIScreen));
+    screen->views = views;
+    screen->activeView = activeView;
+    screen->handle_event = handler;
+
+    if (screenRegistry == NULL) {
+        screenRegistry = list_new(NULL);
+    }
+    list_insert_after(screenRegistry, list_tail(screenRegistry), screen);
+
+    return screen;
+}
+
+internal void
+screen_destroy(UIScreen *screen) {
+    if (screen == NULL) { return; }
+
+    // Destroy all views (and their consoles) that belong to the screen
+    ListElement *e = list_head(screen->views);
+    while (e != NULL) {
+        view_destroy((UIView *)list_data(e));
+        e = list_next(e);
+    }
+    list_destroy(screen->views);
+
+    if (screenRegistry != NULL) {
+        list_remove_element_with_data(screenRegistry, screen);
+    }
+    if (activeScreen == screen) {
+        activeScreen = NULL;
+    }
+
+    mem_free(screen);
+}
+
+internal void
+ui_screens_destroy() {
+    // Tear down every screen we've built
+    if (screenRegistry == NULL) { return; }
+
+    while (list_size(screenRegistry) > 0) {
+        screen_destroy((UIScreen *)list_data(list_head(screenRegistry)));
+    }
+    list_destroy(screenRegistry);
+    screenRegistry = NULL;
+}
+
 /* Console Function Implementation */
 
 internal void 
@@ -238,9 +339,9 @@ console_new(i32 width, i32 height,
             i32 rowCount, i32 colCount,
             u32 bgColor, bool colorize) {
     
-    Console *con = calloc(1, sizeof(Console));
+    Console *con = mem_calloc(MEM_UI, 1, sizeof(Console));
 
-    con->pixels = calloc(width * height, sizeof(u32));
+    con->pixels = mem_calloc(MEM_UI, width * height, sizeof(u32));
     con->width = width;
     con->height = height;
     con->rowCount = rowCount;
@@ -250,16 +351,18 @@ console_new(i32 width, i32 height,
     con->font = NULL;
     con->bgColor = bgColor;
     con->colorize = colorize;
-    con->cells = calloc(rowCount * colCount, sizeof(ConsoleCell));
+    con->cells = mem_calloc(MEM_UI, rowCount * colCount, sizeof(ConsoleCell));
 
     return con;
 }
 
 internal void
 console_destroy(Console *con) {
-    if (con->pixels) { free(con->pixels); }
-    if (con->cells) { free(con->cells); }
-    if (con) { free(con); }
+    if (con == NULL) { return; }
+    if (con->pixels) { mem_free(con->pixels); }
+    if (con->cells) { mem_free(con->cells); }
+    if (con->font) { font_release(con->font); }
+    mem_free(con);
 }
 
 internal void 
@@ -326,19 +429,54 @@ console_set_bitmap_font(Console *con, char *filename,
                         asciiChar firstCharInAtlas,
                         i32 charWidth, i32 charHeight) {
 
+    // Grab the new font before letting go of the old one, so swapping a 
+    // console to the font it already has is just a refcount bump.
+    ConsoleFont *font = font_acquire(filename, firstCharInAtlas, charWidth, charHeight);
+
+    if (con->font != NULL) {
+        font_release(con->font);
+    }
+    con->font = font;
+}
+
+
+/* Font Function Implementation */
+
+internal ConsoleFont *
+font_acquire(char *filename, asciiChar firstCharInAtlas, 
+             i32 charWidth, i32 charHeight) {
+
+    if (fontCache == NULL) {
+        fontCache = list_new(NULL);
+    }
+
+    // If we've already loaded this font at this size, just share it
+    ListElement *e = list_head(fontCache);
+    while (e != NULL) {
+        ConsoleFont *f = (ConsoleFont *)list_data(e);
+        if ((f->charWidth == (u32)charWidth) && 
+            (f->charHeight == (u32)charHeight) &&
+            (f->firstCharInAtlas == firstCharInAtlas) &&
+            (strcmp(f->filename, filename) == 0)) {
+            f->refCount += 1;
+            return f;
+        }
+        e = list_next(e);
+    }
+
     // Load the image data
     int imgWidth, imgHeight, numComponents;
     unsigned char *imgData = stbi_load(filename, 
                                     &imgWidth, &imgHeight, 
                                     &numComponents, STBI_rgb_alpha);
+    assert(imgData != NULL);
 
     // Copy the image data so we can hold onto it
-    u32 imgDataSize = imgWidth * imgHeight * sizeof(u32);
-    u32 *atlasData = calloc(imgDataSize, sizeof(u32));
-    memcpy(atlasData, imgData, imgDataSize);
+    u32 pixelCount = imgWidth * imgHeight;
+    u32 *atlasData = mem_calloc(MEM_UI, pixelCount, sizeof(u32));
+    memcpy(atlasData, imgData, pixelCount * sizeof(u32));
 
     // Swap endianness of data if we need to
-    u32 pixelCount = imgWidth * imgHeight;
     if (system_is_little_endian()) {
         for (u32 i = 0; i < pixelCount; i++) {
             atlasData[i] = SWAP_U32(atlasData[i]);
@@ -353,21 +491,53 @@ console_set_bitmap_font(Console *con, char *filename,
     }        
 
     // Create and configure the font
-    ConsoleFont *font = calloc(1, sizeof(ConsoleFont));
+    ConsoleFont *font = mem_calloc(MEM_UI, 1, sizeof(ConsoleFont));
     font->atlas = atlasData;
     font->charWidth = charWidth;
     font->charHeight = charHeight;
     font->atlasWidth = imgWidth;
     font->atlasHeight = imgHeight;
     font->firstCharInAtlas = firstCharInAtlas;    
+    font->filename = mem_strdup(MEM_UI, filename);
+    font->refCount = 1;
 
     stbi_image_free(imgData);
 
-    if (con->font != NULL) {
-        free(con->font->atlas);
-        free(con->font);
+    list_insert_after(fontCache, list_tail(fontCache), font);
+
+    return font;
+}
+
+internal void
+font_release(ConsoleFont *font) {
+    // Unused fonts stay in the cache, so toggling tilesets or rebuilding a 
+    // screen never has to go back to disk. font_cache_purge() frees them.
+    if (font != NULL && font->refCount > 0) {
+        font->refCount -= 1;
+    }
+}
+
+internal void
+font_cache_purge() {
+    // Free every cached font that no console is using any longer
+    if (fontCache == NULL) { return; }
+
+    ListElement *e = list_head(fontCache);
+    while (e != NULL) {
+        ListElement *next = list_next(e);
+        ConsoleFont *font = (ConsoleFont *)list_data(e);
+        if (font->refCount == 0) {
+            list_remove(fontCache, e);
+            mem_free(font->atlas);
+            mem_free(font->filename);
+            mem_free(font);
+        }
+        e = next;
+    }
+    if (list_size(fontCache) == 0) {
+        list_destroy(fontCache);
+        fontCache = NULL;
     }
-    con->font = font;
 }
 
 
@@ -381,8 +551,8 @@ asciify_bitmap(Console *con, BitmapImage *image) {
     i32 rows = image->height / con->cellHeight;
     i32 cols = image->width / con->cellWidth;
 
-    AsciiImage *asciiImg = calloc(1, sizeof(AsciiImage));
-    asciiImg->cells = calloc(rows * cols, sizeof(ConsoleCell));
+    AsciiImage *asciiImg = mem_calloc(MEM_UI, 1, sizeof(AsciiImage));
+    asciiImg->cells = mem_calloc(MEM_UI, rows * cols, sizeof(ConsoleCell));
     asciiImg->rows = rows;
     asciiImg->cols = cols;
 
@@ -412,7 +582,8 @@ asciify_bitmap(Console *con, BitmapImage *image) {
             asciiChar glyph = image_match_glyph(con, maskImage);
 
             // We're done with the mask
-            free(maskImage);
+            mem_free(maskImage->pixels);
+            mem_free(maskImage);
 
             // printf("Best glyph: %c\n", glyph);
 
@@ -432,12 +603,11 @@ asciify_bitmap(Console *con, BitmapImage *image) {
     }
 
     // Free the memory in each cell's pixels
-	// TODO: - DEBUG
-    // for (i32 c = 0; c < (rows * cols); c++) {
-    //     BitmapImage *bm = &cells[c];
-    //     free(bm->pixels);
-    // }
-    free(cells);
+    for (i32 c = 0; c < (rows * cols); c++) {
+        BitmapImage *bm = &cells[c];
+        mem_free(bm->pixels);
+    }
+    mem_free(cells);
     return asciiImg;
 }
 
@@ -446,13 +616,13 @@ image_slice(BitmapImage *img, i32 rows, i32 cols) {
     // Slice the given image into a 2D array of image cells
     i32 cellWidth = img->width / cols;
     i32 cellHeight = img->height / rows;
-    BitmapImage *cells = calloc(rows * cols, sizeof(BitmapImage));
+    BitmapImage *cells = mem_calloc(MEM_UI, rows * cols, sizeof(BitmapImage));
     for (i32 cellY = 0; cellY < rows; cellY++) {
         for (i32 cellX = 0; cellX < cols; cellX++) {
             BitmapImage *cellBM = &cells[(cellY * cols) + cellX];
             cellBM->width = cellWidth;
             cellBM->height = cellHeight;
-            cellBM->pixels = calloc(cellWidth * cellHeight, sizeof(u32));
+            cellBM->pixels = mem_calloc(MEM_UI, cellWidth * cellHeight, sizeof(u32));
 
             for (i32 y = 0; y < cellHeight; y++) {
                 memcpy(&cellBM->pixels[y * cellWidth], 
@@ -487,8 +657,8 @@ image_analyze_colors(BitmapImage *image, u32 *primaryColor, u32 *secondaryColor)
     // The colors should be distinct enough to be distiguishable.
 
     // Step one - count color occurrences
-    u32 *colors = calloc(image->width * image->height, sizeof(u32));
-    u32 *counts = calloc(image->width * image->height, sizeof(u32));
+    u32 *colors = mem_calloc(MEM_UI, image->width * image->height, sizeof(u32));
+    u32 *counts = mem_calloc(MEM_UI, image->width * image->height, sizeof(u32));
     u32 numColors = 0;
 
     for (u32 y = 0; y < image->height; y++) {
@@ -545,8 +715,51 @@ image_analyze_colors(BitmapImage *image, u32 *primaryColor, u32 *secondaryColor)
         *secondaryColor = 0x00000000;
     }
 
-    free(colors);
-    free(counts);
+    mem_free(colors);
+    mem_free(counts);
+}
+
+internal CachedImage *
+image_acquire(Console *console, char *filename) {
+    // Background images are loaded and asciified only once, not on each render
+    if (imageCache == NULL) {
+        imageCache = list_new(NULL);
+    }
+
+    ListElement *e = list_head(imageCache);
+    while (e != NULL) {
+        CachedImage *image = (CachedImage *)list_data(e);
+        if (strcmp(image->filename, filename) == 0) {
+            return image;
+        }
+        e = list_next(e);
+    }
+
+    CachedImage *image = mem_calloc(MEM_UI, 1, sizeof(CachedImage));
+    image->filename = mem_strdup(MEM_UI, filename);
+    image->bitmap = image_load_from_file(filename);
+    image->ascii = asciify_bitmap(console, image->bitmap);
+    list_insert_after(imageCache, list_tail(imageCache), image);
+
+    return image;
+}
+
+internal void
+image_cache_purge() {
+    // Free every cached image (once the screens drawing them are gone)
+    if (imageCache == NULL) { return; }
+
+    while (list_size(imageCache) > 0) {
+        CachedImage *image = (CachedImage *)list_remove(imageCache, NULL);
+        mem_free(image->bitmap->pixels);
+        mem_free(image->bitmap);
+        mem_free(image->ascii->cells);
+        mem_free(image->ascii);
+        mem_free(image->filename);
+        mem_free(image);
+    }
+    list_destroy(imageCache);
+    imageCache = NULL;
 }
 
 internal BitmapImage*
@@ -558,19 +771,18 @@ image_load_from_file(char *filename) {
                                     &numComponents, STBI_rgb_alpha);
 
     // Copy the image data so we can hold onto it
-    u32 imgDataSize = imgWidth * imgHeight * sizeof(u32);
-    u32 *imageData = calloc(imgDataSize, sizeof(u32));
-    memcpy(imageData, imgData, imgDataSize);
+    u32 pixelCount = imgWidth * imgHeight;
+    u32 *imageData = mem_calloc(MEM_UI, pixelCount, sizeof(u32));
+    memcpy(imageData, imgData, pixelCount * sizeof(u32));
 
     // Swap endianness of data if we need to
     if (system_is_little_endian()) {
-        u32 pixelCount = imgWidth * imgHeight;
         for (u32 i = 0; i < pixelCount; i++) {
             imageData[i] = SWAP_U32(imageData[i]);
         }        
     }
 
-    BitmapImage *bmi = calloc(1, sizeof(BitmapImage));
+    BitmapImage *bmi = mem_calloc(MEM_UI, 1, sizeof(BitmapImage));
     bmi->pixels = imageData;
     bmi->width = imgWidth;
     bmi->height = imgHeight;
@@ -584,10 +796,10 @@ internal BitmapImage *
 image_mask_create(BitmapImage *origImage, u32 primaryColor, u32 secondaryColor) 
 {
     // Create a "1-bit" version of the given image
-    BitmapImage *maskImage = calloc(1, sizeof(BitmapImage));
+    BitmapImage *maskImage = mem_calloc(MEM_UI, 1, sizeof(BitmapImage));
     maskImage->width = origImage->width;
     maskImage->height = origImage->height;
-    maskImage->pixels = calloc(origImage->width * origImage->height, sizeof(u32));
+    maskImage->pixels = mem_calloc(MEM_UI, origImage->width * origImage->height, sizeof(u32));
 
     for (u32 y = 0; y < origImage->height; y++) {
         for (u32 x = 0; x < origImage->width; x++) {
@@ -649,10 +861,10 @@ image_match_glyph(Console *console, BitmapImage *maskImage) {
 internal UIView * 
 view_new(UIRect pixelRect, u32 cellCountX, u32 cellCountY, 
          char *fontFile, asciiChar firstCharInAtlas, u32 bgColor,
-         bool colorize, UIRenderFunction renderFn) {
+         bool colorize, UIRenderFunction renderFn, char *name) {
 
-    UIView *view = calloc(1, sizeof(UIView));
-    UIRect *rect = calloc(1, sizeof(UIRect));
+    UIView *view = mem_calloc(MEM_UI, 1, sizeof(UIView));
+    UIRect *rect = mem_calloc(MEM_UI, 1, sizeof(UIRect));
 
     memcpy(rect, &pixelRect, sizeof(UIRect));
     Console *console = console_new(rect->w, rect->h, cellCountY, cellCountX, 
@@ -665,6 +877,8 @@ view_new(UIRect pixelRect, u32 cellCountX, u32 cellCountY,
     view->console = console;
     view->pixelRect = rect;
     view->render = renderFn;
+    view->name = name;
+    view->profileScope = -1;
 
     return view;
 }
@@ -672,8 +886,9 @@ view_new(UIRect pixelRect, u32 cellCountX, u32 cellCountY,
 internal void 
 view_destroy(UIView *view) {
     if (view) {
-        free(view->pixelRect);
+        mem_free(view->pixelRect);
         console_destroy(view->console);
+        mem_free(view);
     }
 }
 
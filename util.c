@@ -14,11 +14,11 @@ char *fnameSuffix[] = {"ath","amm","erth","ogan","'ul","ew","xor","tar","ith","e
 char *lnamePrefix[] = {"Sword","Axe","Stone","Gold","Light","Warg","Pike","Star","Moon","Sun"};
 char *lnameSuffix[] = {"bringer","crusher","smith","slinger","smiter","hexer","caster","rider","horn","grinder"};
 
-char * name_create() {
-	i32 idx1 = rand() % PREFIX_COUNT;
-	i32 idx2 = rand() % SUFFIX_COUNT;
-	i32 idx3 = rand() % PREFIX_COUNT;
-	i32 idx4 = rand() % SUFFIX_COUNT;
+char * name_create(RNG *rng) {
+	i32 idx1 = rng_range(rng, PREFIX_COUNT);
+	i32 idx2 = rng_range(rng, SUFFIX_COUNT);
+	i32 idx3 = rng_range(rng, PREFIX_COUNT);
+	i32 idx4 = rng_range(rng, SUFFIX_COUNT);
 	char *name = String_Create("%s%s %s%s", fnamePrefix[idx1], fnameSuffix[idx2], 
 											lnamePrefix[idx3], lnameSuffix[idx4]);
 